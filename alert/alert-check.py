@@ -4,6 +4,8 @@ import requests
 
 # This file is run every hour by cron.hourly and checks the last hour of the log file for leaks and low battery status (< 12V)
 # It then emails the administrator if issues were detected
+# Leaks are also alerted immediately by the bluetooth service when the controller reports them, so this check
+# catches smaller flows which are below the controller's leak threshold
 
 LOGFILE = "/var/log/shower"
 DURATION = 3600
@@ -18,14 +20,17 @@ battery = 99	# Dummy value to ensure that the first update to the battery overwr
 # Check the values from the reading in the log
 # Params:
 #   timestamp - the time of the log entry
-#   input - The reading portion of the log entry (space separated temp, flow, voltage and solenoid state)
+#   input - The reading portion of the log entry (space separated flow, voltage, solenoid state and the volume
+#           since the previous reading, which may be followed by the range of the individual voltage samples)
 # Returns: Nothing
 #
 # Increment the volume of water detected (if the flows occur while the solenoid is closed)
 # and save the lowest battery voltage detected (if it is lower than the current lowest reading)
+# Readings are logged whenever they change rather than at a fixed interval, so the volume logged with each one
+# (from the controller's totalizer) is added up rather than the flow
+# The voltage is the controller's filtered reading, so noise in individual samples does not trigger an alert
 def check_values(timestamp, input):
 	readings = input.split(' ')
-	flow = float(readings[0])
 	volts = float(readings[1])
 	solenoid = None
 	if readings[2] == 'Open':
@@ -34,10 +39,11 @@ def check_values(timestamp, input):
 		solenoid = False
 	else:
 		raise ValueError()
+	litres = float(readings[3])
 
-	if not solenoid and flow > 0:
+	if not solenoid and litres > 0:
 		global volume
-		volume += flow / 60.0
+		volume += litres
 	global battery
 	if volts < battery:
 		battery = volts
@@ -75,7 +81,7 @@ def main():
 			if timestamp >= start_time and timestamp <= end_time:
 				if sections[1][:9] == 'Readings ':
 					check_values(timestamp, sections[1][9:])
-		except ValueError:
+		except (ValueError, IndexError):
 			pass
 
 	global volume
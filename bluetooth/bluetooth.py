@@ -4,6 +4,14 @@ from pygatt.exceptions import NotConnectedError
 import os
 import sys
 import logging
+import socket
+import struct
+import json
+import queue
+import threading
+import time
+import requests
+import frame
 
 # Bluetooth communication occurs on handle 0x12 (18 decimal), using the given MAC address and UUID
 HANDLE = 18
@@ -12,8 +20,53 @@ UUID = "0000ffe1-0000-1000-8000-00805f9b34fb"
 
 # The gatt object stores the connection to the pygatt library (and underlying gatttool process)
 gatt = pygatt.GATTToolBackend();
-# Buffer to store unprocessed input between interrupts
-input_buffer = ""
+# Decoder to store unprocessed input between interrupts and reassemble it into frames
+decoder = frame.FrameDecoder()
+
+# Calibration of the controller's sensors, used to convert the raw readings
+PULSES_PER_LITRE = 450.0					# The number of pulses from the flow sensor per litre of flow
+REFERENCE_VOLTAGE = 2.49					# The external ADC reference voltage
+ADC_RESOLUTION = 4096.0						# The number of gradations of the oversampled battery voltage readings
+VOLT_VOLTAGE_DIVIDER = 30000.0/(30000.0+200000.0)		# The resistor divider which reduces the voltage from the battery
+
+# The sequence number, flow total and controller time of the most recent telemetry frame
+# These are saved in the state file so that readings missed while the service was restarting can be requested again
+STATE_FILE = "/home/ubuntu/bluetooth/state.json"
+last_reading = None
+# The state file is written by both the notification handler and the thread writing commands
+state_lock = threading.Lock()
+# The flow total and controller time before the first missing reading, used to calculate the flow for backfilled records
+backfill_reading = None
+
+# Commands waiting to be written to the controller
+# pygatt cannot write from within the notification handler, so writes are made from a separate thread
+commands = queue.Queue()
+# The command being written waits for the controller's ACK or NACK reply, which the notification handler reports here
+reply_event = threading.Event()
+reply = None
+# The id of the most recent request (1 to 255)
+# This is saved in the state file, so the first request after a restart is not mistaken for a retry of the last one before it
+request_id = 0
+# How long to wait for a reply before retrying, and how many times to send a command before giving up
+REPLY_TIMEOUT = 1.0
+COMMAND_ATTEMPTS = 3
+
+# API key for sending alerts to IFTTT (see alert/alert-check.py)
+KEY = "pVB7OrWxiV6nd-7Kvz4m5"
+# The start time of the leak most recently alerted, so a repeated leak frame does not send another alert
+leak_alerted = None
+
+# The GUI follows the controller's shower budget and flow, which are sent to this socket after each telemetry frame
+GUI_SOCKET = "/tmp/shower-status"
+gui = socket.socket(socket.AF_UNIX, socket.SOCK_DGRAM)
+# The nearly done tune is played once the shower has this much time (ms) or volume (mL) remaining
+NEARLY_DONE_TIME = 60000
+NEARLY_DONE_VOLUME = 5000
+# Whether the most recent telemetry showed the shower open, and whether the nearly done tune has been played for it
+shower_open = False
+nearly_done = False
+# The flow total (pulses) when the shower opened, so the GUI can show the volume used in this shower
+session_total = None
 
 # Set the log file configuration
 logging.basicConfig(format='%(asctime)s - %(message)s', level=logging.DEBUG, filename="/var/log/shower")
@@ -32,44 +85,272 @@ def play_tune(tune):
 	pipe.close()
 
 
-# process_line - Process the data corresponding to one line of serial bluetooth communication
+# to_volts - Convert a battery voltage count to Volts
+# Params: count - the count reported by the controller
+# Returns: the voltage, rounded to 2 decimal places
+def to_volts(count):
+	return round(count / VOLT_VOLTAGE_DIVIDER * REFERENCE_VOLTAGE / ADC_RESOLUTION, 2)
+
+
+# log_readings - Convert readings to flow, voltage and solenoid state and log them
+# Params:
+#   readings - the tuple of readings unpacked from a telemetry or record frame
+#   previous - the readings of the preceding frame, or None if they are not known
+#   voltage_range - the lowest and highest voltage counts since the previous frame, or None if they are not known
+#   temperature - the water temperature in degrees C, or None if it is not known
+#   recorded - True if the readings were resent from the controller's log
+# Returns: Nothing
+#
+# The solenoid state is followed by the volume in litres since the previous readings, then the range of
+# the individual voltage readings and the temperature. The voltage is the controller's filtered reading.
+# The flow and volume are the change in the totalizer since the previous readings, so no water is missed if frames
+# are lost, and the volume is right however far apart the frames are (they are sent on change or on the heartbeat).
+# If the previous readings are not known (or the controller has restarted) the flow is the instantaneous rate
+# in mL/min, and the volume is 0.
+# Readings resent from the log arrive some time after they were taken, so they are followed by their sequence number
+# and the controller time (ms) when they were taken.
+def log_readings(readings, previous, voltage_range=None, temperature=None, recorded=False):
+	sequence, millis, total, rate, count, flags = readings
+	if previous is not None and total >= previous[2] and millis > previous[1]:
+		volume = round((total - previous[2]) / PULSES_PER_LITRE, 3)
+		flow = round(volume / ((millis - previous[1]) / 1000.0), 3)
+	else:
+		volume = 0
+		flow = round(rate / 60000.0, 3)
+	volts = to_volts(count)
+	solenoid = "Open" if flags & frame.FLAG_SOLENOID_OPEN else "Closed"
+	if voltage_range is not None:
+		logging.info(f'Readings {flow} {volts} {solenoid} {volume} {to_volts(voltage_range[0])} {to_volts(voltage_range[1])} {temperature}')
+	elif recorded:
+		logging.info(f'Readings {flow} {volts} {solenoid} {volume} record {sequence} at {millis}')
+	else:
+		logging.info(f'Readings {flow} {volts} {solenoid} {volume}')
+
+
+# load_state - Read the most recent readings and request id saved by save_state
+# Params: None
+# Returns: Nothing
+#
+# Older state files hold only the readings
+def load_state():
+	global last_reading, request_id
+	try:
+		with open(STATE_FILE, 'r') as file:
+			state = json.load(file)
+		if isinstance(state, dict):
+			last_reading = tuple(state['reading']) if state.get('reading') is not None else None
+			request_id = int(state.get('request_id', 0)) % 256
+		else:
+			last_reading = tuple(state)
+	except (OSError, ValueError, TypeError, KeyError):
+		last_reading = None
+
+
+# save_state - Save the most recent readings and request id so they survive a restart of the service
+# Params: None
+# Returns: Nothing
+def save_state():
+	with state_lock:
+		try:
+			with open(STATE_FILE, 'w') as file:
+				json.dump({'reading': last_reading, 'request_id': request_id}, file)
+		except OSError:
+			pass
+
+
+# publish_shower - Send the remaining budget and the flow of the shower to the GUI
+# Params:
+#   open - whether the shower is open
+#   remaining_time - the time remaining in ms, or -1 if there is no limit
+#   remaining_volume - the volume remaining in mL, or -1 if there is no limit
+#   rate - the flow rate in mL/min
+#   used - the volume used since the shower opened in mL
+# Returns: Nothing
+def publish_shower(open, remaining_time, remaining_volume, rate, used):
+	try:
+		gui.sendto(f'{int(open)} {remaining_time} {remaining_volume} {rate} {used}\n'.encode(), GUI_SOCKET)
+	except OSError:
+		pass		# The GUI is not running
+
+
+# follow_budget - Play the tunes and update the GUI as the controller uses the shower budget
+# Params:
+#   readings - the readings of the telemetry frame
+#   budget - the remaining time (ms) and volume (mL) from the telemetry frame
+# Returns: Nothing
+#
+# The controller closes the shower when its budget is used, so the start, nearly done and stop tunes
+# follow its reports rather than a timer of their own
+def follow_budget(readings, budget):
+	global shower_open, nearly_done, session_total
+	sequence, millis, total, rate, count, flags = readings
+	open = bool(flags & frame.FLAG_SOLENOID_OPEN)
+	remaining_time, remaining_volume = [-1 if value == frame.BUDGET_NONE else value for value in budget]
+	if open and not shower_open:
+		nearly_done = False
+		session_total = total
+		play_tune(1)
+	elif shower_open and not open:
+		play_tune(3)
+	if open and not nearly_done and (0 <= remaining_time <= NEARLY_DONE_TIME or 0 <= remaining_volume <= NEARLY_DONE_VOLUME):
+		nearly_done = True
+		play_tune(2)
+	shower_open = open
+	# The totalizer wraps, and restarts if the controller does, so the volume used is only known while it counts up
+	used = 0
+	if open and session_total is not None and total >= session_total:
+		used = round((total - session_total) * 1000 / PULSES_PER_LITRE)
+	publish_shower(open, remaining_time, remaining_volume, rate if open else 0, used)
+
+
+# process_telemetry - Process the payload of a telemetry frame
+# Params:
+#   payload - the bytes of the payload
+# Returns: Nothing
+#
+# Log the readings, and if the sequence number shows that readings were missed (because the link dropped
+# or the service restarted), request them from the controller's log instead. Then follow the shower budget.
+# The records requested run up to and include this frame, and are logged in its place, so the water which flowed
+# during the gap is only logged once. If the gap is longer than the log, the newest records are requested,
+# and the first of them is logged against the readings before the gap.
+# Any further flow channels (if more sensors are fitted to the controller) are logged in litres and L/min on a separate line.
+def process_telemetry(payload):
+	if len(payload) < frame.READINGS_SIZE + frame.VOLTAGE_RANGE_SIZE + frame.TEMPERATURE_SIZE + frame.BUDGET_SIZE:
+		return
+	readings = struct.unpack_from(frame.READINGS_FORMAT, payload)
+	voltage_range = struct.unpack_from(frame.VOLTAGE_RANGE_FORMAT, payload, frame.READINGS_SIZE)
+	temperature, = struct.unpack_from(frame.TEMPERATURE_FORMAT, payload, frame.READINGS_SIZE + frame.VOLTAGE_RANGE_SIZE)
+	offset = frame.READINGS_SIZE + frame.VOLTAGE_RANGE_SIZE + frame.TEMPERATURE_SIZE
+	budget = struct.unpack_from(frame.BUDGET_FORMAT, payload, offset)
+	offset += frame.BUDGET_SIZE
+	channels = [struct.unpack_from(frame.CHANNEL_FORMAT, payload, start)
+		for start in range(offset, len(payload) - frame.CHANNEL_SIZE + 1, frame.CHANNEL_SIZE)]
+	temperature = None if temperature == frame.TEMPERATURE_NONE else temperature / 16.0
+	global last_reading, backfill_reading
+	missing = 0
+	if last_reading is not None:
+		missing = (readings[0] - last_reading[0] - 1) & 0xFFFF
+	if missing > 0:
+		count = min(missing + 1, frame.LOG_RECORDS)
+		logging.info(f'Missing {missing} readings, requesting the last {count} records from the controller')
+		backfill_reading = last_reading
+		send_command(frame.COMMAND_BACKFILL, struct.pack('<HB', (readings[0] - count + 1) & 0xFFFF, count))
+	else:
+		log_readings(readings, last_reading, voltage_range, temperature)
+	if channels:
+		logging.info('Channels ' + ' '.join(f'{total / 1000.0} {rate / 1000.0}' for total, rate in channels))
+	last_reading = readings
+	save_state()
+	follow_budget(readings, budget)
+
+
+# process_record - Process the payload of a record frame
+# Params:
+#   payload - the bytes of the payload
+# Returns: Nothing
+#
+# Records are sent in order in response to a backfill request, so the flow is calculated from the previous record
+# (or the readings before the gap for the first)
+def process_record(payload):
+	if len(payload) < frame.READINGS_SIZE:
+		return
+	readings = struct.unpack_from(frame.READINGS_FORMAT, payload)
+	global backfill_reading
+	log_readings(readings, backfill_reading, recorded=True)
+	backfill_reading = readings
+
+
+# process_actuation - Process the payload of an actuation frame
+# Params:
+#   payload - the bytes of the payload
+# Returns: Nothing
+#
+# The controller sends this when the solenoid has finished changing position,
+# with the delay from the request to the start of the pulse, the pulse duration in milliseconds
+# and the id of the command which requested the change (0 if the shower budget was used)
+def process_actuation(payload):
+	if len(payload) != struct.calcsize('<IBHHB'):
+		return
+	millis, position, delay, duration, request = struct.unpack('<IBHHB', payload)
+	solenoid = "Open" if position else "Closed"
+	logging.info(f'Solenoid {solenoid} after {delay} ms delay and {duration} ms pulse (request {request})')
+
+
+# process_reply - Process the payload of an ACK or NACK frame
+# Params:
+#   type - frame.ACK or frame.NACK
+#   payload - the bytes of the payload
+# Returns: Nothing
+#
+# Pass the reply to the thread writing commands, which is waiting for it
+def process_reply(type, payload):
+	global reply
+	if len(payload) < 2:
+		return
+	reply = (type, payload[0], payload[1], payload[2] if len(payload) > 2 else 0)
+	reply_event.set()
+
+
+# trigger_alert - Send an alert to IFTTT
+# Params:
+#   event - The name of the event
+#   value - The value of the parameter associated with the event
+# Returns: Nothing
+def trigger_alert(event, value):
+	try:
+		url = f"https://maker.ifttt.com/trigger/{event}/with/key/{KEY}"
+		requests.post(url, params={"value1":f"{value}"}, timeout=10)
+	except requests.RequestException as error:
+		logging.info(f'Alert {event} could not be sent: {error}')
+
+
+# process_leak - Process the payload of a leak frame
+# Params:
+#   payload - the bytes of the payload
+# Returns: Nothing
+#
+# The controller sends this as soon as water has flowed for a few seconds while the solenoid is closed,
+# and repeats it while the leak continues. The alert is sent once per leak, on its own thread
+# so the notification handler is not held up by the network.
+def process_leak(payload):
+	if len(payload) != struct.calcsize(frame.LEAK_FORMAT):
+		return
+	millis, start, pulses, rate = struct.unpack(frame.LEAK_FORMAT, payload)
+	volume = round(pulses / PULSES_PER_LITRE, 3)
+	logging.info(f'Leak {volume} L since {(millis - start) / 1000.0} s ago at {rate / 1000.0} L/min')
+	global leak_alerted
+	if leak_alerted != start:
+		leak_alerted = start
+		threading.Thread(target=trigger_alert, args=("LeakDetected", volume), daemon=True).start()
+
+
+# process_warm - Process the payload of a warm water frame
+# Params:
+#   payload - the bytes of the payload
+# Returns: Nothing
+#
+# The controller sends this once per shower, as soon as the water reaches the warm temperature,
+# so the warm water tune is played straight away
+def process_warm(payload):
+	if len(payload) != struct.calcsize(frame.WARM_FORMAT):
+		return
+	millis, temperature, elapsed = struct.unpack(frame.WARM_FORMAT, payload)
+	logging.info(f'Warm water {temperature / 16.0} C after {elapsed / 1000.0} s')
+	play_tune(4)
+
+
+# process_diagnostics - Process the payload of a diagnostics frame
 # Params:
-#   line - the line to be processed
-# Returns: Nothing
-#
-# Each line should contain the readings for the temperature, flow, voltage and solenoid state separated by |
-# Convert them to variables and send them to the log file
-#
-# If the water has just become warm, signal the music service to play the warm water sound and set the variable
-# so that it will not be played again for this shower
-def process_line(line):
-	readings = line.split('|')
-	flow = None
-	volts = None
-	solenoid = None
-	for reading in readings:
-		if reading[:4] == 'Flow':
-			flow = float(reading[6:].split(' ')[0])
-		if reading[:6] == ' Volts':
-			volts = float(reading[7:].split(' ')[0])
-		if reading[:9] == ' Solenoid':
-			if reading[10:14] == 'Open':
-				solenoid = "Open"
-			elif reading[10:16] == 'Closed':
-				solenoid = "Closed"
-	logging.info(f'Readings {flow} {volts} {solenoid}')
-
-
-# process_buffer - Process the buffer containing the bluetooth communication data
-# Each new line in the buffer represents a complete entry, so after a carriage return/new line
-# the preceeding text can be processed
-def process_buffer():
-	global input_buffer
-	lines = input_buffer.split('\r\n')
-	if len(lines) > 1:
-		for index in range(0, len(lines)-1):
-			process_line(lines[index])
-		input_buffer = lines[len(lines)-1]
+#   payload - the bytes of the payload
+# Returns: Nothing
+#
+# Log the controller's power and communication counters, which are cumulative since it was reset
+def process_diagnostics(payload):
+	if len(payload) != struct.calcsize('<IIIHHHII'):
+		return
+	awake, idle, asleep, flow_wakes, bluetooth_wakes, actuations, bytes_in, bytes_out = struct.unpack('<IIIHHHII', payload)
+	logging.info(f'Diagnostics awake {awake / 1000.0} s (idle {idle / 1000.0} s) asleep {asleep / 1000.0} s | '
+		f'wakes flow {flow_wakes} bluetooth {bluetooth_wakes} | actuations {actuations} | bytes in {bytes_in} out {bytes_out}')
 
 
 # notification - Event handler when bluetooth communication is received from the solenoid controller
@@ -78,14 +359,25 @@ def process_buffer():
 #  values - The byte array received
 #
 # This function only responds to one handle, for receiving input
-# The values received may not contain the full message, so subsequent entries are concatenated
-# until the buffer contains enough to be processed
+# The values received may not contain the full frame, so the decoder buffers them
+# until a complete frame can be processed
 def notification(handle, values):
 	if handle == HANDLE:
-		global input_buffer
-		decoded = values.decode('ascii')
-		input_buffer += decoded
-		process_buffer()
+		for type, payload in decoder.feed(values):
+			if type == frame.TELEMETRY:
+				process_telemetry(payload)
+			elif type == frame.ACTUATION:
+				process_actuation(payload)
+			elif type == frame.RECORD:
+				process_record(payload)
+			elif type == frame.DIAGNOSTICS:
+				process_diagnostics(payload)
+			elif type == frame.WARM:
+				process_warm(payload)
+			elif type == frame.LEAK:
+				process_leak(payload)
+			elif type == frame.ACK or type == frame.NACK:
+				process_reply(type, payload)
 
 
 # subscribe - Use pygatt to create a bluetooth connection to the solenoid controller
@@ -104,16 +396,85 @@ def unsubscribe():
 	gatt.stop()
 
 
+# send_command - Queue a command to be written to the controller
+# Params:
+#   type - the command type (one of the frame.COMMAND_ constants)
+#   arguments - the bytes which follow the request id in the payload
+# Returns: Nothing
+def send_command(type, arguments=b''):
+	commands.put((type, bytes(arguments)))
+
+
+# write_command - Write a command to the controller and wait for its reply
+# Params:
+#   type - the command type
+#   arguments - the bytes which follow the request id in the payload
+# Returns: True if the command was acknowledged
+#
+# The command is sent again if no reply arrives in time (the first attempt may be lost while the controller wakes).
+# The controller acknowledges a repeated request without carrying it out twice.
+def write_command(type, arguments):
+	global request_id
+	request_id = request_id % 255 + 1
+	save_state()
+	data = frame.encode(type, bytes([request_id]) + arguments)
+	start = time.monotonic()
+	for attempt in range(COMMAND_ATTEMPTS):
+		reply_event.clear()
+		device.char_write(UUID, bytearray([0x77]))	# Wake the device with w
+		device.char_write(UUID, bytearray(data))
+		while reply_event.wait(REPLY_TIMEOUT):
+			reply_event.clear()
+			reply_type, reply_id, reply_command, reason = reply
+			if reply_id != request_id or reply_command != type:
+				continue		# A late reply to an earlier request
+			latency = round((time.monotonic() - start) * 1000)
+			if reply_type == frame.ACK:
+				logging.info(f'Command {type:#x} acknowledged after {latency} ms ({attempt + 1} attempts)')
+				return True
+			logging.info(f'Command {type:#x} rejected: {frame.NACK_REASONS.get(reason, reason)}')
+			return False
+	logging.info(f'Command {type:#x} was not acknowledged after {COMMAND_ATTEMPTS} attempts')
+	return False
+
+
+# handle_commands - Write queued commands to the controller
+# Params: None
+# Returns: Nothing
+#
+# Runs on its own thread until quit is requested
+def handle_commands():
+	while not quit:
+		try:
+			type, arguments = commands.get(timeout=1)
+		except queue.Empty:
+			continue
+		write_command(type, arguments)
+
+
 # handle_input - Process the command received through the temporary file
 # Params: line - the string containing the command
 # Returns: Nothing
+#
+# The open command may be followed by the budget of the shower in seconds and litres (0 for no limit),
+# otherwise the controller uses its shower duration
 def handle_input(line):
-	if line == 'O':
-		# Schedule the starting, nearly done and stop tunes
-		play_tune(1)
-		# Start the shower - send the command to the shower-bluetooth service
-		device.char_write(UUID, bytearray([0x77]))	# Wake the device with w
-		device.char_write(UUID, bytearray([0x6f]))	# Send the command o
+	words = line.split()
+	if words and words[0] == 'O':
+		# Start the shower (the tunes are played as the controller reports the shower opening and closing)
+		if len(words) == 3:
+			try:
+				send_command(frame.COMMAND_OPEN, struct.pack('<II', int(words[1]) * 1000, int(float(words[2]) * 1000)))
+			except (ValueError, struct.error):
+				logging.info(f'Invalid shower budget {line}')
+		else:
+			send_command(frame.COMMAND_OPEN)
+	elif line == 'D':
+		# Request the diagnostic counters, which will be written to the log
+		send_command(frame.COMMAND_DIAGNOSTICS)
+	elif line == 'S':
+		# Request the current readings
+		send_command(frame.COMMAND_STATUS)
 
 
 # main - The service runs this on startup
@@ -131,8 +492,14 @@ def main():
 		global quit
 		quit = False
 
-		# Establish a connection to the solenoid controller
+		# Restore the most recent readings so any missed while the service was stopped can be requested,
+		# and the request id so new requests follow on from those before the restart
+		load_state()
+
+		# Establish a connection to the solenoid controller, and start writing commands to it
 		subscribe()
+		writer = threading.Thread(target=handle_commands, daemon=True)
+		writer.start()
 
 		# Monitor the temporary file for commands from the GUI
 		# First ensure it exists, then open it
@@ -0,0 +1,144 @@
+# Decoder for the binary frames sent by the solenoid controller (see shower_timer.ino)
+#
+# Each frame has the layout
+#   SYNC | VERSION | TYPE | LENGTH | PAYLOAD (LENGTH bytes) | CRC (2 bytes)
+# The CRC-16/CCITT covers everything after the SYNC byte. All multi-byte fields are little endian.
+
+SYNC = 0xA5
+VERSION = 7
+HEADER_SIZE = 4
+MAX_PAYLOAD = 48
+CRC_SIZE = 2
+
+# Frame types
+TELEMETRY = 0x01
+ACTUATION = 0x02
+RECORD = 0x03
+DIAGNOSTICS = 0x04
+ACK = 0x05
+NACK = 0x06
+LEAK = 0x07
+WARM = 0x08
+
+# The readings at the start of a telemetry payload, which are also the payload of a record frame:
+#   sequence, millis, flow total, flow rate (mL/min), voltage count, flags
+READINGS_FORMAT = '<HIIHHB'
+READINGS_SIZE = 15
+
+# The battery voltage range which follows the readings in a telemetry payload: lowest and highest voltage count
+VOLTAGE_RANGE_FORMAT = '<HH'
+VOLTAGE_RANGE_SIZE = 4
+
+# The water temperature which follows the voltage range, in 1/16 degrees C (TEMPERATURE_NONE if the sensor could not be read)
+TEMPERATURE_FORMAT = '<h'
+TEMPERATURE_SIZE = 2
+TEMPERATURE_NONE = -32768
+
+# The remaining budget of the open shower which follows the temperature: time (ms) and volume (mL)
+# Both are 0 while the shower is closed. The volume is BUDGET_NONE when it has no limit, while the time always has one
+# (a shower opened without a time limit is closed after the controller's longest shower duration)
+BUDGET_FORMAT = '<II'
+BUDGET_SIZE = 8
+BUDGET_NONE = 0xFFFFFFFF
+
+# Each further flow channel follows the budget: flow total (mL) and flow rate (mL/min)
+# The first channel is the water through the solenoid, which is in the readings (in pulses)
+CHANNEL_FORMAT = '<IH'
+CHANNEL_SIZE = 6
+
+# The payload of a leak frame: controller time, time the leak started, pulses since it started, flow rate (mL/min)
+LEAK_FORMAT = '<IIIH'
+
+# The payload of a warm water frame: controller time, temperature (1/16 degrees C), time since the shower started (ms)
+WARM_FORMAT = '<IhI'
+
+# The number of records kept in the controller's log, so the oldest sequence number that can be requested again
+LOG_RECORDS = 64
+
+# Command types, sent in frames with the same layout. The first byte of each command payload is a request id
+# (1 to 255) which the controller returns in the ACK or NACK reply: request id, command type [, reason]
+COMMAND_OPEN = 0x81             # optionally the budget, time in milliseconds and volume in millilitres '<II' (0 for no limit)
+COMMAND_CLOSE = 0x82
+COMMAND_STATUS = 0x83
+COMMAND_SET_DURATION = 0x84     # duration in milliseconds '<I'
+COMMAND_SET_REPORTING = 0x85    # sensor interval and heartbeat interval in milliseconds '<HI', optionally followed by
+                                # the flow (pulses), rate (mL/min), voltage (count) and temperature (1/16 C) deadbands '<HHHH'
+COMMAND_DIAGNOSTICS = 0x86
+COMMAND_BACKFILL = 0x87         # first sequence number and number of records '<HB'
+
+# Reasons for a NACK reply
+NACK_REASONS = {1: 'unknown command', 2: 'bad length', 3: 'bad value'}
+
+# Bits in the flags byte of the telemetry frame
+FLAG_SOLENOID_OPEN = 0x01
+FLAG_LOW_BATTERY = 0x02
+FLAG_SOLENOID_MOVING = 0x04
+FLAG_FLOWING = 0x08
+FLAG_EVENT = 0x10
+FLAG_LEAK = 0x20
+FLAG_WARM = 0x40
+
+
+# crc16 - Calculate the CRC-16/CCITT checksum used by the controller
+# Params: data - the bytes to check
+# Returns: the 16 bit checksum
+def crc16(data):
+	crc = 0xFFFF
+	for byte in data:
+		crc ^= byte << 8
+		for i in range(8):
+			if crc & 0x8000:
+				crc = ((crc << 1) ^ 0x1021) & 0xFFFF
+			else:
+				crc = (crc << 1) & 0xFFFF
+	return crc
+
+
+# encode - Build a frame to send to the controller
+# Params:
+#   type - the frame type
+#   payload - the payload bytes
+# Returns: the frame as bytes
+def encode(type, payload):
+	body = bytes([VERSION, type, len(payload)]) + payload
+	crc = crc16(body)
+	return bytes([SYNC]) + body + bytes([crc & 0xFF, crc >> 8])
+
+
+# Class to reassemble frames from the bluetooth notifications
+# Notifications may contain part of a frame, or several frames, so received bytes are buffered
+# until a complete frame is available. Corrupt frames and unknown versions are skipped by searching
+# for the next SYNC byte.
+class FrameDecoder:
+	# feed - Add received bytes and return the complete frames
+	# Params: data - the bytes received
+	# Returns: a list of (type, payload) tuples
+	def feed(self, data):
+		self.buffer += data
+		frames = []
+		while True:
+			start = self.buffer.find(SYNC)
+			if start < 0:
+				self.buffer.clear()
+				break
+			del self.buffer[:start]
+			if len(self.buffer) < HEADER_SIZE:
+				break
+			length = self.buffer[3]
+			if length > MAX_PAYLOAD:
+				del self.buffer[:1]
+				continue
+			size = HEADER_SIZE + length + CRC_SIZE
+			if len(self.buffer) < size:
+				break
+			crc = self.buffer[size-2] | (self.buffer[size-1] << 8)
+			if self.buffer[1] == VERSION and crc16(self.buffer[1:size-2]) == crc:
+				frames.append((self.buffer[2], bytes(self.buffer[HEADER_SIZE:size-2])))
+				del self.buffer[:size]
+			else:
+				# Not a valid frame, so resynchronise from the next byte
+				del self.buffer[:1]
+		return frames
+
+	def __init__(self):
+		self.buffer = bytearray()
@@ -0,0 +1,141 @@
+#include "fb_display.h"
+#include "rgb565.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/fb.h>
+
+/* Measure the time to flush and fill with each set of rgb565 kernels, and with lv_drivers' fbdev_flush.
+ * The framebuffers are in memory, so this runs on the test host as well as the Raspberry Pi.
+ * fbdev.c is compiled into this file with open, ioctl and mmap replaced, so fbdev_init maps memory rather than /dev/fb0.
+ */
+
+#define WIDTH LV_HOR_RES_MAX
+#define HEIGHT LV_VER_RES_MAX
+#define REPEATS 200
+
+static uint32_t framebuffer[WIDTH * HEIGHT];		// Large enough for XRGB8888
+static lv_color_t draw_buffer[WIDTH * HEIGHT];
+static lv_disp_drv_t driver;
+
+static int bench_open(const char* path, int flags, ...)
+{
+  return 0;
+}
+
+static int bench_ioctl(int fd, unsigned long request, ...)
+{
+  va_list args;
+  va_start(args, request);
+  void* info = va_arg(args, void*);
+  va_end(args);
+
+  if (request == FBIOGET_VSCREENINFO) {
+    struct fb_var_screeninfo* vinfo = info;
+    memset(vinfo, 0, sizeof(*vinfo));
+    vinfo->xres = vinfo->xres_virtual = WIDTH;
+    vinfo->yres = vinfo->yres_virtual = HEIGHT;
+    vinfo->bits_per_pixel = 16;
+  } else if (request == FBIOGET_FSCREENINFO) {
+    struct fb_fix_screeninfo* finfo = info;
+    memset(finfo, 0, sizeof(*finfo));
+    finfo->line_length = WIDTH * 2;
+    finfo->smem_len = WIDTH * HEIGHT * 2;
+  }
+  return 0;
+}
+
+static void* bench_mmap(void* address, size_t length, int protection, int flags, int fd, off_t offset)
+{
+  return framebuffer;
+}
+
+#define open bench_open
+#define ioctl bench_ioctl
+#define mmap bench_mmap
+#include "lvgl/lv_drivers/display/fbdev.c"
+#undef open
+#undef ioctl
+#undef mmap
+
+// The benchmark does not link LVGL, so the driver only needs to be told the flush is complete
+void lv_disp_flush_ready(lv_disp_drv_t* drv)
+{
+}
+
+static double now_ms(void)
+{
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec * 1000.0 + time.tv_nsec / 1000000.0;
+}
+
+/* time_flush - Time flushing an area
+ * Params:
+ *  flush - the flush callback
+ *  area - the area
+ * Returns: the average time in ms
+ */
+static double time_flush(void (*flush)(lv_disp_drv_t*, const lv_area_t*, lv_color_t*), const lv_area_t* area)
+{
+  double start = now_ms();
+  for (int i = 0; i < REPEATS; i++)
+    flush(&driver, area, draw_buffer);
+  return (now_ms() - start) / REPEATS;
+}
+
+static double time_fill(const lv_area_t* area)
+{
+  double start = now_ms();
+  for (int i = 0; i < REPEATS; i++)
+    fb_display_fill(&driver, draw_buffer, WIDTH, area, lv_color_make(i, 0x80, 0x40));
+  return (now_ms() - start) / REPEATS;
+}
+
+int main(void)
+{
+  const lv_area_t screen = { 0, 0, WIDTH - 1, HEIGHT - 1 };
+  const lv_area_t button = { 40, 200, 199, 259 };	// The size of the buttons on the shower screen
+  const lv_area_t* areas[] = { &screen, &button };
+  const char* names[] = { "screen", "button" };
+
+  for (int i = 0; i < WIDTH * HEIGHT; i++)
+    draw_buffer[i].full = rand();
+
+  rgb565_init();
+  fbdev_init();
+  printf("%-20s %-7s %10s %10s\n", "kernel", "area", "ms", "Mpixel/s");
+
+  for (int a = 0; a < 2; a++) {
+    int pixels = lv_area_get_width(areas[a]) * lv_area_get_height(areas[a]);
+    double time = time_flush(fbdev_flush, areas[a]);
+    printf("%-20s %-7s %10.4f %10.1f\n", "fbdev_flush", names[a], time, pixels / time / 1000);
+
+    for (int k = 0; k < rgb565_get_count(); k++) {
+      char name[32];
+      rgb565 = rgb565_get_kernels(k);
+
+      fb_display_attach(framebuffer, WIDTH, HEIGHT, 16, WIDTH * 2);
+      time = time_flush(fb_display_flush, areas[a]);
+      snprintf(name, sizeof(name), "%s copy", rgb565->name);
+      printf("%-20s %-7s %10.4f %10.1f\n", name, names[a], time, pixels / time / 1000);
+
+      fb_display_attach(framebuffer, WIDTH, HEIGHT, 32, WIDTH * 4);
+      time = time_flush(fb_display_flush, areas[a]);
+      snprintf(name, sizeof(name), "%s xrgb8888", rgb565->name);
+      printf("%-20s %-7s %10.4f %10.1f\n", name, names[a], time, pixels / time / 1000);
+
+      time = time_fill(areas[a]);
+      snprintf(name, sizeof(name), "%s fill", rgb565->name);
+      printf("%-20s %-7s %10.4f %10.1f\n", name, names[a], time, pixels / time / 1000);
+    }
+  }
+
+  return 0;
+}
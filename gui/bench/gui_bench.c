@@ -0,0 +1,255 @@
+#include "lvgl/lvgl.h"
+#include "user.h"
+#include "main_screen.h"
+#include "login_screen.h"
+#include "shower_screen.h"
+#include "blank_screen.h"
+#include "usage_screen.h"
+#include "usage.h"
+#include "fb_display.h"
+#include "rgb565.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Run the GUI's screens without a display or touchscreen, and measure how they perform
+ * LVGL draws into a framebuffer in memory and reads touches from a script, such as bench/shower.script, with the commands
+ *  step name - start a new interaction, which is reported separately
+ *  tap x y - press the screen at x, y for 50ms, then wait 250ms
+ *  wait ms - let time pass
+ * Time is simulated, so the script runs as fast as LVGL can draw, and the results do not depend on the machine's load.
+ * For each interaction the frames drawn and the CPU time are reported, then the frame rate and the peak LVGL heap.
+ *
+ * Usage: gui_bench [-u users] [script]
+ * The users file is copied, so the showers the script starts are not saved in it, and shower commands and usage go to temporary files.
+ */
+
+#define STEP 5			// The simulated time for each pass through the loop in ms
+#define PRESS_TIME 50
+#define RELEASE_TIME 250
+#define MAX_LINE 128
+
+struct timespec watchdog;		// Used by the screens' click handlers
+bool screensaver_active;
+
+// Display buffer, as in main.c
+#define BUFFER_SIZE 16384
+static lv_disp_draw_buf_t disp_buf;
+static lv_color_t buf_1[BUFFER_SIZE];
+static lv_color_t buf_2[BUFFER_SIZE];
+static uint16_t framebuffer[LV_HOR_RES_MAX * LV_VER_RES_MAX];
+
+static lv_point_t touch_point;
+static bool touch_pressed;
+
+static uint32_t frames;			// Frames drawn in the current interaction
+static int64_t render_time;		// Time spent in lv_timer_handler in the current interaction, in ns
+static uint32_t total_frames;
+static int64_t total_render_time;
+
+static int64_t now_ns(clockid_t clock)
+{
+  struct timespec time;
+  clock_gettime(clock, &time);
+  return (int64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+// Count each frame when its last area is flushed
+static void counting_flush(lv_disp_drv_t* drv, const lv_area_t* area, lv_color_t* color_p)
+{
+  if (lv_disp_flush_is_last(drv))
+    frames++;
+  fb_display_flush(drv, area, color_p);
+}
+
+static void scripted_read(lv_indev_drv_t* drv, lv_indev_data_t* data)
+{
+  data->point = touch_point;
+  data->state = touch_pressed ? LV_INDEV_STATE_PRESSED : LV_INDEV_STATE_RELEASED;
+}
+
+/* run - Run LVGL for a simulated time
+ * Params: ms - the time in ms
+ * Returns: Nothing
+ */
+static void run(uint32_t ms)
+{
+  for (uint32_t elapsed = 0; elapsed < ms; elapsed += STEP) {
+    lv_tick_inc(STEP);
+    int64_t start = now_ns(CLOCK_MONOTONIC);
+    lv_timer_handler();
+    render_time += now_ns(CLOCK_MONOTONIC) - start;
+  }
+}
+
+/* report - Print the results of an interaction, and start the next
+ * Params:
+ *  name - the interaction, or NULL if there was none
+ *  cpu_start - the process CPU time when it started, which is reset
+ * Returns: Nothing
+ */
+static void report(const char* name, int64_t* cpu_start)
+{
+  int64_t cpu = now_ns(CLOCK_PROCESS_CPUTIME_ID);
+  if (name != NULL)
+    printf("%-20s %8u %12.3f %12.3f\n", name, frames, (cpu - *cpu_start) / 1e6, render_time / 1e6);
+
+  total_frames += frames;
+  total_render_time += render_time;
+  frames = 0;
+  render_time = 0;
+  *cpu_start = cpu;
+}
+
+/* copy_file - Copy a file to a new temporary file
+ * Params:
+ *  path - the file to copy
+ *  copy - the template for mkstemp, which is set to the name of the copy
+ * Returns: true if the file was copied
+ */
+static bool copy_file(const char* path, char* copy)
+{
+  char buffer[4096];
+  size_t size;
+
+  FILE* in = fopen(path, "r");
+  int fd = mkstemp(copy);
+  if (in == NULL || fd < 0) {
+    if (in != NULL)
+      fclose(in);
+    return false;
+  }
+  FILE* out = fdopen(fd, "w");
+  while ((size = fread(buffer, 1, sizeof(buffer), in)) > 0)
+    fwrite(buffer, 1, size, out);
+  fclose(in);
+  fclose(out);
+  return true;
+}
+
+int main(int argc, char** argv)
+{
+  const char* users_path = "users";
+  const char* script_path = "bench/shower.script";
+  char users_copy[] = "/tmp/gui_bench_users.XXXXXX";
+  char control_copy[] = "/tmp/gui_bench_shower.XXXXXX";
+  char usage_copy[] = "/tmp/gui_bench_usage.XXXXXX";
+  int option;
+
+  while ((option = getopt(argc, argv, "u:")) != -1) {
+    if (option == 'u') {
+      users_path = optarg;
+    } else {
+      fprintf(stderr, "Usage: %s [-u users] [script]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (optind < argc)
+    script_path = argv[optind];
+
+  FILE* script = fopen(script_path, "r");
+  if (script == NULL) {
+    fprintf(stderr, "Unable to open the script %s\n", script_path);
+    return 1;
+  }
+  if (!copy_file(users_path, users_copy)) {
+    fprintf(stderr, "Unable to copy the users file %s\n", users_path);
+    return 1;
+  }
+  int control_fd = mkstemp(control_copy);
+  if (control_fd >= 0)
+    close(control_fd);
+  int usage_fd = mkstemp(usage_copy);
+  if (usage_fd >= 0)
+    close(usage_fd);
+
+  lv_init();
+  rgb565_init();
+  clock_gettime(CLOCK_REALTIME, &watchdog);
+  screensaver_active = false;
+
+  fb_display_attach(framebuffer, LV_HOR_RES_MAX, LV_VER_RES_MAX, 16, LV_HOR_RES_MAX * sizeof(uint16_t));
+  lv_disp_draw_buf_init(&disp_buf, buf_1, buf_2, BUFFER_SIZE);
+
+  lv_disp_drv_t disp_drv;
+  lv_disp_drv_init(&disp_drv);
+  disp_drv.flush_cb = counting_flush;
+  disp_drv.gpu_fill_cb = fb_display_fill;
+  disp_drv.draw_buf = &disp_buf;
+  disp_drv.hor_res = LV_HOR_RES_MAX;
+  disp_drv.ver_res = LV_VER_RES_MAX;
+  lv_disp_drv_register(&disp_drv);
+
+  lv_indev_drv_t indev_drv;
+  lv_indev_drv_init(&indev_drv);
+  indev_drv.type = LV_INDEV_TYPE_POINTER;
+  indev_drv.read_cb = scripted_read;
+  lv_indev_drv_register(&indev_drv);
+
+  user_set_file(users_copy);
+  user_load();
+  shower_screen_set_control_file(control_copy);
+  usage_set_file(usage_copy);
+  usage_load();
+
+  int64_t cpu_start = now_ns(CLOCK_PROCESS_CPUTIME_ID);
+  lv_obj_t* scr_mainscreen = main_screen_create(NULL);
+  main_screen_update_users(scr_mainscreen);
+  lv_obj_t* scr_loginscreen = login_screen_create(NULL);
+  lv_obj_t* scr_showerscreen = shower_screen_create(NULL);
+  lv_obj_t* scr_blankscreen = blank_screen_create(NULL);
+  usage_screen_create(NULL, USAGE_DAILY);
+  usage_screen_create(NULL, USAGE_WEEKLY);
+
+  login_screen_set_main_screen(scr_mainscreen);
+  login_screen_set_shower_screen(scr_showerscreen);
+  main_screen_set_login_screen(scr_loginscreen);
+  main_screen_set_blank_screen(scr_blankscreen);
+  shower_screen_set_main_screen(scr_mainscreen);
+  usage_screen_set_return_screen(scr_showerscreen);
+
+  lv_scr_load(scr_mainscreen);
+  run(RELEASE_TIME);
+
+  printf("%-20s %8s %12s %12s\n", "interaction", "frames", "cpu ms", "render ms");
+  report("start", &cpu_start);
+
+  char line[MAX_LINE];
+  char name[MAX_LINE] = "";
+  int x, y;
+  unsigned int ms;
+  while (fgets(line, sizeof(line), script) != NULL) {
+    line[strcspn(line, "#\r\n")] = '\0';
+    if (strncmp(line, "step ", 5) == 0) {
+      report(name[0] != '\0' ? name : NULL, &cpu_start);
+      snprintf(name, sizeof(name), "%s", line + 5);
+    } else if (sscanf(line, " tap %d %d", &x, &y) == 2) {
+      touch_point.x = x;
+      touch_point.y = y;
+      touch_pressed = true;
+      run(PRESS_TIME);
+      touch_pressed = false;
+      run(RELEASE_TIME);
+    } else if (sscanf(line, " wait %u", &ms) == 1) {
+      run(ms);
+    } else if (strspn(line, " \t") != strlen(line)) {
+      fprintf(stderr, "Unknown command in %s: %s\n", script_path, line);
+    }
+  }
+  report(name[0] != '\0' ? name : NULL, &cpu_start);
+  fclose(script);
+
+  lv_mem_monitor_t monitor;
+  lv_mem_monitor(&monitor);
+  printf("\n%u frames at %.1f frames per second of render time\n", total_frames,
+         total_render_time > 0 ? total_frames * 1e9 / total_render_time : 0.0);
+  printf("Peak LVGL heap %u of %u bytes\n", (unsigned int)monitor.max_used, (unsigned int)monitor.total_size);
+
+  unlink(users_copy);
+  unlink(control_copy);
+  unlink(usage_copy);
+  return 0;
+}
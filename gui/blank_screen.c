@@ -1,14 +1,43 @@
 #include "blank_screen.h"
 #include "logger.h"
+#if USE_DRM
+#include "drm_display.h"
+#endif
 #include "lvgl/src/misc/lv_color.h"
 #include <unistd.h>
 #include <time.h>
 #include <stdio.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <linux/fb.h>
 
+#define FRAMEBUFFER "/dev/fb0"
+
+static lv_obj_t* scr_blankscreen;
 static lv_obj_t* scr_returnscreen;
+static lv_timer_t* check_timer;		// The timer which activates the screensaver, paused while it is active
+static bool panel_blanked;		// Whether the panel is powered down, with rendering paused
 extern struct timespec watchdog;
 extern bool screensaver_active;
 
+/* set_panel_blank - Power the panel (and its backlight) down or up through the DRM or framebuffer driver
+ * Params: blank - true to power down, false to power up
+ * Returns: true if the driver changed the panel
+ */
+static bool set_panel_blank(bool blank)
+{
+#if USE_DRM
+  if (drm_display_blank(blank))
+    return true;
+#endif
+  int fd = open(FRAMEBUFFER, O_RDWR | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+  bool changed = ioctl(fd, FBIOBLANK, blank ? FB_BLANK_POWERDOWN : FB_BLANK_UNBLANK) == 0;
+  close(fd);
+  return changed;
+}
+
 static void event_handler(lv_obj_t* obj, lv_event_t event)
 {
   if (event == LV_EVENT_CLICKED) {
@@ -16,6 +45,17 @@ static void event_handler(lv_obj_t* obj, lv_event_t event)
       log_info("GUI", "Deactivating screen saver");
       clock_gettime(CLOCK_REALTIME, &watchdog);
       lv_scr_load(scr_returnscreen);
+      if (panel_blanked) {
+        // Power the panel up first, as DRM page flips do not complete while it is off.
+        // The framebuffer may not have kept its contents, so then draw the whole screen once
+        set_panel_blank(false);
+        panel_blanked = false;
+        lv_timer_resume(lv_disp_get_default()->refr_timer);
+        lv_obj_invalidate(scr_returnscreen);
+        lv_refr_now(NULL);
+      }
+      if (check_timer != NULL)
+        lv_timer_resume(check_timer);
       screensaver_active = false;
     } else {
       printf("Returnscreen is NULL in shower_screen\n");
@@ -35,12 +75,44 @@ lv_obj_t* blank_screen_create(lv_obj_t* parent)
 
   lv_obj_add_event_cb(screen, event_handler, NULL);
 
+  scr_blankscreen = screen;
   scr_returnscreen = NULL;
+  check_timer = NULL;
+  panel_blanked = false;
 
   return screen;
 }
 
-void blank_screen_set_return_screen(lv_obj_t* returnscreen)
+/* blank_screen_set_check_timer - Set the timer which activates the screensaver
+ * Params: timer - the timer, which is paused while the screensaver is active
+ * Returns: Nothing
+ */
+void blank_screen_set_check_timer(lv_timer_t* timer)
 {
-  scr_returnscreen = returnscreen;
+  check_timer = timer;
+}
+
+/* blank_screen_activate - Start the screensaver
+ * Params: None
+ * Returns: Nothing
+ *
+ * The blank screen is loaded so the touch which wakes the screen does not press a button.
+ * If the panel can be powered down nothing is rendered until then, so the GUI only wakes for input.
+ * Otherwise the blank screen is shown as a black screen.
+ */
+void blank_screen_activate(void)
+{
+  log_info("GUI", "Activating the screensaver");
+  screensaver_active = true;
+  scr_returnscreen = lv_scr_act();
+  if (check_timer != NULL)
+    lv_timer_pause(check_timer);
+  lv_scr_load(scr_blankscreen);
+
+  if (set_panel_blank(true)) {
+    panel_blanked = true;
+    lv_timer_pause(lv_disp_get_default()->refr_timer);
+  } else {
+    log_info("GUI", "Unable to power down the panel, showing a black screen instead");
+  }
 }
@@ -4,6 +4,7 @@
 #include "lvgl/lvgl.h"
 
 lv_obj_t* blank_screen_create(lv_obj_t* parent);
-void blank_screen_set_return_screen(lv_obj_t* returnscreen);
+void blank_screen_set_check_timer(lv_timer_t* timer);
+void blank_screen_activate(void);
 
 #endif
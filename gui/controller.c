@@ -0,0 +1,156 @@
+#include "controller.h"
+#include "logger.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* The solenoid controller enforces the shower budget, and reports what remains in every telemetry frame.
+ * The Bluetooth service forwards each report to this socket as a datagram with the text
+ *   open remaining_ms remaining_ml rate_ml_min used_ml
+ * where a remaining budget of -1 has no limit, and used_ml is the volume since the shower opened.
+ * The GUI follows these reports rather than keeping its own timer.
+ */
+
+#define CONTROLLER_TIMEOUT 30	// If no report arrives for 30 seconds, the Bluetooth service has stopped and the shower is closed
+
+static int controller_fd = -1;
+static bool shower_open;		// The state from the most recent report
+static long remaining_ms;
+static long remaining_ml;
+static long flow_rate;			// mL/min
+static long volume_used;		// mL
+static struct timespec received;	// When the most recent report arrived (CLOCK_MONOTONIC)
+static struct timespec opened;		// When the first report of the open shower arrived (CLOCK_MONOTONIC)
+static void (*session_handler)(int millilitres, int seconds);
+
+/* elapsed_ms - Get the time since the most recent report
+ * Params: None
+ * Returns: the time in milliseconds
+ */
+static long elapsed_ms(void)
+{
+  struct timespec current_time;
+  clock_gettime(CLOCK_MONOTONIC, &current_time);
+  return (current_time.tv_sec - received.tv_sec) * 1000 + (current_time.tv_nsec - received.tv_nsec) / 1000000;
+}
+
+/* controller_init - Create the socket which receives the controller state
+ * Params: None
+ * Returns: Nothing
+ *
+ * The socket is non-blocking, so controller_poll returns straight away when nothing has arrived
+ */
+void controller_init(void)
+{
+  struct sockaddr_un address;
+
+  shower_open = false;
+  controller_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (controller_fd < 0) {
+    log_info("GUI", "Unable to create the controller socket");
+    return;
+  }
+
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path, CONTROLLER_SOCKET, sizeof(address.sun_path) - 1);
+  unlink(CONTROLLER_SOCKET);
+  if (bind(controller_fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+    log_info("GUI", "Unable to bind the controller socket");
+    close(controller_fd);
+    controller_fd = -1;
+  }
+}
+
+/* controller_poll - Read the reports which have arrived since the last poll
+ * Params: None
+ * Returns: Nothing
+ *
+ * Only the most recent report is kept, except that the session handler is called when a report shows the shower has closed,
+ * with the volume from the last report before it closed
+ */
+void controller_poll(void)
+{
+  char buffer[64];
+  ssize_t size;
+  int open;
+  long time, volume, rate, used;
+
+  if (controller_fd < 0)
+    return;
+
+  while ((size = recv(controller_fd, buffer, sizeof(buffer) - 1, 0)) > 0) {
+    buffer[size] = '\0';
+    if (sscanf(buffer, "%d %ld %ld %ld %ld", &open, &time, &volume, &rate, &used) != 5)
+      continue;
+    clock_gettime(CLOCK_MONOTONIC, &received);
+    if (open && !shower_open) {
+      opened = received;
+    } else if (!open && shower_open && session_handler != NULL) {
+      session_handler(volume_used, received.tv_sec - opened.tv_sec);
+    }
+    shower_open = open != 0;
+    remaining_ms = time;
+    remaining_ml = volume;
+    flow_rate = rate;
+    volume_used = used;
+  }
+}
+
+// Call handler with the volume (mL) and duration (seconds) of each shower when it closes
+void controller_set_session_handler(void (*handler)(int millilitres, int seconds))
+{
+  session_handler = handler;
+}
+
+int controller_get_fd(void)
+{
+  return controller_fd;
+}
+
+bool controller_shower_open(void)
+{
+  return shower_open && elapsed_ms() < CONTROLLER_TIMEOUT * 1000;
+}
+
+/* controller_remaining_time - Get the time left in the budget of the open shower
+ * Params: None
+ * Returns: the time in whole seconds (rounded up), 0 if the shower is closed, or CONTROLLER_NONE if there is no time limit
+ *
+ * The time since the most recent report is subtracted, so the countdown is smooth between reports
+ */
+int controller_remaining_time(void)
+{
+  if (!controller_shower_open())
+    return 0;
+  if (remaining_ms < 0)
+    return CONTROLLER_NONE;
+  long remaining = remaining_ms - elapsed_ms();
+  return remaining > 0 ? (remaining + 999) / 1000 : 0;
+}
+
+/* controller_remaining_volume - Get the volume left in the budget of the open shower
+ * Params: None
+ * Returns: the volume in mL, 0 if the shower is closed, or CONTROLLER_NONE if there is no volume limit
+ */
+int controller_remaining_volume(void)
+{
+  if (!controller_shower_open())
+    return 0;
+  return remaining_ml < 0 ? CONTROLLER_NONE : remaining_ml;
+}
+
+// The flow rate of the open shower in mL/min, or 0 if it is closed
+int controller_flow_rate(void)
+{
+  return controller_shower_open() ? flow_rate : 0;
+}
+
+// The volume used since the shower opened in mL, or 0 if it is closed
+int controller_volume_used(void)
+{
+  return controller_shower_open() ? volume_used : 0;
+}
@@ -0,0 +1,19 @@
+#ifndef CONTROLLER_H
+#define CONTROLLER_H
+
+#include <stdbool.h>
+
+#define CONTROLLER_SOCKET "/tmp/shower-status"	// The Bluetooth service sends the controller state to this socket
+#define CONTROLLER_NONE -1			// A remaining budget with no limit
+
+void controller_init(void);			// Open the socket for the controller state
+void controller_poll(void);			// Read any state received since the last poll
+int controller_get_fd(void);			// The socket, which is readable when new state arrives
+void controller_set_session_handler(void (*handler)(int millilitres, int seconds));	// Called when each shower closes
+bool controller_shower_open(void);		// Whether the controller reports the shower is open
+int controller_remaining_time(void);		// The time left in the shower budget in seconds, or CONTROLLER_NONE
+int controller_remaining_volume(void);		// The volume left in the shower budget in mL, or CONTROLLER_NONE
+int controller_flow_rate(void);			// The flow rate of the open shower in mL/min
+int controller_volume_used(void);		// The volume used since the shower opened in mL
+
+#endif
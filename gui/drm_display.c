@@ -0,0 +1,358 @@
+#include "drm_display.h"
+#include "logger.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+/* A display backend using DRM/KMS rather than /dev/fb0.
+ * Two full screen dumb buffers are allocated and LVGL draws straight into them (direct mode), so there is no copy to a framebuffer.
+ * When a frame is complete the buffer is presented with a page flip, which the kernel applies on vblank, so the screen does not tear.
+ * Once the flip completes, the areas drawn in the frame are copied to the other buffer, which becomes the next back buffer,
+ * so it holds the whole screen before LVGL draws the next frame's changes into it.
+ */
+
+#define MAX_DIRTY_AREAS 16	// After this many areas in one frame, the whole screen is copied
+#define FLIP_TIMEOUT 100	// The longest wait for a page flip in ms, which should take at most one frame
+
+struct scanout_buffer
+{
+  uint32_t handle;
+  uint32_t pitch;
+  uint64_t size;
+  uint32_t fb_id;
+  uint8_t* map;
+};
+
+static int drm_fd = -1;
+static uint32_t connector_id;
+static uint32_t crtc_id;
+static uint32_t plane_id;		// The primary plane, whose FB_ID is set by atomic page flips
+static uint32_t fb_id_property;		// 0 if atomic modesetting is unavailable, so legacy page flips are used
+static uint32_t dpms_property;
+static struct scanout_buffer buffers[2];
+static lv_area_t dirty_areas[MAX_DIRTY_AREAS];
+static int num_dirty_areas;		// More than MAX_DIRTY_AREAS if the whole screen was drawn
+static bool flip_pending;
+
+/* find_property - Find the ID of a named property of a DRM object
+ * Params:
+ *  object_id - the object
+ *  object_type - the type of object, such as DRM_MODE_OBJECT_PLANE
+ *  name - the name of the property
+ *  value - set to the current value of the property, if not NULL
+ * Returns: the property ID, or 0 if the object does not have the property
+ */
+static uint32_t find_property(uint32_t object_id, uint32_t object_type, const char* name, uint64_t* value)
+{
+  uint32_t property_id = 0;
+  drmModeObjectProperties* properties = drmModeObjectGetProperties(drm_fd, object_id, object_type);
+  if (properties == NULL)
+    return 0;
+
+  for (uint32_t i = 0; i < properties->count_props && property_id == 0; i++) {
+    drmModePropertyRes* property = drmModeGetProperty(drm_fd, properties->props[i]);
+    if (property == NULL)
+      continue;
+    if (strcmp(property->name, name) == 0) {
+      property_id = property->prop_id;
+      if (value != NULL)
+        *value = properties->prop_values[i];
+    }
+    drmModeFreeProperty(property);
+  }
+  drmModeFreeObjectProperties(properties);
+  return property_id;
+}
+
+/* find_primary_plane - Find the primary plane of a CRTC
+ * Params: crtc_index - the index of the CRTC in the card's resources
+ * Returns: the plane ID, or 0 if there is none
+ */
+static uint32_t find_primary_plane(int crtc_index)
+{
+  uint32_t primary = 0;
+  drmModePlaneRes* planes = drmModeGetPlaneResources(drm_fd);
+  if (planes == NULL)
+    return 0;
+
+  for (uint32_t i = 0; i < planes->count_planes && primary == 0; i++) {
+    drmModePlane* plane = drmModeGetPlane(drm_fd, planes->planes[i]);
+    if (plane == NULL)
+      continue;
+    uint64_t type;
+    if ((plane->possible_crtcs & (1 << crtc_index)) && find_property(plane->plane_id, DRM_MODE_OBJECT_PLANE, "type", &type) && type == DRM_PLANE_TYPE_PRIMARY)
+      primary = plane->plane_id;
+    drmModeFreePlane(plane);
+  }
+  drmModeFreePlaneResources(planes);
+  return primary;
+}
+
+/* find_display - Find a connected display with a mode the size of the screen, and the CRTC to drive it
+ * Params: mode - set to the display's mode
+ * Returns: true if a display was found
+ */
+static bool find_display(drmModeModeInfo* mode)
+{
+  bool found = false;
+  drmModeRes* resources = drmModeGetResources(drm_fd);
+  if (resources == NULL)
+    return false;
+
+  for (int i = 0; i < resources->count_connectors && !found; i++) {
+    drmModeConnector* connector = drmModeGetConnector(drm_fd, resources->connectors[i]);
+    if (connector == NULL)
+      continue;
+
+    if (connector->connection == DRM_MODE_CONNECTED && connector->encoder_id != 0) {
+      for (int m = 0; m < connector->count_modes && !found; m++) {
+        if (connector->modes[m].hdisplay == LV_HOR_RES_MAX && connector->modes[m].vdisplay == LV_VER_RES_MAX) {
+          drmModeEncoder* encoder = drmModeGetEncoder(drm_fd, connector->encoder_id);
+          if (encoder != NULL && encoder->crtc_id != 0) {
+            for (int c = 0; c < resources->count_crtcs; c++) {
+              if (resources->crtcs[c] == encoder->crtc_id)
+                plane_id = find_primary_plane(c);
+            }
+            *mode = connector->modes[m];
+            connector_id = connector->connector_id;
+            crtc_id = encoder->crtc_id;
+            found = true;
+          }
+          drmModeFreeEncoder(encoder);
+        }
+      }
+    }
+    drmModeFreeConnector(connector);
+  }
+  drmModeFreeResources(resources);
+  return found;
+}
+
+/* create_buffer - Allocate a dumb buffer the size of the screen and map it
+ * Params: buffer - the buffer to create
+ * Returns: true if the buffer was created
+ *
+ * LVGL draws straight into the buffer, so each row must immediately follow the last
+ */
+static bool create_buffer(struct scanout_buffer* buffer)
+{
+  struct drm_mode_create_dumb create = { 0 };
+  struct drm_mode_map_dumb map = { 0 };
+
+  create.width = LV_HOR_RES_MAX;
+  create.height = LV_VER_RES_MAX;
+  create.bpp = LV_COLOR_DEPTH;
+  if (drmIoctl(drm_fd, DRM_IOCTL_MODE_CREATE_DUMB, &create) < 0)
+    return false;
+  buffer->handle = create.handle;
+  buffer->pitch = create.pitch;
+  buffer->size = create.size;
+
+  if (buffer->pitch != LV_HOR_RES_MAX * sizeof(lv_color_t))
+    return false;
+  if (drmModeAddFB(drm_fd, LV_HOR_RES_MAX, LV_VER_RES_MAX, LV_COLOR_DEPTH, LV_COLOR_DEPTH, buffer->pitch, buffer->handle, &buffer->fb_id) < 0)
+    return false;
+
+  map.handle = buffer->handle;
+  if (drmIoctl(drm_fd, DRM_IOCTL_MODE_MAP_DUMB, &map) < 0)
+    return false;
+  buffer->map = mmap(NULL, buffer->size, PROT_READ | PROT_WRITE, MAP_SHARED, drm_fd, map.offset);
+  if (buffer->map == MAP_FAILED) {
+    buffer->map = NULL;
+    return false;
+  }
+  memset(buffer->map, 0, buffer->size);
+  return true;
+}
+
+/* destroy_buffers - Free the dumb buffers and close the card, after drm_display_init fails
+ * Params: None
+ * Returns: Nothing
+ */
+static void destroy_buffers(void)
+{
+  for (int i = 0; i < 2; i++) {
+    if (buffers[i].map != NULL)
+      munmap(buffers[i].map, buffers[i].size);
+    if (buffers[i].fb_id != 0)
+      drmModeRmFB(drm_fd, buffers[i].fb_id);
+    if (buffers[i].handle != 0) {
+      struct drm_mode_destroy_dumb destroy = { .handle = buffers[i].handle };
+      drmIoctl(drm_fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+    }
+  }
+  memset(buffers, 0, sizeof(buffers));
+  close(drm_fd);
+  drm_fd = -1;
+}
+
+static void page_flip_handler(int fd, unsigned int frame, unsigned int sec, unsigned int usec, void* data)
+{
+  flip_pending = false;
+}
+
+/* wait_for_flip - Wait for the page flip to complete, when the new front buffer is on the screen
+ * Params: None
+ * Returns: Nothing
+ */
+static void wait_for_flip(void)
+{
+  drmEventContext context = { 0 };
+  context.version = 2;
+  context.page_flip_handler = page_flip_handler;
+
+  struct pollfd fds = { .fd = drm_fd, .events = POLLIN };
+  while (flip_pending) {
+    int ready = poll(&fds, 1, FLIP_TIMEOUT);
+    if (ready < 0 && errno == EINTR)
+      continue;
+    if (ready <= 0) {
+      log_info("GUI", "Timed out waiting for a page flip");
+      flip_pending = false;
+    } else {
+      drmHandleEvent(drm_fd, &context);
+    }
+  }
+}
+
+/* page_flip - Ask the kernel to show a buffer from the next vblank
+ * Params: buffer - the buffer to show
+ * Returns: true if the flip was queued
+ */
+static bool page_flip(struct scanout_buffer* buffer)
+{
+  int result;
+  if (fb_id_property != 0) {
+    drmModeAtomicReq* request = drmModeAtomicAlloc();
+    drmModeAtomicAddProperty(request, plane_id, fb_id_property, buffer->fb_id);
+    result = drmModeAtomicCommit(drm_fd, request, DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_ATOMIC_NONBLOCK, NULL);
+    drmModeAtomicFree(request);
+  } else {
+    result = drmModePageFlip(drm_fd, crtc_id, buffer->fb_id, DRM_MODE_PAGE_FLIP_EVENT, NULL);
+  }
+  return result == 0;
+}
+
+/* copy_area - Copy an area of the screen from one buffer to the other
+ * Params:
+ *  to - the buffer to copy to
+ *  from - the buffer to copy from
+ *  area - the area to copy
+ * Returns: Nothing
+ */
+static void copy_area(struct scanout_buffer* to, const struct scanout_buffer* from, const lv_area_t* area)
+{
+  size_t offset = area->y1 * from->pitch + area->x1 * sizeof(lv_color_t);
+  size_t width = lv_area_get_width(area) * sizeof(lv_color_t);
+  for (lv_coord_t y = area->y1; y <= area->y2; y++) {
+    memcpy(to->map + offset, from->map + offset, width);
+    offset += from->pitch;
+  }
+}
+
+/* drm_display_init - Set the display driver to draw into DRM scanout buffers
+ * Params:
+ *  drv - the display driver, which should be initialised with lv_disp_drv_init
+ *  draw_buf - the draw buffer to use the scanout buffers
+ * Returns: true if the display can be used, or false if the display should use fbdev instead
+ */
+bool drm_display_init(lv_disp_drv_t* drv, lv_disp_draw_buf_t* draw_buf)
+{
+  drmModeModeInfo mode;
+
+  drm_fd = open(DRM_DEVICE, O_RDWR | O_CLOEXEC);
+  if (drm_fd < 0) {
+    log_info("GUI", "Unable to open the DRM device");
+    return false;
+  }
+
+  drmSetClientCap(drm_fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1);
+  bool atomic = drmSetClientCap(drm_fd, DRM_CLIENT_CAP_ATOMIC, 1) == 0;
+  if (!find_display(&mode)) {
+    log_info("GUI", "Unable to find a display for DRM");
+    destroy_buffers();
+    return false;
+  }
+  if (atomic && plane_id != 0)
+    fb_id_property = find_property(plane_id, DRM_MODE_OBJECT_PLANE, "FB_ID", NULL);
+  dpms_property = find_property(connector_id, DRM_MODE_OBJECT_CONNECTOR, "DPMS", NULL);
+
+  if (!create_buffer(&buffers[0]) || !create_buffer(&buffers[1])) {
+    log_info("GUI", "Unable to create the DRM scanout buffers");
+    destroy_buffers();
+    return false;
+  }
+
+  if (drmModeSetCrtc(drm_fd, crtc_id, buffers[1].fb_id, 0, 0, &connector_id, 1, &mode) < 0) {
+    log_info("GUI", "Unable to set the DRM mode");
+    destroy_buffers();
+    return false;
+  }
+
+  lv_disp_draw_buf_init(draw_buf, buffers[0].map, buffers[1].map, LV_HOR_RES_MAX * LV_VER_RES_MAX);
+  drv->draw_buf = draw_buf;
+  drv->direct_mode = 1;
+  drv->flush_cb = drm_display_flush;
+  num_dirty_areas = MAX_DIRTY_AREAS + 1;
+
+  log_info("GUI", fb_id_property != 0 ? "Using DRM with atomic page flips" : "Using DRM with page flips");
+  return true;
+}
+
+/* drm_display_flush - Present a frame once all of its areas have been drawn
+ * Params:
+ *  drv - the display driver
+ *  area - an area which was drawn
+ *  color_p - the buffer which was drawn into
+ * Returns: Nothing
+ *
+ * LVGL draws into the back buffer, and does not draw into the other until lv_disp_flush_ready is called,
+ * so the flip is waited for here.
+ */
+void drm_display_flush(lv_disp_drv_t* drv, const lv_area_t* area, lv_color_t* color_p)
+{
+  if (num_dirty_areas < MAX_DIRTY_AREAS)
+    lv_area_copy(&dirty_areas[num_dirty_areas], area);
+  if (num_dirty_areas <= MAX_DIRTY_AREAS)
+    num_dirty_areas++;
+
+  if (!lv_disp_flush_is_last(drv)) {
+    lv_disp_flush_ready(drv);
+    return;
+  }
+
+  struct scanout_buffer* front = (uint8_t*)color_p == buffers[0].map ? &buffers[0] : &buffers[1];
+  struct scanout_buffer* back = front == &buffers[0] ? &buffers[1] : &buffers[0];
+
+  flip_pending = page_flip(front);
+  if (!flip_pending)
+    log_info("GUI", "Unable to flip the DRM buffers");
+  wait_for_flip();
+
+  if (num_dirty_areas > MAX_DIRTY_AREAS) {
+    memcpy(back->map, front->map, front->size);
+  } else {
+    for (int i = 0; i < num_dirty_areas; i++)
+      copy_area(back, front, &dirty_areas[i]);
+  }
+  num_dirty_areas = 0;
+
+  lv_disp_flush_ready(drv);
+}
+
+/* drm_display_blank - Power the display down or up with DPMS
+ * Params: blank - true to power down, false to power up
+ * Returns: true if the display changed
+ */
+bool drm_display_blank(bool blank)
+{
+  if (drm_fd < 0 || dpms_property == 0)
+    return false;
+  return drmModeConnectorSetProperty(drm_fd, connector_id, dpms_property, blank ? DRM_MODE_DPMS_OFF : DRM_MODE_DPMS_ON) == 0;
+}
@@ -0,0 +1,13 @@
+#ifndef DRM_DISPLAY_H
+#define DRM_DISPLAY_H
+
+#include "lvgl/lvgl.h"
+#include <stdbool.h>
+
+#define DRM_DEVICE "/dev/dri/card0"
+
+bool drm_display_init(lv_disp_drv_t* drv, lv_disp_draw_buf_t* draw_buf);	// Set the driver to render into the scanout buffers, false if DRM is unavailable
+void drm_display_flush(lv_disp_drv_t* drv, const lv_area_t* area, lv_color_t* color_p);	// Present the frame with a page flip
+bool drm_display_blank(bool blank);						// Power the display down or up, false if DRM is not in use
+
+#endif
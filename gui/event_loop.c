@@ -0,0 +1,189 @@
+#include "event_loop.h"
+#include "frame_stats.h"
+#include "logger.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+/* Rather than waking every few milliseconds, the GUI sleeps in epoll_wait until one of
+ *  - the touchscreen has input (the evdev file descriptor is readable)
+ *  - the next LVGL timer is due (a timerfd armed to the deadline returned by lv_timer_handler)
+ *  - another file descriptor added with event_loop_add is readable
+ * The LVGL tick is advanced by the CLOCK_MONOTONIC time which has passed, so it stays accurate however long a frame takes.
+ * The input device's read timer is paused while the screen is not touched, and resumed by the next input event.
+ * The display refreshes every REFRESH_ACTIVE ms while the screen is touched or animating, and for ACTIVE_TIME afterwards.
+ * Otherwise it is idle and refreshes every REFRESH_IDLE ms, which is still often enough for the countdown's once a second updates.
+ */
+
+#define MAX_SOURCES 8
+#define MAX_EVENTS 8
+#define REFRESH_ACTIVE LV_DISP_DEF_REFR_PERIOD	// ms
+#define REFRESH_IDLE 250			// ms
+#define ACTIVE_TIME 1000			// ms after the last input before the display is idle
+
+extern int evdev_fd;			// The touchscreen, opened by evdev_init (lv_drivers/indev/evdev.c)
+
+struct source
+{
+  int fd;
+  void (*handler)(void);
+};
+
+static int epoll_fd = -1;
+static int timer_fd = -1;
+static lv_indev_t* touch;		// The touchscreen input device
+static struct source sources[MAX_SOURCES];
+static int num_sources = 0;
+static struct timespec tick_time;	// The CLOCK_MONOTONIC time up to which lv_tick_inc has been called
+static uint32_t last_input;		// The tick of the most recent touchscreen input
+
+/* watch - Add a file descriptor to the epoll set
+ * Params:
+ *  fd - the file descriptor
+ *  index - identifies the source in the events returned by epoll_wait
+ * Returns: Nothing
+ */
+static void watch(int fd, int index)
+{
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.u32 = index;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+    log_info("GUI", "Unable to watch a file descriptor in the event loop");
+}
+
+/* update_tick - Advance the LVGL tick by the time which has passed
+ * Params: None
+ * Returns: Nothing
+ *
+ * Only whole milliseconds are added, and tick_time advanced by the same amount, so no time is lost to rounding
+ */
+static void update_tick(void)
+{
+  struct timespec current_time;
+  clock_gettime(CLOCK_MONOTONIC, &current_time);
+  // The nanoseconds are added before dividing, as their difference alone may be negative and would round the wrong way
+  int64_t elapsed = ((int64_t)(current_time.tv_sec - tick_time.tv_sec) * 1000000000
+                     + (current_time.tv_nsec - tick_time.tv_nsec)) / 1000000;
+  if (elapsed <= 0)
+    return;
+
+  lv_tick_inc(elapsed);
+  tick_time.tv_sec += elapsed / 1000;
+  tick_time.tv_nsec += (elapsed % 1000) * 1000000;
+  if (tick_time.tv_nsec >= 1000000000) {
+    tick_time.tv_sec++;
+    tick_time.tv_nsec -= 1000000000;
+  }
+}
+
+/* arm_timer - Set the timerfd to expire when the next LVGL timer is due
+ * Params: delay - the time until the next timer in ms, from lv_timer_handler
+ * Returns: Nothing
+ *
+ * The deadline is absolute, from the current tick, so a deadline which has already passed expires straight away
+ */
+static void arm_timer(uint32_t delay)
+{
+  struct itimerspec deadline = { 0 };
+  if (delay != LV_NO_TIMER_READY) {
+    deadline.it_value.tv_sec = tick_time.tv_sec + delay / 1000;
+    deadline.it_value.tv_nsec = tick_time.tv_nsec + (delay % 1000) * 1000000;
+    if (deadline.it_value.tv_nsec >= 1000000000) {
+      deadline.it_value.tv_sec++;
+      deadline.it_value.tv_nsec -= 1000000000;
+    }
+  }
+  timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &deadline, NULL);
+}
+
+/* update_refresh_period - Refresh the display quickly while the GUI is in use, and slowly while it is idle
+ * Params: None
+ * Returns: Nothing
+ */
+static void update_refresh_period(void)
+{
+  lv_timer_t* refresh = lv_disp_get_default()->refr_timer;
+  bool active = touch->proc.state != LV_INDEV_STATE_RELEASED || lv_anim_count_running() > 0 || lv_tick_elaps(last_input) < ACTIVE_TIME;
+  lv_timer_set_period(refresh, active ? REFRESH_ACTIVE : REFRESH_IDLE);
+}
+
+/* event_loop_init - Create the epoll set, with the LVGL timer and the touchscreen
+ * Params: indev - the touchscreen input device, whose read timer is paused while it is not touched
+ * Returns: Nothing
+ */
+void event_loop_init(lv_indev_t* indev)
+{
+  touch = indev;
+  clock_gettime(CLOCK_MONOTONIC, &tick_time);
+
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (epoll_fd < 0 || timer_fd < 0) {
+    log_info("GUI", "Unable to create the event loop");
+    return;
+  }
+
+  event_loop_add(timer_fd, NULL);
+  event_loop_add(evdev_fd, NULL);
+}
+
+/* event_loop_add - Call a handler whenever a file descriptor is readable
+ * Params:
+ *  fd - the file descriptor, which should be non-blocking
+ *  handler - the function to call, which should read everything available
+ * Returns: Nothing
+ */
+void event_loop_add(int fd, void (*handler)(void))
+{
+  if (fd < 0 || num_sources >= MAX_SOURCES)
+    return;
+  sources[num_sources].fd = fd;
+  sources[num_sources].handler = handler;
+  watch(fd, num_sources++);
+}
+
+/* event_loop_run - Run LVGL, sleeping until there is something to do
+ * Params: None
+ * Returns: Does not return
+ */
+void event_loop_run(void)
+{
+  struct epoll_event events[MAX_EVENTS];
+  uint64_t expirations;
+
+  while (1)
+  {
+    update_tick();
+    frame_stats_pass_begin();
+    uint32_t delay = lv_timer_handler();
+
+    // Stop reading the touchscreen once it is released, until it has more input
+    if (touch->proc.state == LV_INDEV_STATE_RELEASED)
+      lv_timer_pause(touch->driver->read_timer);
+    update_refresh_period();
+
+    arm_timer(delay);
+    int count = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+
+    for (int i = 0; i < count; i++) {
+      struct source* source = &sources[events[i].data.u32];
+      if (source->fd == timer_fd) {
+        if (read(timer_fd, &expirations, sizeof(expirations)) < 0)
+          continue;
+      } else if (source->fd == evdev_fd) {
+        // The read timer reads every event which is waiting, so it runs on this pass through the loop
+        frame_stats_touch();
+        last_input = lv_tick_get();
+        lv_timer_set_period(lv_disp_get_default()->refr_timer, REFRESH_ACTIVE);
+        lv_timer_resume(touch->driver->read_timer);
+        lv_timer_ready(touch->driver->read_timer);
+      } else if (source->handler != NULL) {
+        source->handler();
+      }
+    }
+  }
+}
@@ -0,0 +1,10 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include "lvgl/lvgl.h"
+
+void event_loop_init(lv_indev_t* indev);			// Create the loop, which wakes for the touchscreen and LVGL's timers
+void event_loop_add(int fd, void (*handler)(void));	// Call handler whenever fd is readable
+void event_loop_run(void);				// Run LVGL until the process is stopped
+
+#endif
@@ -0,0 +1,126 @@
+#include "fb_display.h"
+#include "rgb565.h"
+#include "logger.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/fb.h>
+
+/* A replacement for lv_drivers' fbdev_flush, which copies each row of the flushed area with the rgb565 kernels.
+ * LVGL draws RGB565, and the framebuffer may be RGB565 (copied) or XRGB8888 (converted).
+ * fb_display_fill is LVGL's gpu_fill_cb, so large solid fills in the draw buffer use the same kernels.
+ */
+
+#if LV_COLOR_DEPTH != 16 || LV_COLOR_16_SWAP != 0
+#error "The framebuffer kernels need LV_COLOR_DEPTH 16 without LV_COLOR_16_SWAP"
+#endif
+
+static uint8_t* framebuffer;		// The first visible pixel
+static int fb_width;
+static int fb_height;
+static int fb_bits_per_pixel;
+static int fb_line_length;		// Bytes from one row to the next
+
+/* fb_display_init - Map the framebuffer device
+ * Params: None
+ * Returns: true if the framebuffer is RGB565 or XRGB8888, and was mapped
+ */
+bool fb_display_init(void)
+{
+  struct fb_var_screeninfo vinfo;
+  struct fb_fix_screeninfo finfo;
+
+  int fd = open(FB_DEVICE, O_RDWR | O_CLOEXEC);
+  if (fd < 0) {
+    log_info("GUI", "Unable to open the framebuffer");
+    return false;
+  }
+  if (ioctl(fd, FBIOGET_FSCREENINFO, &finfo) < 0 || ioctl(fd, FBIOGET_VSCREENINFO, &vinfo) < 0
+      || (vinfo.bits_per_pixel != 16 && vinfo.bits_per_pixel != 32)) {
+    log_info("GUI", "Unable to use the framebuffer format");
+    close(fd);
+    return false;
+  }
+
+  uint8_t* memory = mmap(NULL, finfo.smem_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (memory == MAP_FAILED) {
+    log_info("GUI", "Unable to map the framebuffer");
+    return false;
+  }
+
+  memory += vinfo.yoffset * finfo.line_length + vinfo.xoffset * (vinfo.bits_per_pixel / 8);
+  fb_display_attach(memory, vinfo.xres, vinfo.yres, vinfo.bits_per_pixel, finfo.line_length);
+  return true;
+}
+
+/* fb_display_attach - Draw into a framebuffer in memory
+ * Params:
+ *  memory - the first visible pixel
+ *  width, height - the size in pixels
+ *  bits_per_pixel - 16 for RGB565 or 32 for XRGB8888
+ *  line_length - the bytes from one row to the next
+ * Returns: Nothing
+ */
+void fb_display_attach(void* memory, int width, int height, int bits_per_pixel, int line_length)
+{
+  framebuffer = memory;
+  fb_width = width;
+  fb_height = height;
+  fb_bits_per_pixel = bits_per_pixel;
+  fb_line_length = line_length;
+}
+
+/* fb_display_flush - Copy an area of the draw buffer to the framebuffer
+ * Params:
+ *  drv - the display driver
+ *  area - the area, which is clipped to the framebuffer
+ *  color_p - the pixels of the area, row by row
+ * Returns: Nothing
+ */
+void fb_display_flush(lv_disp_drv_t* drv, const lv_area_t* area, lv_color_t* color_p)
+{
+  int x1 = LV_MAX(area->x1, 0);
+  int y1 = LV_MAX(area->y1, 0);
+  int x2 = LV_MIN(area->x2, fb_width - 1);
+  int y2 = LV_MIN(area->y2, fb_height - 1);
+
+  if (framebuffer != NULL && x1 <= x2 && y1 <= y2) {
+    int stride = lv_area_get_width(area);
+    int count = x2 - x1 + 1;
+    const uint16_t* src = (const uint16_t*)color_p + (y1 - area->y1) * stride + (x1 - area->x1);
+    uint8_t* dst = framebuffer + y1 * fb_line_length + x1 * (fb_bits_per_pixel / 8);
+
+    for (int y = y1; y <= y2; y++) {
+      if (fb_bits_per_pixel == 16)
+        rgb565->copy((uint16_t*)dst, src, count);
+      else
+        rgb565->to_xrgb8888((uint32_t*)dst, src, count);
+      src += stride;
+      dst += fb_line_length;
+    }
+  }
+
+  lv_disp_flush_ready(drv);
+}
+
+/* fb_display_fill - Fill an area of a draw buffer with one colour
+ * Params:
+ *  drv - the display driver
+ *  dest_buf - the draw buffer
+ *  dest_width - the width of the draw buffer in pixels
+ *  fill_area - the area to fill, relative to the draw buffer
+ *  color - the colour
+ * Returns: Nothing
+ */
+void fb_display_fill(lv_disp_drv_t* drv, lv_color_t* dest_buf, lv_coord_t dest_width, const lv_area_t* fill_area, lv_color_t color)
+{
+  uint16_t* dst = (uint16_t*)dest_buf + fill_area->y1 * dest_width + fill_area->x1;
+  int count = lv_area_get_width(fill_area);
+
+  for (lv_coord_t y = fill_area->y1; y <= fill_area->y2; y++) {
+    rgb565->fill(dst, color.full, count);
+    dst += dest_width;
+  }
+}
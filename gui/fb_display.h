@@ -0,0 +1,15 @@
+#ifndef FB_DISPLAY_H
+#define FB_DISPLAY_H
+
+#include "lvgl/lvgl.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#define FB_DEVICE "/dev/fb0"
+
+bool fb_display_init(void);		// Map the framebuffer device, false if it cannot be used
+void fb_display_attach(void* memory, int width, int height, int bits_per_pixel, int line_length);	// Draw into memory rather than a device
+void fb_display_flush(lv_disp_drv_t* drv, const lv_area_t* area, lv_color_t* color_p);		// Copy an area to the framebuffer
+void fb_display_fill(lv_disp_drv_t* drv, lv_color_t* dest_buf, lv_coord_t dest_width, const lv_area_t* fill_area, lv_color_t color);	// Fill an area of a draw buffer
+
+#endif
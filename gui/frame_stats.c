@@ -0,0 +1,217 @@
+#include "frame_stats.h"
+#include "logger.h"
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/signalfd.h>
+
+/* Each frame LVGL renders is measured, and the measurements are counted in histograms with fixed buckets
+ *  - render time, from the start of the lv_timer_handler pass to the end of the last flush, less the flush time
+ *  - flush time, the total time in the display driver's flush callback
+ *  - dirty area, the pixels flushed
+ *  - touch latency, from the touchscreen becoming readable to the end of the last flush of the first frame it changed
+ * The touch time is when epoll woke for the touchscreen, as lv_drivers' evdev_read consumes the events and their timestamps.
+ * A touch changes a frame when an area is invalidated while the touchscreen's read timer runs, which LVGL passes to the
+ * display's rounder callback. Frames drawn for other timers, such as animations, leave the touch waiting.
+ * Send SIGUSR1 (systemctl kill -s USR1 shower-gui) to write the histograms to stdout, which is kept in the journal.
+ */
+
+#define BUCKETS 12
+#define TOUCH_TIMEOUT 500000	// A touch which has not changed the screen within 500ms did not cause a frame
+
+struct histogram
+{
+  const char* name;
+  const char* unit;
+  uint32_t base;		// The upper bound of the first bucket, with each bucket doubling the last
+  uint32_t counts[BUCKETS + 1];	// The last bucket counts everything larger
+  uint32_t count;
+  uint64_t total;
+  uint32_t max;
+};
+
+static struct histogram render_time = { "Render time", "us", 125 };
+static struct histogram flush_time = { "Flush time", "us", 125 };
+static struct histogram dirty_area = { "Dirty area", "px", 256 };
+static struct histogram touch_latency = { "Touch latency", "us", 1000 };
+
+static void (*driver_flush)(lv_disp_drv_t* drv, const lv_area_t* area, lv_color_t* color_p);	// The flush callback being timed
+static void (*driver_rounder)(lv_disp_drv_t* drv, lv_area_t* area);	// The display's own rounder callback, if any
+static void (*input_read)(lv_timer_t* timer);	// The touchscreen's read timer callback
+static int signal_fd = -1;
+static int64_t pass_start;	// When the current lv_timer_handler pass started
+static int64_t frame_flush;	// The time spent flushing the current frame
+static uint32_t frame_pixels;	// The pixels flushed in the current frame
+static int64_t touch_time;	// When the touchscreen became readable, or 0 if a frame has been drawn since
+static bool touch_invalidated;	// Whether the input since touch_time has invalidated an area
+static bool reading_input;	// Whether the touchscreen's read timer is running
+
+static int64_t now_us(void)
+{
+  struct timespec current_time;
+  clock_gettime(CLOCK_MONOTONIC, &current_time);
+  return (int64_t)current_time.tv_sec * 1000000 + current_time.tv_nsec / 1000;
+}
+
+/* record - Count a value in a histogram
+ * Params:
+ *  histogram - the histogram
+ *  value - the value
+ * Returns: Nothing
+ */
+static void record(struct histogram* histogram, uint32_t value)
+{
+  int bucket = 0;
+  while (bucket < BUCKETS && value >= (histogram->base << bucket))
+    bucket++;
+  histogram->counts[bucket]++;
+  histogram->count++;
+  histogram->total += value;
+  if (value > histogram->max)
+    histogram->max = value;
+}
+
+static void dump(const struct histogram* histogram)
+{
+  printf("%s (%s): count %u mean %llu max %u\n", histogram->name, histogram->unit, histogram->count,
+         histogram->count > 0 ? (unsigned long long)(histogram->total / histogram->count) : 0ULL, histogram->max);
+  for (int bucket = 0; bucket < BUCKETS; bucket++)
+    printf("  < %8u %u\n", histogram->base << bucket, histogram->counts[bucket]);
+  printf("  >=%8u %u\n", histogram->base << (BUCKETS - 1), histogram->counts[BUCKETS]);
+}
+
+/* timed_flush - Call the display driver's flush callback, and record the frame after its last area
+ * Params: as for the flush callback
+ * Returns: Nothing
+ */
+static void timed_flush(lv_disp_drv_t* drv, const lv_area_t* area, lv_color_t* color_p)
+{
+  bool last = lv_disp_flush_is_last(drv);
+  int64_t start = now_us();
+  driver_flush(drv, area, color_p);
+  int64_t end = now_us();
+
+  frame_flush += end - start;
+  frame_pixels += lv_area_get_width(area) * lv_area_get_height(area);
+  if (!last)
+    return;
+
+  record(&render_time, end - pass_start - frame_flush);
+  record(&flush_time, frame_flush);
+  record(&dirty_area, frame_pixels);
+  if (touch_invalidated) {
+    if (end - touch_time < TOUCH_TIMEOUT)
+      record(&touch_latency, end - touch_time);
+    touch_time = 0;
+    touch_invalidated = false;
+  }
+
+  // Another frame in the same pass starts now
+  pass_start = end;
+  frame_flush = 0;
+  frame_pixels = 0;
+}
+
+/* watched_rounder - Call the display's rounder callback, and note whether the area was invalidated by input
+ * Params: as for the rounder callback
+ * Returns: Nothing
+ */
+static void watched_rounder(lv_disp_drv_t* drv, lv_area_t* area)
+{
+  if (driver_rounder != NULL)
+    driver_rounder(drv, area);
+  if (reading_input && touch_time != 0)
+    touch_invalidated = true;
+}
+
+/* watched_read - Run the touchscreen's read timer, which invalidates the areas changed by its input
+ * Params: timer - the read timer
+ * Returns: Nothing
+ */
+static void watched_read(lv_timer_t* timer)
+{
+  reading_input = true;
+  input_read(timer);
+  reading_input = false;
+}
+
+/* frame_stats_init - Block SIGUSR1 and receive it through a signalfd instead
+ * Params: None
+ * Returns: Nothing
+ */
+void frame_stats_init(void)
+{
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGUSR1);
+  sigprocmask(SIG_BLOCK, &signals, NULL);
+  signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (signal_fd < 0)
+    log_info("GUI", "Unable to create the signalfd for frame statistics");
+}
+
+/* frame_stats_wrap - Time the display driver's flush callback, and watch the areas it invalidates
+ * Params: drv - the display driver, before it is registered
+ * Returns: Nothing
+ */
+void frame_stats_wrap(lv_disp_drv_t* drv)
+{
+  driver_flush = drv->flush_cb;
+  drv->flush_cb = timed_flush;
+  driver_rounder = drv->rounder_cb;
+  drv->rounder_cb = watched_rounder;
+}
+
+/* frame_stats_wrap_input - Watch the touchscreen's read timer, so only the frames it changes count for touch latency
+ * Params: indev - the touchscreen input device, after it is registered
+ * Returns: Nothing
+ */
+void frame_stats_wrap_input(lv_indev_t* indev)
+{
+  input_read = indev->driver->read_timer->timer_cb;
+  indev->driver->read_timer->timer_cb = watched_read;
+}
+
+void frame_stats_pass_begin(void)
+{
+  pass_start = now_us();
+  frame_flush = 0;
+  frame_pixels = 0;
+}
+
+// Only the first touch before a frame is kept, as the frame is late for all of them
+void frame_stats_touch(void)
+{
+  if (touch_time == 0 || now_us() - touch_time >= TOUCH_TIMEOUT) {
+    touch_time = now_us();
+    touch_invalidated = false;
+  }
+}
+
+int frame_stats_get_fd(void)
+{
+  return signal_fd;
+}
+
+/* frame_stats_poll - Write the histograms to stdout if SIGUSR1 has arrived
+ * Params: None
+ * Returns: Nothing
+ */
+void frame_stats_poll(void)
+{
+  struct signalfd_siginfo info;
+  bool requested = false;
+
+  while (read(signal_fd, &info, sizeof(info)) == sizeof(info))
+    requested = true;
+  if (!requested)
+    return;
+
+  dump(&render_time);
+  dump(&flush_time);
+  dump(&dirty_area);
+  dump(&touch_latency);
+  fflush(stdout);
+}
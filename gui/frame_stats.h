@@ -0,0 +1,14 @@
+#ifndef FRAME_STATS_H
+#define FRAME_STATS_H
+
+#include "lvgl/lvgl.h"
+
+void frame_stats_init(void);			// Handle SIGUSR1, which dumps the statistics
+void frame_stats_wrap(lv_disp_drv_t* drv);	// Time the display driver's flush callback, which must already be set
+void frame_stats_wrap_input(lv_indev_t* indev);	// Watch the touchscreen's read timer, once it is registered
+void frame_stats_pass_begin(void);		// Called before each lv_timer_handler, where frames are rendered
+void frame_stats_touch(void);			// Called when the touchscreen has input
+int frame_stats_get_fd(void);			// The signalfd, which is readable when SIGUSR1 arrives
+void frame_stats_poll(void);			// Dump the statistics if SIGUSR1 has arrived
+
+#endif
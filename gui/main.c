@@ -1,22 +1,28 @@
 #include "lvgl/lvgl.h"
-#include "lvgl/lv_drivers/display/fbdev.h"
 #include "lvgl/lv_drivers/indev/evdev.h"
 #include "user.h"
 #include "main_screen.h"
 #include "login_screen.h"
 #include "shower_screen.h"
 #include "blank_screen.h"
+#include "usage_screen.h"
+#include "usage.h"
+#include "controller.h"
+#include "event_loop.h"
+#include "fb_display.h"
+#include "frame_stats.h"
+#include "rgb565.h"
 #include "logger.h"
+#if USE_DRM
+#include "drm_display.h"
+#endif
 #include <stdio.h>
 #include <time.h>
-#include <unistd.h>
 
 struct timespec watchdog;		// Set by each screen's on click handler to delay start of screen saver
 bool screensaver_active;		// Indicate whether the screen saver is active
 
 #define SCREENSAVER_DELAY 60
-#define NEARLY_DONE_DELAY 180
-#define SHOWER_FINISH_DELAY 240
 
 // Display buffer
 #define BUFFER_SIZE 16384
@@ -24,22 +30,43 @@ static lv_disp_draw_buf_t disp_buf;
 static lv_color_t buf_1[BUFFER_SIZE];
 static lv_color_t buf_2[BUFFER_SIZE];
 
+// Set the screensaver if required, checked once a second by an LVGL timer
+// The timer is paused while the screensaver is active
+static void screensaver_check(lv_timer_t* timer)
+{
+  struct timespec current_time;
+  clock_gettime(CLOCK_REALTIME, &current_time);
+
+  if (!screensaver_active && (current_time.tv_sec - watchdog.tv_sec) >= SCREENSAVER_DELAY)
+    blank_screen_activate();
+}
+
 int main(int argc, char** argv)
 {
   log_info("GUI", "Starting the shower GUI service");
   lv_init();
-  fbdev_init();
+  rgb565_init();
   evdev_init();
 
   clock_gettime(CLOCK_REALTIME, &watchdog);
   screensaver_active = false;
 
-  lv_disp_draw_buf_init(&disp_buf, buf_1, buf_2, BUFFER_SIZE);
-
   lv_disp_drv_t disp_drv;
   lv_disp_drv_init(&disp_drv);
-  disp_drv.flush_cb = fbdev_flush;
-  disp_drv.draw_buf = &disp_buf;
+#if USE_DRM
+  if (!drm_display_init(&disp_drv, &disp_buf))
+#endif
+  {
+    if (!fb_display_init()) {
+      log_info("GUI", "No display is available, exiting");
+      return 1;
+    }
+    lv_disp_draw_buf_init(&disp_buf, buf_1, buf_2, BUFFER_SIZE);
+    disp_drv.flush_cb = fb_display_flush;
+    disp_drv.draw_buf = &disp_buf;
+  }
+  disp_drv.gpu_fill_cb = fb_display_fill;
+  frame_stats_wrap(&disp_drv);
   disp_drv.hor_res = LV_HOR_RES_MAX;
   disp_drv.ver_res = LV_VER_RES_MAX;
   lv_disp_drv_register(&disp_drv);
@@ -48,43 +75,38 @@ int main(int argc, char** argv)
   lv_indev_drv_init(&indev_drv);
   indev_drv.type = LV_INDEV_TYPE_POINTER;
   indev_drv.read_cb = evdev_read;
-  lv_indev_drv_register(&indev_drv);
+  lv_indev_t* indev = lv_indev_drv_register(&indev_drv);
+  frame_stats_wrap_input(indev);
 
   user_load();
+  usage_load();
+  controller_init();
+  controller_set_session_handler(user_finish_shower);
+  frame_stats_init();
 
   lv_obj_t* scr_mainscreen = main_screen_create(NULL);
   main_screen_update_users(scr_mainscreen);
   lv_obj_t* scr_loginscreen = login_screen_create(NULL);
   lv_obj_t* scr_showerscreen = shower_screen_create(NULL);
   lv_obj_t* scr_blankscreen = blank_screen_create(NULL);
+  usage_screen_create(NULL, USAGE_DAILY);
+  usage_screen_create(NULL, USAGE_WEEKLY);
 
   login_screen_set_main_screen(scr_mainscreen);
   login_screen_set_shower_screen(scr_showerscreen);
   main_screen_set_login_screen(scr_loginscreen);
   main_screen_set_blank_screen(scr_blankscreen);
   shower_screen_set_main_screen(scr_mainscreen);
+  usage_screen_set_return_screen(scr_showerscreen);
 
   lv_scr_load(scr_mainscreen);
+  blank_screen_set_check_timer(lv_timer_create(screensaver_check, 1000, NULL));
 
-  struct timespec current_time;
-
-  while (1)
-  {
-    lv_tick_inc(5);
-    lv_task_handler();
-
-    clock_gettime(CLOCK_REALTIME, &current_time);
-
-    // Set the screensaver if required
-    if (!screensaver_active && (current_time.tv_sec - watchdog.tv_sec) >= SCREENSAVER_DELAY) {
-      log_info("GUI", "Activating the screensaver");
-      screensaver_active = true;
-      blank_screen_set_return_screen(lv_scr_act());
-      lv_scr_load(scr_blankscreen);
-    }
-
-    usleep(5000);
-  }
+  // Sleep until there is touch input, a report from the controller or an LVGL timer is due
+  event_loop_init(indev);
+  event_loop_add(controller_get_fd(), controller_poll);
+  event_loop_add(frame_stats_get_fd(), frame_stats_poll);
+  event_loop_run();
 
   return 0;
 }
@@ -20,8 +20,7 @@ static void event_handler(lv_obj_t* obj, lv_event_t event)
     int index = (int)lv_event_get_user_data();
     if (index == BTN_BLANK) {
       if (scr_blankscreen != NULL) {
-        blank_screen_set_return_screen(scr_mainscreen);
-        lv_scr_load(scr_blankscreen);
+        blank_screen_activate();
       } else {
         printf("Error: blankscreen in mainscreen is NULL\n");
       }
@@ -0,0 +1,170 @@
+#include "rgb565.h"
+#include <string.h>
+
+/* The display uses 16 bit colour, so every flush and solid fill moves RGB565 pixels.
+ * There is a scalar version of each kernel, and vector versions for
+ *  - SSE2, on the x86 host used for testing
+ *  - NEON, on the Raspberry Pi (always on AArch64, or when a 32 bit build is compiled with -mfpu=neon)
+ * A vector version is only used if the CPU reports the instruction set when rgb565_init is called.
+ * Copies always use memcpy, which the C library already vectorises and which was faster than SSE2 loads and stores in fb_bench.
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+#define RGB565_SSE2 1
+#include <emmintrin.h>
+#define SSE2 __attribute__((target("sse2")))
+#endif
+
+#if defined(__aarch64__) || defined(__ARM_NEON)
+#define RGB565_NEON 1
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+/* expand - Convert an RGB565 pixel to XRGB8888
+ * Params: pixel - the pixel
+ * Returns: the pixel, with the top bits of each channel repeated in the new low bits so white stays white
+ */
+static inline uint32_t expand(uint16_t pixel)
+{
+  uint32_t r = pixel >> 11;
+  uint32_t g = (pixel >> 5) & 0x3f;
+  uint32_t b = pixel & 0x1f;
+  return 0xff000000 | ((r << 3 | r >> 2) << 16) | ((g << 2 | g >> 4) << 8) | (b << 3 | b >> 2);
+}
+
+static void copy_scalar(uint16_t* dst, const uint16_t* src, int count)
+{
+  memcpy(dst, src, count * sizeof(uint16_t));
+}
+
+static void fill_scalar(uint16_t* dst, uint16_t colour, int count)
+{
+  for (int i = 0; i < count; i++)
+    dst[i] = colour;
+}
+
+static void to_xrgb8888_scalar(uint32_t* dst, const uint16_t* src, int count)
+{
+  for (int i = 0; i < count; i++)
+    dst[i] = expand(src[i]);
+}
+
+static const struct rgb565_kernels scalar = { "scalar", copy_scalar, fill_scalar, to_xrgb8888_scalar };
+
+#if RGB565_SSE2
+// 8 pixels at a time
+SSE2 static void fill_sse2(uint16_t* dst, uint16_t colour, int count)
+{
+  __m128i pixels = _mm_set1_epi16(colour);
+  int i = 0;
+  for (; i + 8 <= count; i += 8)
+    _mm_storeu_si128((__m128i*)(dst + i), pixels);
+  for (; i < count; i++)
+    dst[i] = colour;
+}
+
+// 8 pixels at a time, with each channel widened in 16 bit lanes then interleaved into 32 bit pixels
+SSE2 static void to_xrgb8888_sse2(uint32_t* dst, const uint16_t* src, int count)
+{
+  const __m128i mask5 = _mm_set1_epi16(0x1f);
+  const __m128i mask6 = _mm_set1_epi16(0x3f);
+  const __m128i alpha = _mm_set1_epi16((short)0xff00);
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m128i p = _mm_loadu_si128((const __m128i*)(src + i));
+    __m128i r = _mm_srli_epi16(p, 11);
+    __m128i g = _mm_and_si128(_mm_srli_epi16(p, 5), mask6);
+    __m128i b = _mm_and_si128(p, mask5);
+    r = _mm_or_si128(_mm_slli_epi16(r, 3), _mm_srli_epi16(r, 2));
+    g = _mm_or_si128(_mm_slli_epi16(g, 2), _mm_srli_epi16(g, 4));
+    b = _mm_or_si128(_mm_slli_epi16(b, 3), _mm_srli_epi16(b, 2));
+    __m128i gb = _mm_or_si128(_mm_slli_epi16(g, 8), b);
+    __m128i ar = _mm_or_si128(alpha, r);
+    _mm_storeu_si128((__m128i*)(dst + i), _mm_unpacklo_epi16(gb, ar));
+    _mm_storeu_si128((__m128i*)(dst + i + 4), _mm_unpackhi_epi16(gb, ar));
+  }
+  for (; i < count; i++)
+    dst[i] = expand(src[i]);
+}
+
+static const struct rgb565_kernels sse2 = { "sse2", copy_scalar, fill_sse2, to_xrgb8888_sse2 };
+#endif
+
+#if RGB565_NEON
+// 8 pixels at a time
+static void fill_neon(uint16_t* dst, uint16_t colour, int count)
+{
+  uint16x8_t pixels = vdupq_n_u16(colour);
+  int i = 0;
+  for (; i + 8 <= count; i += 8)
+    vst1q_u16(dst + i, pixels);
+  for (; i < count; i++)
+    dst[i] = colour;
+}
+
+// 8 pixels at a time, with each channel widened in 16 bit lanes then interleaved into 32 bit pixels by the store
+static void to_xrgb8888_neon(uint32_t* dst, const uint16_t* src, int count)
+{
+  const uint16x8_t mask5 = vdupq_n_u16(0x1f);
+  const uint16x8_t mask6 = vdupq_n_u16(0x3f);
+  const uint16x8_t alpha = vdupq_n_u16(0xff00);
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    uint16x8_t p = vld1q_u16(src + i);
+    uint16x8_t r = vshrq_n_u16(p, 11);
+    uint16x8_t g = vandq_u16(vshrq_n_u16(p, 5), mask6);
+    uint16x8_t b = vandq_u16(p, mask5);
+    r = vorrq_u16(vshlq_n_u16(r, 3), vshrq_n_u16(r, 2));
+    g = vorrq_u16(vshlq_n_u16(g, 2), vshrq_n_u16(g, 4));
+    b = vorrq_u16(vshlq_n_u16(b, 3), vshrq_n_u16(b, 2));
+    uint16x8x2_t pixels;
+    pixels.val[0] = vorrq_u16(vshlq_n_u16(g, 8), b);
+    pixels.val[1] = vorrq_u16(alpha, r);
+    vst2q_u16((uint16_t*)(dst + i), pixels);
+  }
+  for (; i < count; i++)
+    dst[i] = expand(src[i]);
+}
+
+static const struct rgb565_kernels neon = { "neon", copy_scalar, fill_neon, to_xrgb8888_neon };
+#endif
+
+static const struct rgb565_kernels* supported[3];	// The kernels this CPU supports, fastest first
+static int num_supported = 0;
+const struct rgb565_kernels* rgb565 = &scalar;
+
+/* rgb565_init - Find the kernels this CPU supports, and use the fastest
+ * Params: None
+ * Returns: Nothing
+ */
+void rgb565_init(void)
+{
+  num_supported = 0;
+#if RGB565_SSE2
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2"))
+    supported[num_supported++] = &sse2;
+#endif
+#if RGB565_NEON
+#if defined(__aarch64__)
+  if (getauxval(AT_HWCAP) & HWCAP_ASIMD)
+#else
+  if (getauxval(AT_HWCAP) & HWCAP_NEON)
+#endif
+    supported[num_supported++] = &neon;
+#endif
+  supported[num_supported++] = &scalar;
+  rgb565 = supported[0];
+}
+
+int rgb565_get_count(void)
+{
+  return num_supported;
+}
+
+const struct rgb565_kernels* rgb565_get_kernels(int index)
+{
+  return index >= 0 && index < num_supported ? supported[index] : NULL;
+}
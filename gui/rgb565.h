@@ -0,0 +1,21 @@
+#ifndef RGB565_H
+#define RGB565_H
+
+#include <stdint.h>
+
+// Kernels which move rows of RGB565 pixels, in a version for each instruction set
+struct rgb565_kernels
+{
+  const char* name;
+  void (*copy)(uint16_t* dst, const uint16_t* src, int count);		// Copy pixels
+  void (*fill)(uint16_t* dst, uint16_t colour, int count);		// Set pixels to one colour
+  void (*to_xrgb8888)(uint32_t* dst, const uint16_t* src, int count);	// Convert pixels for a 32 bit framebuffer
+};
+
+extern const struct rgb565_kernels* rgb565;	// The fastest kernels this CPU supports, chosen by rgb565_init
+
+void rgb565_init(void);					// Choose the kernels from the CPU features
+int rgb565_get_count(void);				// The number of kernels this CPU supports
+const struct rgb565_kernels* rgb565_get_kernels(int index);	// The kernels, fastest first
+
+#endif
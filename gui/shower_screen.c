@@ -1,31 +1,57 @@
 #include "shower_screen.h"
 #include "user.h"
+#include "controller.h"
+#include "usage_screen.h"
 #include "logger.h"
 #include <unistd.h>
 #include <time.h>
 #include <stdio.h>
+#include <string.h>
 
 static char greeting[20];
 static int selected_user;
 static lv_obj_t* title;
 static lv_obj_t* scr_mainscreen;
 static lv_obj_t* countdown_label;
+static lv_obj_t* scr_showerscreen;
+static lv_timer_t* countdown_timer;	// Updates the countdown while the screen is active
+static lv_obj_t* flow_label;
+static lv_obj_t* flow_chart;
+static lv_chart_series_t* flow_series;
+static bool flow_shown;			// Whether the flow of an open shower is shown
 
 #define BTN_BACK 0
 #define BTN_SHOWER 1
 #define BTN_USAGE 2
 #define BTN_WEEKLY 3
 
+#define COUNTDOWN_PERIOD 1000	// ms
+#define COUNTDOWN_WIDTH 400	// The label keeps this width, so new text only redraws the label
+#define FLOW_POINTS 60		// The chart shows the flow rate each second for the last minute
+#define MAX_FLOW_RATE 15000	// mL/min at the top of the chart
+
 extern struct timespec watchdog;
 
-static void start_shower()
+static const char* control_file = "/tmp/shower";	// The Bluetooth service reads commands from this pipe
+
+// Write shower commands to a different file, so gui_bench does not open the shower
+void shower_screen_set_control_file(const char* path)
+{
+  control_file = path;
+}
+
+// Send the open command with the user's budget, in seconds and litres
+static void start_shower(int index)
 {
+  int seconds, litres;
+  user_get_budget(index, &seconds, &litres);
+
   FILE *fp_shower;
-  fp_shower = fopen("/tmp/shower", "w");
+  fp_shower = fopen(control_file, "w");
   if (fp_shower == NULL) {
     printf("Unable to open shower control file for writing");
   } else {
-    fprintf(fp_shower, "O\n");
+    fprintf(fp_shower, "O %d %d\n", seconds, litres);
   }
   fclose(fp_shower);
 }
@@ -56,20 +82,92 @@ static void event_handler(lv_obj_t* obj, lv_event_t event)
       if (countdown == 0) {
         snprintf(buffer, sizeof(buffer), "Starting shower for %s", user_get_name(selected_user));
         log_info("GUI", buffer);
-        start_shower();
+        start_shower(selected_user);
       } else {
         printf("User %d must wait another %d seconds\n", selected_user, countdown);
       }
       break;
+
+    case BTN_USAGE:
+      usage_screen_show(USAGE_DAILY, selected_user);
+      break;
+
+    case BTN_WEEKLY:
+      usage_screen_show(USAGE_WEEKLY, selected_user);
+      break;
     }
   }
   shower_update_label(selected_user);
 }
 
+// Only set a label's text when it changes, as setting it redraws the label
+static void set_label_text(lv_obj_t* label, const char* text)
+{
+  if (strcmp(lv_label_get_text(label), text) != 0)
+    lv_label_set_text(label, text);
+}
+
+/* update_flow - Show the flow rate and volume used while the user's shower is open
+ * Params:
+ *  index - the selected user
+ *  sample - true to add the flow rate to the chart, which is done once a second
+ * Returns: Nothing
+ *
+ * The chart keeps the last FLOW_POINTS rates, and lv_chart_set_next_value replaces the oldest, so nothing is rebuilt
+ */
+static void update_flow(int index, bool sample)
+{
+  static char buffer[32];
+
+  if (index < 0 || !user_shower_active(index)) {
+    if (flow_shown) {
+      lv_obj_add_flag(flow_chart, LV_OBJ_FLAG_HIDDEN);
+      lv_obj_add_flag(flow_label, LV_OBJ_FLAG_HIDDEN);
+      flow_shown = false;
+    }
+    return;
+  }
+
+  if (!flow_shown) {
+    lv_chart_set_all_value(flow_chart, flow_series, LV_CHART_POINT_NONE);
+    lv_obj_clear_flag(flow_chart, LV_OBJ_FLAG_HIDDEN);
+    lv_obj_clear_flag(flow_label, LV_OBJ_FLAG_HIDDEN);
+    flow_shown = true;
+  }
+
+  int rate = controller_flow_rate();
+  if (sample)
+    lv_chart_set_next_value(flow_chart, flow_series, LV_MIN(rate, MAX_FLOW_RATE));
+  snprintf(buffer, sizeof(buffer), "%.1f L/min    %.1f L used", rate / 1000.0, controller_volume_used() / 1000.0);
+  set_label_text(flow_label, buffer);
+}
+
+// Update the countdown and flow once a second, until another screen is loaded
+static void countdown_tick(lv_timer_t* timer)
+{
+  if (lv_scr_act() != scr_showerscreen) {
+    lv_timer_pause(timer);
+    return;
+  }
+  shower_update_label(selected_user);
+  update_flow(selected_user, true);
+}
+
+// Restart the countdown whenever the screen is shown, including after the screensaver
+static void screen_event_handler(lv_obj_t* obj, lv_event_t event)
+{
+  if (event == LV_EVENT_SCREEN_LOADED) {
+    shower_update_label(selected_user);
+    update_flow(selected_user, false);
+    lv_timer_resume(countdown_timer);
+  }
+}
+
 lv_obj_t* shower_screen_create(lv_obj_t* parent)
 {
   lv_obj_t* screen = lv_obj_create(parent);
   lv_obj_set_size(screen, LV_HOR_RES, LV_VER_RES);
+  lv_obj_add_event_cb(screen, screen_event_handler, NULL);
 
   title = lv_label_create(screen);
   lv_label_set_text(title, "Hi!");
@@ -88,55 +186,83 @@ lv_obj_t* shower_screen_create(lv_obj_t* parent)
 
   button = lv_btn_create(screen);
   lv_obj_add_event_cb(button, event_handler, (void *)BTN_SHOWER);
-  lv_obj_set_size(button, 430, 230);
+  lv_obj_set_size(button, 430, 170);
   lv_obj_align(button, LV_ALIGN_TOP_LEFT, 20, 70);
   countdown_label = lv_label_create(button);
+  lv_obj_set_width(countdown_label, COUNTDOWN_WIDTH);
+  lv_obj_set_style_text_align(countdown_label, LV_TEXT_ALIGN_CENTER, LV_PART_MAIN);
   lv_label_set_text(countdown_label, "Shower available");
   lv_obj_align(countdown_label, LV_ALIGN_BOTTOM_MID, 0, 0);
 
-/*
+  // The chart and flow label are hidden until the shower opens, and do not take the button's clicks
+  flow_chart = lv_chart_create(button);
+  lv_obj_set_size(flow_chart, 380, 70);
+  lv_obj_align(flow_chart, LV_ALIGN_TOP_MID, 0, 0);
+  lv_obj_clear_flag(flow_chart, LV_OBJ_FLAG_CLICKABLE);
+  lv_obj_add_flag(flow_chart, LV_OBJ_FLAG_HIDDEN);
+  lv_chart_set_type(flow_chart, LV_CHART_TYPE_LINE);
+  lv_chart_set_update_mode(flow_chart, LV_CHART_UPDATE_MODE_SHIFT);
+  lv_chart_set_point_count(flow_chart, FLOW_POINTS);
+  lv_chart_set_range(flow_chart, LV_CHART_AXIS_PRIMARY_Y, 0, MAX_FLOW_RATE);
+  flow_series = lv_chart_add_series(flow_chart, LV_COLOR_MAKE(0x21, 0x96, 0xF3), LV_CHART_AXIS_PRIMARY_Y);
+
+  flow_label = lv_label_create(button);
+  lv_obj_set_width(flow_label, COUNTDOWN_WIDTH);
+  lv_obj_set_style_text_align(flow_label, LV_TEXT_ALIGN_CENTER, LV_PART_MAIN);
+  lv_label_set_text(flow_label, "");
+  lv_obj_align(flow_label, LV_ALIGN_TOP_MID, 0, 75);
+  lv_obj_add_flag(flow_label, LV_OBJ_FLAG_HIDDEN);
+  flow_shown = false;
+
   button = lv_btn_create(screen);
   lv_obj_add_event_cb(button, event_handler, (void *)BTN_USAGE);
-  lv_obj_set_size(button, 130, 230);
-  lv_obj_align(button, LV_ALIGN_TOP_LEFT, 170, 70);
+  lv_obj_set_size(button, 210, 50);
+  lv_obj_align(button, LV_ALIGN_TOP_LEFT, 20, 250);
   label = lv_label_create(button);
   lv_label_set_text(label, "Usage");
-  lv_obj_align(label, LV_ALIGN_BOTTOM_MID, 0, 0);
+  lv_obj_align(label, LV_ALIGN_CENTER, 0, 0);
 
   button = lv_btn_create(screen);
   lv_obj_add_event_cb(button, event_handler, (void *)BTN_WEEKLY);
-  lv_obj_set_size(button, 130, 230);
-  lv_obj_align(button, LV_ALIGN_TOP_LEFT, 320, 70);
+  lv_obj_set_size(button, 210, 50);
+  lv_obj_align(button, LV_ALIGN_TOP_LEFT, 240, 250);
   label = lv_label_create(button);
   lv_label_set_text(label, "Weekly");
-  lv_obj_align(label, LV_ALIGN_BOTTOM_MID, 0, 0);
-*/
+  lv_obj_align(label, LV_ALIGN_CENTER, 0, 0);
 
   selected_user = -1;
   scr_mainscreen = NULL;
+  scr_showerscreen = screen;
+  countdown_timer = lv_timer_create(countdown_tick, COUNTDOWN_PERIOD, NULL);
+  lv_timer_pause(countdown_timer);
 
   return screen;
 }
 
 void shower_update_label(int index)
 {
-  if (countdown_label == 0)
+  if (countdown_label == 0 || index < 0)
     return;
 
-  static char buffer[50];
-  struct timespec current_time;
-  clock_gettime(CLOCK_REALTIME, &current_time);
-  int remaining_time = user_shower_active(index);
-  if (remaining_time > 0 && remaining_time <= 240) {
-    sprintf(buffer, "Your shower has\n%d seconds remaining", remaining_time);
-    lv_label_set_text(countdown_label, buffer);
+  static char buffer[64];
+  if (user_shower_active(index)) {
+    // Show whichever budget the controller is enforcing
+    int remaining_time = controller_remaining_time();
+    int remaining_volume = controller_remaining_volume();
+    if (remaining_time != CONTROLLER_NONE && remaining_volume != CONTROLLER_NONE)
+      snprintf(buffer, sizeof(buffer), "Your shower has\n%d seconds and %.1f L remaining", remaining_time, remaining_volume / 1000.0);
+    else if (remaining_volume != CONTROLLER_NONE)
+      snprintf(buffer, sizeof(buffer), "Your shower has\n%.1f L remaining", remaining_volume / 1000.0);
+    else
+      snprintf(buffer, sizeof(buffer), "Your shower has\n%d seconds remaining", remaining_time);
+    set_label_text(countdown_label, buffer);
   } else {
     int countdown = user_get_shower_countdown(index);
     if (countdown == 0) {
-      lv_label_set_text(countdown_label, "Click to start\nyour shower");
+      set_label_text(countdown_label, "Click to start\nyour shower");
     } else {
-      sprintf(buffer, "The shower is unavailable\nfor %d seconds", countdown);
-      lv_label_set_text(countdown_label, buffer);
+      snprintf(buffer, sizeof(buffer), "The shower is unavailable\nfor %d seconds", countdown);
+      set_label_text(countdown_label, buffer);
     }
   }
 }
@@ -7,5 +7,6 @@ lv_obj_t* shower_screen_create(lv_obj_t* parent);
 void shower_screen_select_user(int index);
 void shower_screen_set_main_screen(lv_obj_t* mainscreen);
 void shower_update_label(int index);
+void shower_screen_set_control_file(const char* path);
 
 #endif
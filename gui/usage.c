@@ -0,0 +1,256 @@
+#include "usage.h"
+#include "user.h"
+#include <stdio.h>
+#include <string.h>
+
+/* Each user's showers are added up by day and by week as each shower finishes, so the usage screens
+ * only read the rollups rather than a history of showers.
+ * The rollups are kept in rings indexed by the day or week, where a slot holding an older period is reused.
+ * Each user's rings are found by their id rather than their place in the users file, so their history stays
+ * with them if users are reordered or removed. The rings of a user who has been removed are reused for a new one.
+ * They are saved in a binary file after each shower.
+ */
+
+#define USAGE_MAGIC 0x32475355	// "USG2"
+#define USAGE_MAGIC_1 0x31475355	// "USG1", where the rings were in the order of the users file
+
+static const char* usage_file = "/home/ubuntu/gui/usage";
+static int32_t ids[MAX_USERS];		// The id of the user each ring belongs to (0 if it is free)
+static struct usage_rollup daily[MAX_USERS][USAGE_DAYS];
+static struct usage_rollup weekly[MAX_USERS][USAGE_WEEKS];
+
+/* get_day - Get the day of a time
+ * Params: when - the time
+ * Returns: the days since the epoch in local time
+ */
+static int32_t get_day(time_t when)
+{
+  struct tm tm;
+  localtime_r(&when, &tm);
+  return (when + tm.tm_gmtoff) / 86400;
+}
+
+// Weeks start on Monday, and the epoch was a Thursday
+static int32_t get_week(int32_t day)
+{
+  return (day + 3) / 7;
+}
+
+/* add - Add a shower to a ring of rollups
+ * Params:
+ *  ring - the rollups
+ *  size - the number of rollups in the ring
+ *  period - the day or week of the shower
+ *  millilitres, seconds - the shower
+ * Returns: Nothing
+ */
+static void add(struct usage_rollup* ring, int size, int32_t period, int millilitres, int seconds)
+{
+  struct usage_rollup* rollup = &ring[period % size];
+  if (rollup->period != period) {
+    memset(rollup, 0, sizeof(*rollup));
+    rollup->period = period;
+  }
+  rollup->showers++;
+  rollup->millilitres += millilitres;
+  rollup->seconds += seconds;
+}
+
+/* get - Copy the most recent periods from a ring of rollups
+ * Params:
+ *  ring - the rollups
+ *  size - the number of rollups in the ring
+ *  last - the most recent period
+ *  count - the number of periods, which is limited to size
+ *  rollups - set to the periods, oldest first, with periods which have no showers set to zero
+ * Returns: the number of periods copied
+ */
+static int get(const struct usage_rollup* ring, int size, int32_t last, int count, struct usage_rollup* rollups)
+{
+  if (count > size)
+    count = size;
+  for (int i = 0; i < count; i++) {
+    int32_t period = last - count + 1 + i;
+    if (period >= 0 && ring[period % size].period == period) {
+      rollups[i] = ring[period % size];
+    } else {
+      memset(&rollups[i], 0, sizeof(rollups[i]));
+      rollups[i].period = period;
+    }
+  }
+  return count;
+}
+
+/* find - Find the rings of a user
+ * Params:
+ *  user_id - the user
+ *  create - whether to give the user rings if they have none
+ * Returns: the index of the rings, or -1 if there are none
+ */
+static int find(int user_id, bool create)
+{
+  if (user_id <= 0)
+    return -1;
+  for (int i = 0; i < MAX_USERS; i++)
+    if (ids[i] == user_id)
+      return i;
+  if (!create)
+    return -1;
+  for (int i = 0; i < MAX_USERS; i++) {
+    if (ids[i] == 0 || user_find(ids[i]) < 0) {
+      ids[i] = user_id;
+      memset(daily[i], 0, sizeof(daily[i]));
+      memset(weekly[i], 0, sizeof(weekly[i]));
+      return i;
+    }
+  }
+  return -1;
+}
+
+void usage_set_file(const char* path)
+{
+  usage_file = path;
+}
+
+/* usage_load - Read the rollups saved by usage_record
+ * Params: None
+ * Returns: Nothing
+ *
+ * If there is no file, or it is from a different version, there is no usage yet.
+ * The users must be loaded first, as a file from the first version has the rings in the order of the users file.
+ */
+void usage_load(void)
+{
+  uint32_t magic = 0;
+
+  memset(ids, 0, sizeof(ids));
+  memset(daily, 0, sizeof(daily));
+  memset(weekly, 0, sizeof(weekly));
+  FILE* fp = fopen(usage_file, "rb");
+  if (fp == NULL)
+    return;
+  bool read = fread(&magic, sizeof(magic), 1, fp) == 1;
+  if (read && magic == USAGE_MAGIC) {
+    read = fread(ids, sizeof(ids), 1, fp) == 1;
+  } else if (read && magic == USAGE_MAGIC_1) {
+    for (int i = 0; i < user_get_count(); i++)
+      ids[i] = user_get_id(i);
+  } else {
+    read = false;
+  }
+  if (!read || fread(daily, sizeof(daily), 1, fp) != 1 || fread(weekly, sizeof(weekly), 1, fp) != 1) {
+    printf("Ignoring the usage file, which is not complete\n");
+    memset(ids, 0, sizeof(ids));
+    memset(daily, 0, sizeof(daily));
+    memset(weekly, 0, sizeof(weekly));
+  }
+  fclose(fp);
+}
+
+/* usage_record - Add a finished shower to the user's daily and weekly rollups, and save them
+ * Params:
+ *  user_id - the id of the user who had the shower
+ *  when - when the shower finished
+ *  millilitres - the volume used
+ *  seconds - how long the shower was open
+ * Returns: Nothing
+ */
+void usage_record(int user_id, time_t when, int millilitres, int seconds)
+{
+  const uint32_t magic = USAGE_MAGIC;
+
+  int index = find(user_id, true);
+  if (index < 0) {
+    printf("Error: No usage for user %d in usage_record\n", user_id);
+    return;
+  }
+
+  int32_t day = get_day(when);
+  add(daily[index], USAGE_DAYS, day, millilitres, seconds);
+  add(weekly[index], USAGE_WEEKS, get_week(day), millilitres, seconds);
+
+  FILE* fp = fopen(usage_file, "wb");
+  if (fp == NULL) {
+    printf("Error opening usage file");
+    return;
+  }
+  fwrite(&magic, sizeof(magic), 1, fp);
+  fwrite(ids, sizeof(ids), 1, fp);
+  fwrite(daily, sizeof(daily), 1, fp);
+  fwrite(weekly, sizeof(weekly), 1, fp);
+  fclose(fp);
+}
+
+int usage_get_daily(int user_id, int days, struct usage_rollup* rollups)
+{
+  static const struct usage_rollup none[USAGE_DAYS];
+  int index = find(user_id, false);
+  return get(index >= 0 ? daily[index] : none, USAGE_DAYS, get_day(time(NULL)), days, rollups);
+}
+
+int usage_get_weekly(int user_id, int weeks, struct usage_rollup* rollups)
+{
+  static const struct usage_rollup none[USAGE_WEEKS];
+  int index = find(user_id, false);
+  return get(index >= 0 ? weekly[index] : none, USAGE_WEEKS, get_week(get_day(time(NULL))), weeks, rollups);
+}
+
+/* usage_downsample - Reduce a series with Largest-Triangle-Three-Buckets, which keeps its peaks and shape
+ * Params:
+ *  values - the series, with one value for each period
+ *  count - the number of values
+ *  output - set to the reduced series
+ *  threshold - the largest number of values in the reduced series
+ * Returns: the number of values in the reduced series
+ *
+ * The first and last values are kept. The values between are split into threshold - 2 buckets,
+ * and from each bucket the value making the largest triangle with the value chosen from the previous bucket
+ * and the average of the next bucket is chosen.
+ */
+int usage_downsample(const int32_t* values, int count, int32_t* output, int threshold)
+{
+  if (threshold >= count || threshold < 3) {
+    memcpy(output, values, count * sizeof(*values));
+    return count;
+  }
+
+  double every = (double)(count - 2) / (threshold - 2);
+  int chosen = 0;
+  output[0] = values[0];
+
+  for (int bucket = 0; bucket < threshold - 2; bucket++) {
+    // The average of the next bucket, which is the last value for the last bucket
+    int next_start = (int)((bucket + 1) * every) + 1;
+    int next_end = (int)((bucket + 2) * every) + 1;
+    if (next_end > count)
+      next_end = count;
+    double average_x = 0, average_y = 0;
+    for (int i = next_start; i < next_end; i++) {
+      average_x += i;
+      average_y += values[i];
+    }
+    average_x /= next_end - next_start;
+    average_y /= next_end - next_start;
+
+    // The value in this bucket with the largest triangle
+    int start = (int)(bucket * every) + 1;
+    int end = (int)((bucket + 1) * every) + 1;
+    double largest = -1;
+    int largest_index = start;
+    for (int i = start; i < end; i++) {
+      double area = (chosen - average_x) * (values[i] - values[chosen]) - (chosen - i) * (average_y - values[chosen]);
+      if (area < 0)
+        area = -area;
+      if (area > largest) {
+        largest = area;
+        largest_index = i;
+      }
+    }
+
+    output[bucket + 1] = values[largest_index];
+    chosen = largest_index;
+  }
+
+  output[threshold - 1] = values[count - 1];
+  return threshold;
+}
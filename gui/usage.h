@@ -0,0 +1,26 @@
+#ifndef USAGE_H
+#define USAGE_H
+
+#include <stdint.h>
+#include <time.h>
+
+#define USAGE_DAYS 366		// Daily rollups are kept for a year
+#define USAGE_WEEKS 260		// Weekly rollups are kept for five years
+
+// The showers of one user in one day or week
+struct usage_rollup
+{
+  int32_t period;		// The day or week since the epoch, in local time
+  uint32_t showers;
+  uint32_t millilitres;
+  uint32_t seconds;
+};
+
+void usage_set_file(const char* path);
+void usage_load(void);
+void usage_record(int user_id, time_t when, int millilitres, int seconds);	// Add a finished shower to the rollups of the user with the id
+int usage_get_daily(int user_id, int days, struct usage_rollup* rollups);	// The most recent days, oldest first
+int usage_get_weekly(int user_id, int weeks, struct usage_rollup* rollups);	// The most recent weeks, oldest first
+int usage_downsample(const int32_t* values, int count, int32_t* output, int threshold);	// Reduce a series to threshold points
+
+#endif
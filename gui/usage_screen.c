@@ -0,0 +1,173 @@
+#include "usage_screen.h"
+#include "usage.h"
+#include "user.h"
+#include <stdio.h>
+#include <time.h>
+
+/* The Usage and Weekly screens show a user's water in a chart, with a summary of their showers.
+ * The values come from the rollups in usage.c, and are reduced with usage_downsample to at most CHART_POINTS
+ * so the chart costs the same to draw however much history there is.
+ * The millilitres are reduced, and only then scaled to decilitres for the chart, so short showers are not rounded away.
+ * A chart value must be below LV_CHART_POINT_NONE, so if there is too much water for decilitres, litres (and so on) are used.
+ */
+
+#define CHART_POINTS 60
+#define CHART_SCALE 100		// Millilitres per chart unit (decilitres)
+
+// The state of one of the two screens
+struct usage_screen
+{
+  const char* name;
+  int count;			// The days or weeks in the chart
+  lv_obj_t* screen;
+  lv_obj_t* title;
+  lv_obj_t* summary;
+  lv_obj_t* chart;
+  lv_chart_series_t* series;
+  lv_coord_t points[CHART_POINTS];	// The chart's values, which the series uses in place of its own array
+};
+
+static struct usage_screen screens[2] = {
+  { "Usage", USAGE_DAYS },
+  { "Weekly", USAGE_WEEKS },
+};
+static lv_obj_t* scr_returnscreen;
+
+extern struct timespec watchdog;
+
+static void event_handler(lv_obj_t* obj, lv_event_t event)
+{
+  if (event == LV_EVENT_CLICKED) {
+    clock_gettime(CLOCK_REALTIME, &watchdog);
+    if (scr_returnscreen != NULL) {
+      lv_scr_load(scr_returnscreen);
+    } else {
+      printf("Returnscreen is NULL in usage_screen\n");
+    }
+  }
+}
+
+/* add_up - Total the showers in some rollups
+ * Params:
+ *  rollups - the rollups
+ *  count - the number of rollups
+ *  total - set to the totals
+ * Returns: the number of rollups with showers
+ */
+static int add_up(const struct usage_rollup* rollups, int count, struct usage_rollup* total)
+{
+  int used = 0;
+  total->showers = total->millilitres = total->seconds = 0;
+  for (int i = 0; i < count; i++) {
+    total->showers += rollups[i].showers;
+    total->millilitres += rollups[i].millilitres;
+    total->seconds += rollups[i].seconds;
+    if (rollups[i].showers > 0)
+      used++;
+  }
+  return used;
+}
+
+lv_obj_t* usage_screen_create(lv_obj_t* parent, int period)
+{
+  struct usage_screen* usage = &screens[period];
+  lv_obj_t* screen = lv_obj_create(parent);
+  lv_obj_set_size(screen, LV_HOR_RES, LV_VER_RES);
+
+  usage->title = lv_label_create(screen);
+  lv_label_set_text(usage->title, usage->name);
+  lv_obj_align(usage->title, LV_ALIGN_TOP_MID, 0, 20);
+
+  lv_obj_t* button = lv_btn_create(screen);
+  lv_obj_add_event_cb(button, event_handler, NULL);
+  lv_obj_set_size(button, 55, 30);
+  lv_obj_align(button, LV_ALIGN_TOP_LEFT, 20, 20);
+  lv_obj_t* label = lv_label_create(button);
+  lv_label_set_text(label, "Back");
+  lv_obj_align(label, LV_ALIGN_CENTER, 0, 0);
+
+  usage->summary = lv_label_create(screen);
+  lv_label_set_text(usage->summary, "");
+  lv_obj_align(usage->summary, LV_ALIGN_TOP_LEFT, 20, 65);
+
+  usage->chart = lv_chart_create(screen);
+  lv_obj_set_size(usage->chart, 440, 170);
+  lv_obj_align(usage->chart, LV_ALIGN_TOP_LEFT, 20, 130);
+  lv_chart_set_type(usage->chart, LV_CHART_TYPE_LINE);
+  lv_chart_set_point_count(usage->chart, CHART_POINTS);
+  usage->series = lv_chart_add_series(usage->chart, LV_COLOR_MAKE(0x21, 0x96, 0xF3), LV_CHART_AXIS_PRIMARY_Y);
+  lv_chart_set_ext_y_array(usage->chart, usage->series, usage->points);
+
+  usage->screen = screen;
+  return screen;
+}
+
+/* usage_screen_show - Load the Usage or Weekly screen for a user
+ * Params:
+ *  period - USAGE_DAILY or USAGE_WEEKLY
+ *  index - the user
+ * Returns: Nothing
+ */
+void usage_screen_show(int period, int index)
+{
+  static struct usage_rollup rollups[USAGE_DAYS > USAGE_WEEKS ? USAGE_DAYS : USAGE_WEEKS];
+  static int32_t millilitres[USAGE_DAYS > USAGE_WEEKS ? USAGE_DAYS : USAGE_WEEKS];
+  static int32_t reduced[CHART_POINTS];
+  static char buffer[160];
+  struct usage_screen* usage = &screens[period];
+  struct usage_rollup recent, total;
+
+  if (usage->screen == NULL) {
+    printf("Usage screen %d is NULL\n", period);
+    return;
+  }
+
+  int count;
+  if (period == USAGE_DAILY)
+    count = usage_get_daily(user_get_id(index), usage->count, rollups);
+  else
+    count = usage_get_weekly(user_get_id(index), usage->count, rollups);
+
+  int used = add_up(rollups, count, &total);
+  if (period == USAGE_DAILY) {
+    add_up(&rollups[count - 7], 7, &recent);
+    snprintf(buffer, sizeof(buffer), "Today: %u showers, %.1f L, %u min\nLast 7 days: %u showers, %.1f L, %u min",
+             rollups[count - 1].showers, rollups[count - 1].millilitres / 1000.0, rollups[count - 1].seconds / 60,
+             recent.showers, recent.millilitres / 1000.0, recent.seconds / 60);
+  } else {
+    used = used > 0 ? used : 1;
+    snprintf(buffer, sizeof(buffer), "This week: %u showers, %.1f L, %u min\nAverage week: %.1f showers, %.1f L, %u min",
+             rollups[count - 1].showers, rollups[count - 1].millilitres / 1000.0, rollups[count - 1].seconds / 60,
+             (double)total.showers / used, total.millilitres / 1000.0 / used, total.seconds / 60 / used);
+  }
+  lv_label_set_text(usage->summary, buffer);
+
+  snprintf(buffer, sizeof(buffer), "%s for %s", usage->name, user_get_name(index));
+  lv_label_set_text(usage->title, buffer);
+
+  // Millilitres for each day or week, reduced to fit the chart, then shown in decilitres
+  int32_t largest = 1;
+  for (int i = 0; i < count; i++)
+    millilitres[i] = rollups[i].millilitres;
+  int points = usage_downsample(millilitres, count, reduced, CHART_POINTS);
+  for (int i = 0; i < points; i++)
+    if (reduced[i] > largest)
+      largest = reduced[i];
+  int32_t scale = CHART_SCALE;
+  while (largest / scale >= LV_CHART_POINT_NONE)
+    scale *= 10;
+  largest = (largest + scale - 1) / scale;
+  for (int i = 0; i < points; i++)
+    usage->points[i] = reduced[i] / scale;
+  for (int i = points; i < CHART_POINTS; i++)
+    usage->points[i] = LV_CHART_POINT_NONE;
+  lv_chart_set_range(usage->chart, LV_CHART_AXIS_PRIMARY_Y, 0, largest);
+  lv_chart_refresh(usage->chart);
+
+  lv_scr_load(usage->screen);
+}
+
+void usage_screen_set_return_screen(lv_obj_t* returnscreen)
+{
+  scr_returnscreen = returnscreen;
+}
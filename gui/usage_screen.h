@@ -0,0 +1,13 @@
+#ifndef USAGE_SCREEN_H
+#define USAGE_SCREEN_H
+
+#include "lvgl/lvgl.h"
+
+#define USAGE_DAILY 0		// The Usage screen, with the user's showers each day
+#define USAGE_WEEKLY 1		// The Weekly screen, with the user's showers each week
+
+lv_obj_t* usage_screen_create(lv_obj_t* parent, int period);
+void usage_screen_show(int period, int index);
+void usage_screen_set_return_screen(lv_obj_t* returnscreen);
+
+#endif
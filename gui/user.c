@@ -1,20 +1,30 @@
 #include "user.h"
+#include "controller.h"
+#include "usage.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
 
-// For each user, store the name, password, image index and most three shower times
+// For each user, store the id, name, password, image index, most three shower times and shower budget
 struct user
 {
+  int id;			// Kept in the users file, so the user's usage stays with them if the file is reordered
   char name[20];
   int password;
   int image;
   struct timespec shower_times[3];
+  int budget_seconds;		// The time budget of each shower (0 for the controller's longest shower)
+  int budget_litres;		// The volume budget of each shower (0 for no volume limit)
 };
 
-#define MAX_USERS 8
 static struct user user_list[MAX_USERS];
 static int num_users = 0;
+static int shower_user = -1;	// The user who started the most recent shower
+
+// The budget of users without one in the users file
+// It is sent to the controller with each shower, which closes the valve once either is used
+#define SHOWER_TIME_BUDGET 240		// seconds (0 for the controller's longest shower)
+#define SHOWER_VOLUME_BUDGET 0		// litres (0 for no volume limit)
 
 #define MAX_IMAGES 4
 LV_IMG_DECLARE(red)
@@ -25,6 +35,24 @@ static const lv_img_dsc_t* images[MAX_IMAGES] = {
   &red, &pink, &blue, &orange
 };
 
+static const char* users_file = "/home/ubuntu/gui/users";
+
+// Return an id which no user has
+static int next_id(void)
+{
+  int id = 0;
+  for (int i = 0; i < num_users; i++)
+    if (user_list[i].id > id)
+      id = user_list[i].id;
+  return id + 1;
+}
+
+// Load and save the users in a different file, such as a copy for gui_bench
+void user_set_file(const char* path)
+{
+  users_file = path;
+}
+
 void user_load()
 {
   char* line=NULL;
@@ -34,7 +62,7 @@ void user_load()
   ssize_t read;
 
   num_users = 0;
-  FILE *fp = fopen("/home/ubuntu/gui/users", "r");
+  FILE *fp = fopen(users_file, "r");
   if (fp == NULL) {
     printf("Error opening users file");
     return;
@@ -46,6 +74,9 @@ void user_load()
     int password = 0;
     int image = 0;
     struct timespec shower[3];
+    int budget_seconds = SHOWER_TIME_BUDGET;
+    int budget_litres = SHOWER_VOLUME_BUDGET;
+    int id = 0;
 
     // Process the user's data in line, which should be comma separated
     token = strtok(line, comma);
@@ -79,47 +110,72 @@ void user_load()
         case 8: // Shower 2 tv_nsec (long int)
           shower[2].tv_nsec = atol(token);
           break;
+        case 9: // Budget seconds (optional)
+          budget_seconds = atoi(token);
+          break;
+        case 10: // Budget litres (optional)
+          budget_litres = atoi(token);
+          break;
+        case 11: // Id (optional)
+          id = atoi(token);
+          break;
       }
       token = strtok(NULL, comma);
       column++;
     }
-    if (column == 9)
-      user_create(name, password, image, shower);
+    if (column == 9 || column == 11 || column == 12)
+      user_create(name, password, image, shower, budget_seconds, budget_litres, id);
 
     read = getline(&line, &len, fp);
   }
 
   fclose(fp);
+
+  // Give users from an older file (or with a repeated id) a new id, and keep it
+  bool assigned = false;
+  for (int i = 0; i < num_users; i++) {
+    if (user_list[i].id <= 0 || user_find(user_list[i].id) != i) {
+      user_list[i].id = next_id();
+      assigned = true;
+    }
+  }
+  if (assigned)
+    user_save();
 }
 
 void user_save()
 {
-  FILE *fp = fopen("/home/ubuntu/gui/users", "w");
+  FILE *fp = fopen(users_file, "w");
   if (fp == NULL) {
     printf("Error opening users file");
     return;
   }
 
   for (int i=0; i < num_users; ++i) {
-    fprintf(fp, "%s, %d, %d, %ld, %ld, %ld, %ld, %ld, %ld\n",
+    fprintf(fp, "%s, %d, %d, %ld, %ld, %ld, %ld, %ld, %ld, %d, %d, %d\n",
       user_list[i].name, user_list[i].password, user_list[i].image,
       user_list[i].shower_times[0].tv_sec, user_list[i].shower_times[0].tv_nsec,
       user_list[i].shower_times[1].tv_sec, user_list[i].shower_times[1].tv_nsec,
-      user_list[i].shower_times[2].tv_sec, user_list[i].shower_times[2].tv_nsec);
+      user_list[i].shower_times[2].tv_sec, user_list[i].shower_times[2].tv_nsec,
+      user_list[i].budget_seconds, user_list[i].budget_litres, user_list[i].id);
   }
 
   fclose(fp);
 }
 
-int user_create(const char* name, int password, int image, struct timespec *showers)
+// Add a user, where id is 0 if they do not have one yet (user_load gives them one)
+int user_create(const char* name, int password, int image, struct timespec *showers, int budget_seconds, int budget_litres, int id)
 {
   if (num_users < MAX_USERS)
   {
+    user_list[num_users].id = id;
     strncpy(user_list[num_users].name,name,20);
     user_list[num_users].password = password;
     user_list[num_users].image = image;
     for (int i=0; i<3; i++)
       user_list[num_users].shower_times[i] = showers[i];
+    user_list[num_users].budget_seconds = budget_seconds;
+    user_list[num_users].budget_litres = budget_litres;
 
     return num_users++;
   }
@@ -132,6 +188,24 @@ int user_get_count(void)
   return num_users;
 }
 
+int user_get_id(int index)
+{
+  if (index < 0 || index >= num_users) {
+    printf("Error: Invalid index %d in user_get_id\n", index);
+    return 0;
+  }
+  return user_list[index].id;
+}
+
+// Return the index of the first user with the id, or -1 if there is none
+int user_find(int id)
+{
+  for (int i = 0; i < num_users; i++)
+    if (user_list[i].id == id)
+      return i;
+  return -1;
+}
+
 const char* user_get_name(int index)
 {
   if (index < 0 || index >= MAX_USERS) {
@@ -224,26 +298,42 @@ int user_start_shower(int user_index)
   for (int i=2; i > 1; i--)
     user_list[user_index].shower_times[i] = user_list[user_index].shower_times[i-1];
   user_list[user_index].shower_times[0] = current_time;
+  shower_user = user_index;
 
   user_save();
   return 0;
 }
 
-int user_shower_active(int user_index)
+// Set the time (seconds) and volume (litres) budget of a shower for the user, where 0 is no limit
+// (a shower without a time limit is closed after the controller's longest shower)
+void user_get_budget(int user_index, int* seconds, int* litres)
 {
   if (user_index < 0 || user_index >= MAX_USERS) {
-    printf("Error: Invalid index %d in user_start_shower\n", user_index);
-    return 0;
+    printf("Error: Invalid index %d in user_get_budget\n", user_index);
+    *seconds = SHOWER_TIME_BUDGET;
+    *litres = SHOWER_VOLUME_BUDGET;
+    return;
   }
 
-  struct timespec current_time;
-  clock_gettime(CLOCK_REALTIME, &current_time);
+  *seconds = user_list[user_index].budget_seconds;
+  *litres = user_list[user_index].budget_litres;
+}
 
-  for (int i=0; i<3; ++i)
-  {
-    int remaining_time = 240 - (current_time.tv_sec - user_list[user_index].shower_times[i].tv_sec);
-    if (remaining_time > 0 && remaining_time <= 240)
-      return remaining_time;
+// Return true while the shower started by the user is open
+// The controller closes the shower when its budget is used, so the GUI follows the controller rather than a timer
+bool user_shower_active(int user_index)
+{
+  if (user_index < 0 || user_index >= MAX_USERS) {
+    printf("Error: Invalid index %d in user_shower_active\n", user_index);
+    return false;
   }
-  return 0;
+
+  return user_index == shower_user && controller_shower_open();
+}
+
+// Add the shower which has just closed to the usage of the user who started it
+void user_finish_shower(int millilitres, int seconds)
+{
+  if (shower_user >= 0)
+    usage_record(user_list[shower_user].id, time(NULL), millilitres, seconds);
 }
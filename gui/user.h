@@ -4,15 +4,22 @@
 #include "lvgl/lvgl.h"
 #include <time.h>
 
+#define MAX_USERS 8
+
+void user_set_file(const char* path);
 void user_load();
 void user_save();
-int user_create(const char* name, int password, int image, struct timespec* shower);
+int user_create(const char* name, int password, int image, struct timespec* shower, int budget_seconds, int budget_litres, int id);
 int user_get_count(void);
+int user_get_id(int index);
+int user_find(int id);
 const char* user_get_name(int index);
 bool user_check_password(int index, int password);
 const lv_img_dsc_t* user_get_image(int index);
 int user_start_shower(int index);
 int user_get_shower_countdown(int index);
-int user_shower_active(int index);
+void user_get_budget(int index, int* seconds, int* litres);
+bool user_shower_active(int index);
+void user_finish_shower(int millilitres, int seconds);
 
 #endif
@@ -2,7 +2,7 @@
 import os
 import threading
 import time
-from datetime import datetime, timedelta
+from datetime import datetime
 import logging
 import schedule
 from PWM import PWM
@@ -13,6 +13,8 @@ scheduled_tunes = []
 pwm = PWM(0)
 # Set to True to quit the thread and service
 quit = False
+# Set to check the schedule straight away, rather than at the next second
+wake = threading.Event()
 
 # Set the log file configuration
 logging.basicConfig(format='%(asctime)s - %(message)s', level=logging.DEBUG, filename="/var/log/shower")
@@ -68,8 +70,17 @@ def play_stop():
 	pwm.enable(False)
 
 
+# Play the tone when the water becomes warm
+def play_warm():
+	logging.info("Playing Warm tune")
+	pwm.enable(True)
+	play_slide(220, 660, 0.5)
+	play_note(660, 0.25, 0.8)
+	pwm.enable(False)
+
+
 # A dictionary mapping tune numbers to the functions that play them
-tunes = {'1': play_start, '2': play_nearly_done, '3': play_stop}
+tunes = {'1': play_start, '2': play_nearly_done, '3': play_stop, '4': play_warm}
 
 
 # Add a tune to the schedule to play it at a given time
@@ -102,23 +113,24 @@ def play_tune(tune):
 
 # This thread ensures that any tunes added to the schedule are played at the appropriate time
 # It needs to be run as a separate thread to the one monitoring the pipe as readline is blocking
-# Check each second to see if any tunes need to be played
+# Check each second to see if any tunes need to be played, or straight away when woken
 def handle_schedule_thread():
 	while not quit:
 		handle_schedule()
-		time.sleep(1)
+		wake.wait(1)
+		wake.clear()
 
 
 # Handle user input from the pipe
-# Schedule the tunes for the required times
+# The Bluetooth service sends each tune as the controller reports the shower starting, nearly using
+# its budget, stopping or the water becoming warm, so the tune is played straight away
 def handle_input(input):
 	if not input:
 		return
 
-	elif input == '1':
-		schedule_tune(datetime.now(), '1')
-		schedule_tune(datetime.now() + timedelta(minutes=3), '2')
-		schedule_tune(datetime.now() + timedelta(minutes=4), '3')
+	elif input in tunes:
+		schedule_tune(datetime.now(), input)
+		wake.set()
 
 
 def create_fifo(path):
@@ -151,6 +163,7 @@ def main():
 	finally:
 		# Instruct the thread to quit and wait for it to do so
 		quit = True
+		wake.set()
 		handler.join()
 		pwm.cleanup()
 
@@ -1,28 +1,372 @@
 #include <avr/sleep.h>
+#include <avr/power.h>
+#include <avr/eeprom.h>
+#include <avr/wdt.h>
+#include <util/atomic.h>
+#include <OneWire.h>
 
 // PIN CONNECTIONS
-const int FLOW_PIN = 2;             // Signals from the Flow sensor are monitored on pin D2 (Int 0)
+const int FLOW_PIN = 2;             // Signals from the Flow sensor after the solenoid are monitored on pin D2
 const int BLUETOOTH_PIN = 3;        // Signals from the Bluetooth module are monitored on pin D3 (Int 1)
 const int SOLENOID_INPUT_A = 12;    // Control for the motor driver for the solenoid are from pins D12 and D13
 const int SOLENOID_INPUT_B = 13;    // Setting one high and the other low applies a positive or negative voltage to the solenoid
 const int VOLTAGE_PIN = A0;         // Monitor the battery voltage which is connected to A0
+const int TEMPERATURE_PIN = 4;      // The DS18B20 water temperature sensor is on a 1-Wire bus on pin D4 (with a 4.7k pull up)
 
 // GLOBAL VARIABLES FOR STORING STATE
-volatile int flow_count;      // Stores the number of water flow signals received. Each is 1/450 L.
 bool solenoid_open;           // Record whether the solenoid is currently open
-unsigned long sensorStart;    // The time the sensors were last read (used to determine when to read again)
-unsigned long showerStart;    // The time the shower was started (used to determine when to close the solenoid)
-unsigned long watchdogStart;  // The time the last control signal was received (used to determine when to sleep)
+unsigned int sequence;        // The sequence number of the next telemetry frame (lets the Raspberry Pi detect lost frames)
+uint32_t sensorStart;         // The time the sensors were last read (used to determine when to read again)
+uint32_t reportStart;         // The time the last telemetry frame was sent (used to determine when a heartbeat is due)
+uint32_t showerStart;         // The time the shower was started (used to determine when to close the solenoid)
+uint32_t showerDuration;      // How long the shower lasts (see SHOWER_DURATION), which can be changed by the Raspberry Pi
+uint32_t budgetTime;          // The time budget of the current shower in milliseconds (always set, so the valve cannot stay open forever)
+uint32_t budgetPulses;        // The volume budget of the current shower in flow pulses (0 if there is no volume limit)
+uint32_t budgetTotal;         // The flow total when the current shower was opened (used to measure the volume used)
+uint32_t showerEnd;           // The time the solenoid was last closed (used to ignore water draining from the pipes)
+uint32_t watchdogStart;       // The time the last control signal was received (used to determine when to sleep)
+
+// DIAGNOSTIC COUNTERS
+// Maintained so that battery drain can be profiled in the field, and reported in a FRAME_DIAGNOSTICS frame
+enum WakeReason { WAKE_NONE, WAKE_FLOW, WAKE_BLUETOOTH };
+volatile WakeReason wake_reason;    // Set by the wake interrupt handlers to show why the controller woke
+volatile unsigned int sleep_ticks;  // The number of watchdog periods which have passed during the current sleep
+uint32_t awakeMark;                 // The time the awake time was last added to diagnostics.awakeMillis
+unsigned int idleMicros;            // Time spent idling which has not yet been added to diagnostics.idleMillis
+uint32_t diagnosticStart;           // The time the last diagnostic frame was sent
+
+// BATTERY VOLTAGE STATE
+uint32_t voltageAverage;            // The moving average of the battery voltage readings, with VOLTAGE_AVERAGE_SHIFT fractional bits (0 before the first reading)
+unsigned int voltageMin;            // The lowest battery voltage reading since the last telemetry frame
+unsigned int voltageMax;            // The highest battery voltage reading since the last telemetry frame
+
+struct Diagnostics
+{
+  uint32_t awakeMillis;             // Time spent awake (including idling between loops)
+  uint32_t idleMillis;              // Time spent in SLEEP_MODE_IDLE between loops
+  uint32_t asleepMillis;            // Time spent in SLEEP_MODE_PWR_DOWN, counted in watchdog periods
+  unsigned int flowWakes;           // The number of times the controller was woken by flow
+  unsigned int bluetoothWakes;      // The number of times the controller was woken by bluetooth communication
+  unsigned int actuations;          // The number of solenoid pulses
+  uint32_t bytesIn;                 // The number of bytes received from the Raspberry Pi
+  uint32_t bytesOut;                // The number of bytes sent to the Raspberry Pi
+};
+Diagnostics diagnostics;
+
+// SOLENOID DRIVER STATE
+// The solenoid is latched, so it only needs a short pulse to change position. Rather than waiting for the pulse
+// to finish, the driver is a state machine which is advanced by updateSolenoid each time around the loop:
+//   SOLENOID_IDLE -> writeSolenoid -> SOLENOID_START -> SOLENOID_HOLD -> pulse duration elapsed -> SOLENOID_IDLE
+enum SolenoidState { SOLENOID_IDLE, SOLENOID_START, SOLENOID_HOLD };
+SolenoidState solenoid_state;       // The current step of the solenoid pulse
+bool solenoid_target;               // The position most recently requested by writeSolenoid
+bool solenoid_driven;               // The position the current pulse is driving the solenoid to
+uint32_t solenoidRequest;           // The time the most recent position was requested
+uint32_t pulseRequest;              // The time the position being driven now was requested
+byte solenoidRequestId;             // The id of the command which requested the most recent position (0 if not requested by a command)
+byte pulseRequestId;                // The id of the command which requested the position being driven now
+uint32_t pulseStart;                // The time the current pulse started
 
 // CONSTANTS
-const float REFERENCE_VOLTAGE = 2.49;                             // The reference voltage to use (internal is 5V, external is calibrated to 2.49V)
-const float ADC_RESOLUTION = 1024.0;                              // The number of gradations of the ADC.
-const float VOLT_VOLTAGE_DIVIDER = 30000.0/(30000.0+200000.0);    // The resistor divider which reduces the voltage from the battery
-const float PULSES_PER_LITRE = 450.0;                             // The number of pulses from the flow sensor per litre of flow
-const unsigned long SOLENOID_PULSE_DURATION = 20;                 // Change the solenoid position with a 20 millisecond pulse
-const unsigned long SENSOR_READ_INTERVAL = 1000;                  // Read the sensors every second (value in milliseconds)
-const unsigned long SHOWER_DURATION   = 240000;                   // The shower will lock 4 minutes after being started (value in milliseconds)
-const unsigned long WATCHDOG_DURATION = 10000;                    // If the solenoid is closed, the device will sleep after 10 seconds of inactivity (value in milliseconds)
+const uint32_t REFERENCE_MILLIVOLTS = 2490;                       // The reference voltage to use (internal is 5V, external is calibrated to 2.49V)
+const uint32_t ADC_RESOLUTION = 1024;                             // The number of gradations of the ADC.
+const byte VOLTAGE_OVERSAMPLE_BITS = 2;                           // Oversampling by 4^2 = 16 samples adds 2 bits of resolution to the battery voltage
+const byte VOLTAGE_SAMPLES = 1 << (2 * VOLTAGE_OVERSAMPLE_BITS);  // The number of ADC samples taken for each battery voltage reading
+const uint32_t VOLTAGE_RESOLUTION = ADC_RESOLUTION << VOLTAGE_OVERSAMPLE_BITS;        // The number of gradations of a battery voltage reading
+const byte VOLTAGE_AVERAGE_SHIFT = 3;                             // The battery voltage is a moving average over roughly 2^3 = 8 readings
+const uint32_t DIVIDER_HIGH_OHMS = 200000;                        // The resistor divider which reduces the voltage from the battery
+const uint32_t DIVIDER_LOW_OHMS = 30000;                          // (the battery voltage is measured across the low resistor)
+const unsigned int PULSES_PER_LITRE = 450;                        // The number of pulses from the flow sensor per litre of flow
+const unsigned int LOW_BATTERY_MILLIVOLTS = 12000;                // Below this battery voltage the telemetry reports a low battery
+const uint32_t FLOW_TIMEOUT_MICROS = 2000000;                     // If no flow signal arrives for 2 seconds, the flow has stopped
+const byte FLOW_AVERAGE_SHIFT = 3;                                // The flow period is averaged over roughly 2^3 = 8 signals
+const uint32_t SOLENOID_PULSE_DURATION = 20;                      // Change the solenoid position with a 20 millisecond pulse
+const uint32_t SENSOR_READ_INTERVAL = 1000;                       // Read the sensors every second, and report them if they have changed (value in milliseconds)
+const uint32_t HEARTBEAT_INTERVAL = 10000;                        // Report the sensors every 10 seconds even if nothing has changed (value in milliseconds)
+const uint32_t FLOW_DEADBAND = 0;                                 // Report if more than this many flow pulses have been counted since the last report
+const unsigned int RATE_DEADBAND = 100;                           // Report if the flow rate has changed by more than 100 mL/min
+const unsigned int VOLTAGE_DEADBAND = 16;                         // Report if the voltage count has changed by more than 16 (about 75 mV)
+const uint32_t DIAGNOSTIC_INTERVAL = 60000;                       // Send the diagnostic counters every minute while awake (value in milliseconds)
+const uint32_t SLEEP_CLOCK_PERIOD = 1024;                         // While asleep the watchdog wakes the controller briefly every 1.024 s (128K cycles at 128 kHz) to count the time asleep
+const unsigned int LOW_BATTERY_HYSTERESIS = 200;                  // The battery must recover 200 mV above LOW_BATTERY_MILLIVOLTS to clear the low battery flag
+const uint32_t SHOWER_DURATION   = 240000;                        // The time budget of a shower opened without one, 4 minutes (value in milliseconds)
+const uint32_t WATCHDOG_DURATION = 10000;                         // If the solenoid is closed, the device will sleep after 10 seconds of inactivity (value in milliseconds)
+const uint32_t LEAK_WINDOW = 1000;                                // Flow while the solenoid is closed is counted in 1 second windows (value in milliseconds)
+const uint32_t LEAK_PULSES = 1;                                   // A window with more than this many pulses (2 or more a second, at least 267 mL/min) counts towards a leak
+const byte LEAK_WINDOWS = 5;                                      // A leak is reported after 5 windows in a row, so 5 seconds of flow
+const uint32_t LEAK_SETTLE_TIME = 5000;                           // Water draining after the solenoid closes is not a leak, so wait 5 seconds before counting (value in milliseconds)
+const uint32_t TEMPERATURE_INTERVAL = 1000;                       // Start a temperature conversion every second, or straight after the last during a shower (value in milliseconds)
+const uint32_t TEMPERATURE_POLL_INTERVAL = 10;                    // Check whether the conversion has finished every 10 milliseconds
+const uint32_t TEMPERATURE_TIMEOUT = 1000;                        // A 12 bit conversion takes up to 750 ms, so give up after 1 second (value in milliseconds)
+const int TEMPERATURE_NONE = -32768;                              // Reported when the temperature could not be read
+const int WARM_TEMPERATURE = 35 * 16;                             // The water is warm from 35 degrees C (value in 1/16 degrees C)
+const int WARM_HYSTERESIS = 2 * 16;                               // The water must cool 2 degrees C below WARM_TEMPERATURE to be cold again
+const unsigned int TEMPERATURE_DEADBAND = 8;                      // Report if the temperature has changed by more than 0.5 degrees C
+const uint32_t LEAK_REPEAT_INTERVAL = 60000;                      // Repeat the leak frame every minute while the leak continues, in case one is lost (value in milliseconds)
+
+// TELEMETRY FRAMES
+// Readings are sent to the Raspberry Pi as binary frames rather than text, which keeps the airtime short
+// and avoids formatting floating point numbers on the ATmega328P. Each frame has the layout
+//   SYNC | VERSION | TYPE | LENGTH | PAYLOAD (LENGTH bytes) | CRC (2 bytes)
+// The CRC-16/CCITT covers everything after the SYNC byte, so the receiver can discard corrupted frames and
+// resynchronise on the next SYNC byte. All multi-byte fields are sent least significant byte first.
+const byte FRAME_SYNC = 0xA5;                                     // Marks the start of every frame
+const byte FRAME_VERSION = 7;                                     // Incremented whenever the layout of a payload changes
+const byte FRAME_MAX_PAYLOAD = 48;                                // The largest payload that can be sent in one frame
+const byte FRAME_TELEMETRY = 0x01;                                // Periodic sensor readings (see sendTelemetry)
+const byte FRAME_ACTUATION = 0x02;                                // Sent when the solenoid finishes changing position (see sendActuation)
+const byte FRAME_RECORD = 0x03;                                   // A telemetry record resent from the log on request (see updateBackfill)
+const byte FRAME_DIAGNOSTICS = 0x04;                              // The diagnostic counters (see sendDiagnostics)
+const byte FRAME_ACK = 0x05;                                      // A command has been accepted (see sendReply)
+const byte FRAME_NACK = 0x06;                                     // A command has been rejected (see sendReply)
+const byte FRAME_LEAK = 0x07;                                     // Water is flowing while the solenoid is closed (see sendLeak)
+const byte FRAME_WARM = 0x08;                                     // The water has become warm during a shower (see sendWarm)
+
+// Bits in the flags byte of the telemetry frame
+const byte FLAG_SOLENOID_OPEN = 0x01;                             // Set while the solenoid valve is open
+
+const byte FLAG_LOW_BATTERY = 0x02;                               // Set while the battery is below LOW_BATTERY_MILLIVOLTS
+const byte FLAG_SOLENOID_MOVING = 0x04;                           // Set while a solenoid pulse is pending or in progress
+const byte FLAG_FLOWING = 0x08;                                   // Set while water is flowing through any channel
+const byte FLAG_EVENT = 0x10;                                     // Set when the frame was sent immediately because one of the EVENT_FLAGS changed
+const byte FLAG_LEAK = 0x20;                                      // Set while a leak is detected
+const byte FLAG_WARM = 0x40;                                      // Set while the water is warm
+const byte EVENT_FLAGS = FLAG_SOLENOID_OPEN | FLAG_LOW_BATTERY | FLAG_FLOWING | FLAG_LEAK | FLAG_WARM;
+
+const byte TELEMETRY_SIZE = 29;                                   // The payload of a telemetry frame with one flow channel
+const byte CHANNEL_SIZE = 6;                                      // The payload added for each further flow channel
+
+unsigned int reportVoltage;
+int reportTemperature;
+byte reportFlags;
+bool low_battery;                   // Whether the battery is low (with hysteresis, so the flag does not flicker)
+
+// Reporting intervals and deadbands, which can be changed while running
+uint32_t sensorInterval;            // How often the sensors are read (see SENSOR_READ_INTERVAL)
+uint32_t heartbeatInterval;         // The longest time between reports (see HEARTBEAT_INTERVAL)
+uint32_t flowDeadband;              // See FLOW_DEADBAND
+unsigned int rateDeadband;          // See RATE_DEADBAND
+unsigned int voltageDeadband;       // See VOLTAGE_DEADBAND
+unsigned int temperatureDeadband;   // See TEMPERATURE_DEADBAND
+
+// WATER TEMPERATURE
+// The DS18B20 takes up to 750 ms to convert a temperature. Rather than waiting for it, updateTemperature starts
+// a conversion and then polls the bus on later loops (the sensor reads 0 until it has finished).
+// DS18B20 commands (the sensor is alone on the bus, so it is addressed with SKIP ROM)
+const byte DS18B20_CONVERT = 0x44;
+const byte DS18B20_READ_SCRATCHPAD = 0xBE;
+enum TemperatureState { TEMPERATURE_IDLE, TEMPERATURE_CONVERTING };
+OneWire temperatureBus(TEMPERATURE_PIN);
+TemperatureState temperature_state;
+uint32_t temperatureStart;          // The time the last conversion was started
+uint32_t temperaturePoll;           // The time the bus was last checked for the end of the conversion
+int temperature;                    // The water temperature in 1/16 degrees C (TEMPERATURE_NONE if it could not be read)
+bool warm_water;                    // Whether the water is warm (with hysteresis, so the flag does not flicker)
+bool warmReported;                  // Whether FRAME_WARM has been sent for this shower
+
+// LEAK DETECTION
+// While the solenoid is closed no water should flow, so the flow pulses are counted in LEAK_WINDOW windows.
+// LEAK_WINDOWS busy windows in a row is a leak, which is reported straight away in a FRAME_LEAK frame
+// rather than waiting for the Raspberry Pi to notice it in the log.
+uint32_t leakWindowStart;           // The time the current window started
+uint32_t leakWindowTotal;           // The flow total at the start of the current window
+uint32_t leakStartTotal;            // The flow total at the start of the first busy window in a row
+uint32_t leakStart;                 // The time the first busy window in a row started
+byte leakWindows;                   // The number of busy windows in a row
+bool leak_detected;                 // Whether a leak has been reported and water is still flowing
+uint32_t leakReported;              // The time the last FRAME_LEAK frame was sent
+
+byte frame[FRAME_MAX_PAYLOAD + 6];  // The frame currently being assembled
+byte frameLength;                   // The number of bytes written to frame so far
+
+// TELEMETRY LOG
+// Each telemetry frame is also kept in a ring of records in EEPROM, so readings missed while the bluetooth
+// link is down can be requested again by sequence number. A record is the start of the telemetry payload
+// (sequence, millis, flow total, flow rate, voltage count and flags) followed by a check byte.
+// The ring is written in order, so each slot is only rewritten once per lap (wear levelling), and the newest
+// record is found at boot from the sequence numbers. A record takes about 16 x 3.3 ms to write, so new records
+// wait in a small queue in RAM and are written one byte per loop while the EEPROM is ready, which means the
+// EEPROM write time never blocks the loop, even when frames follow each other closely.
+const byte LOG_PAYLOAD_SIZE = 15;                                 // The number of telemetry payload bytes kept in each record
+const byte LOG_RECORD_SIZE = 16;                                  // The payload plus a check byte
+const byte LOG_RECORDS = (E2END + 1) / LOG_RECORD_SIZE;           // The number of records in the ring (64 on the ATmega328P)
+const byte LOG_QUEUE = 4;                                         // The number of records which can wait to be written
+
+byte logQueue[LOG_QUEUE][LOG_RECORD_SIZE];  // Records waiting to be written to EEPROM, oldest first from logHead
+byte logHead;                       // The position in logQueue of the record being written
+byte logQueued;                     // The number of records in logQueue
+byte logWritten;                    // The number of bytes of the record at logHead written so far
+byte logSlot;                       // The slot the record at logHead will be written to
+unsigned int backfillSequence;      // The sequence number of the next record to resend
+byte backfillRemaining;             // The number of records still to resend
+
+// COMMANDS
+// The Raspberry Pi sends commands using the same frame layout as telemetry. The first byte of every command payload
+// is a request id (1 to 255), which is returned in the FRAME_ACK or FRAME_NACK reply so the Raspberry Pi can match
+// replies to requests and retry requests which were not acknowledged. A repeat of the last request within
+// RETRY_WINDOW is acknowledged again without being repeated, so a retry after a lost acknowledgement is harmless.
+// Older repeats are carried out, as the Raspberry Pi has stopped retrying and an id may be reused.
+// A shower opened with a volume budget and no time limit is still closed after MAX_SHOWER_DURATION, in case the water never flows.
+const byte COMMAND_OPEN = 0x81;                                   // Open the solenoid for the shower duration, or for a budget: milliseconds (4) and millilitres (4), 0 for no limit
+const byte COMMAND_CLOSE = 0x82;                                  // Close the solenoid now
+const byte COMMAND_STATUS = 0x83;                                 // Send a telemetry frame now
+const byte COMMAND_SET_DURATION = 0x84;                           // Set the time budget of showers opened without one: milliseconds (4)
+const byte COMMAND_SET_REPORTING = 0x85;                          // Set the reporting intervals: sensor interval (2) and heartbeat interval (4) in milliseconds, then optionally the flow, rate, voltage and temperature deadbands (2 each)
+const byte COMMAND_DIAGNOSTICS = 0x86;                            // Send a diagnostics frame now
+const byte COMMAND_BACKFILL = 0x87;                               // Resend records from the log: first sequence number (2) and number of records (1)
+
+// Reasons a command is rejected, sent in the FRAME_NACK reply
+const byte NACK_UNKNOWN_COMMAND = 1;                              // The command type is not recognised
+const byte NACK_BAD_LENGTH = 2;                                   // The payload is the wrong length for the command
+const byte NACK_BAD_VALUE = 3;                                    // A value in the payload is out of range
+
+const uint32_t COMMAND_TIMEOUT = 250;                             // A partly received command is discarded after 250 ms
+const uint32_t RETRY_WINDOW = 5000;                               // The Raspberry Pi stops retrying a request after about 3 seconds (value in milliseconds)
+const uint32_t MIN_SENSOR_INTERVAL = 100;                         // The shortest sensor interval which can be set (value in milliseconds)
+const uint32_t MAX_SHOWER_DURATION = 1800000;                     // The longest shower duration which can be set, 30 minutes (value in milliseconds)
+const uint32_t MAX_SHOWER_VOLUME = 300000;                        // The largest volume budget which can be set, 300 L (value in millilitres)
+const uint32_t BUDGET_NONE = 0xFFFFFFFF;                          // Reported as the remaining budget when there is no limit
+
+byte command[FRAME_MAX_PAYLOAD + 6];  // The command frame being received
+byte commandLength;                   // The number of bytes of the command received so far
+uint32_t commandStart;                // The time the first byte of the command was received
+byte lastRequestId;                   // The id and type of the last command carried out, used to recognise a retry (id 0 if there is none)
+byte lastRequestType;
+uint32_t lastRequestTime;             // The time the last command was carried out
+bool statusRequested;                 // Set when a telemetry frame should be sent now
+
+// FIXED POINT CONVERSIONS
+// The ATmega328P has no floating point unit, so readings are converted with an integer multiply and shift.
+// Each scale factor is the conversion ratio with 16 fractional bits, and is calculated by the compiler
+// for the sensor and divider configuration, so no division is done at run time.
+const byte FIXED_SHIFT = 16;
+
+// fixedScale - Calculate the fixed point scale factor numerator / denominator at compile time
+constexpr uint32_t fixedScale(unsigned long long numerator, unsigned long long denominator)
+{
+  return (uint32_t)(((numerator << FIXED_SHIFT) + denominator / 2) / denominator);
+}
+
+// A battery voltage divider measured against the ADC reference
+// The measured voltage is count * reference / resolution, and the battery voltage is that scaled by (high + low) / low
+template <uint32_t HighOhms, uint32_t LowOhms, uint32_t ReferenceMillivolts, uint32_t Resolution>
+struct VoltageDivider
+{
+  static constexpr uint32_t MILLIVOLTS_PER_COUNT = fixedScale(ReferenceMillivolts * (HighOhms + LowOhms), Resolution * LowOhms);
+
+  static unsigned int toMillivolts(unsigned int count)
+  {
+    return ((uint32_t)count * MILLIVOLTS_PER_COUNT) >> FIXED_SHIFT;
+  }
+};
+
+// A flow sensor connected to a pin, with the conversion factors for its calibration
+struct FlowChannel
+{
+  byte pin;
+  unsigned int pulsesPerLitre;
+  uint32_t millilitresPerPulse;       // With FIXED_SHIFT fractional bits
+  uint32_t rateNumerator;             // The flow rate in mL/min is rateNumerator / period in us
+};
+
+// A flow sensor which produces PulsesPerLitre pulses for each litre of flow
+template <unsigned int PulsesPerLitre>
+struct FlowSensor
+{
+  static constexpr uint32_t MILLILITRES_PER_PULSE = fixedScale(1000, PulsesPerLitre);
+
+  // The flow rate in mL/min is 1000 mL/L * 60000000 us/min / (PulsesPerLitre * period in us)
+  static constexpr uint32_t RATE_NUMERATOR = 60000000000ULL / PulsesPerLitre;
+  static_assert(60000000000ULL / PulsesPerLitre <= 0xFFFFFFFFUL, "Flow rate numerator must fit in 32 bits");
+
+  // on - Describe a sensor of this type connected to a pin
+  static constexpr FlowChannel on(byte pin)
+  {
+    return { pin, PulsesPerLitre, MILLILITRES_PER_PULSE, RATE_NUMERATOR };
+  }
+};
+
+typedef VoltageDivider<DIVIDER_HIGH_OHMS, DIVIDER_LOW_OHMS, REFERENCE_MILLIVOLTS, VOLTAGE_RESOLUTION> BatteryVoltage;
+
+// FLOW CHANNELS
+// Each flow sensor is a channel with its own calibration and totalizer. The sensors are all on port D, and are
+// counted by the port's pin change interrupt, which also wakes the controller from SLEEP_MODE_PWR_DOWN.
+// Channel 0 is the water through the solenoid, which the shower budget and leak detection measure.
+// To add a sensor, add its pin and calibration to the table (telemetry carries every channel in one frame).
+// Only add sensors which are fitted, as every channel is reported whether or not a sensor is connected to its pin.
+constexpr FlowChannel FLOW_CHANNELS[] = {
+  FlowSensor<PULSES_PER_LITRE>::on(FLOW_PIN),             // The shower, after the solenoid
+  // FlowSensor<660>::on(5),                              // For example, a 660 pulse per litre sensor on the hot water line on D5
+};
+const byte FLOW_CHANNEL_COUNT = sizeof(FLOW_CHANNELS) / sizeof(FLOW_CHANNELS[0]);
+const byte SHOWER_CHANNEL = 0;
+
+// flowMask - Calculate the port D bits of the flow channels from the given channel onwards at compile time
+constexpr byte flowMask(byte channel)
+{
+  return channel < FLOW_CHANNEL_COUNT ? _BV(FLOW_CHANNELS[channel].pin) | flowMask(channel + 1) : 0;
+}
+
+// flowPinsValid - Check at compile time that the flow channels from the given channel onwards are free pins on port D
+constexpr bool flowPinsValid(byte channel)
+{
+  return channel >= FLOW_CHANNEL_COUNT ||
+         (FLOW_CHANNELS[channel].pin >= 2 && FLOW_CHANNELS[channel].pin <= 7 &&
+          FLOW_CHANNELS[channel].pin != BLUETOOTH_PIN && FLOW_CHANNELS[channel].pin != TEMPERATURE_PIN &&
+          flowPinsValid(channel + 1));
+}
+
+const byte FLOW_MASK = flowMask(0);
+static_assert(flowPinsValid(0), "Flow sensors must be on port D (D2 to D7), away from the serial, bluetooth and temperature pins");
+const byte TELEMETRY_PAYLOAD = TELEMETRY_SIZE + (FLOW_CHANNEL_COUNT - 1) * CHANNEL_SIZE;
+static_assert(TELEMETRY_PAYLOAD <= FRAME_MAX_PAYLOAD, "Every flow channel must fit in one telemetry frame");
+
+volatile uint32_t flow_total[FLOW_CHANNEL_COUNT];           // The number of flow signals received since boot. Read with readFlowTotal.
+volatile uint32_t flow_edge_time[FLOW_CHANNEL_COUNT];       // The time of the most recent flow signal in microseconds
+volatile uint32_t flow_period[FLOW_CHANNEL_COUNT];          // The moving average of the time between flow signals in microseconds (0 if unknown)
+volatile byte flow_pins;                                    // The level of the flow pins at the last pin change
+
+// The readings in the last telemetry frame, used to decide whether anything has changed enough to report
+uint32_t reportTotal[FLOW_CHANNEL_COUNT];
+unsigned int reportRate[FLOW_CHANNEL_COUNT];
+
+
+// toMillilitres - Convert a number of flow pulses to a volume
+// Params:
+//   channel - the flow channel
+//   pulses - the number of pulses
+// Returns: the volume in mL
+//
+// Whole litres are converted separately so that large totals cannot overflow the multiplication
+uint32_t toMillilitres(byte channel, uint32_t pulses)
+{
+  const FlowChannel& sensor = FLOW_CHANNELS[channel];
+  return (pulses / sensor.pulsesPerLitre) * 1000 + (((pulses % sensor.pulsesPerLitre) * sensor.millilitresPerPulse) >> FIXED_SHIFT);
+}
+
+
+// toPulses - Convert a volume to a number of flow pulses
+// Params:
+//   channel - the flow channel
+//   millilitres - the volume in mL
+// Returns: the number of pulses
+uint32_t toPulses(byte channel, uint32_t millilitres)
+{
+  const FlowChannel& sensor = FLOW_CHANNELS[channel];
+  return (millilitres / 1000) * sensor.pulsesPerLitre + (millilitres % 1000) * sensor.pulsesPerLitre / 1000;
+}
+
+
+// toMillilitresPerMinute - Convert the time between flow pulses to a flow rate
+// Params:
+//   channel - the flow channel
+//   periodMicros - the time between pulses in microseconds
+// Returns: the flow rate in mL/min (at most 0xFFFF)
+unsigned int toMillilitresPerMinute(byte channel, uint32_t periodMicros)
+{
+  uint32_t rate = FLOW_CHANNELS[channel].rateNumerator / periodMicros;
+  return rate > 0xFFFF ? 0xFFFF : rate;
+}
 
 // setup - Set up the ATmega328P, with global variables and pins in a known state
 // Params: None
@@ -38,138 +382,1198 @@ void setup() {
   digitalWrite(SOLENOID_INPUT_B, LOW);
   pinMode(SOLENOID_INPUT_A, OUTPUT);      // and have them ready for output
   pinMode(SOLENOID_INPUT_B, OUTPUT);
-  writeSolenoid(solenoid_open);           // Send a signal to the solenoid so it also is in a known state
+  solenoid_state = SOLENOID_IDLE;
+  writeSolenoid(solenoid_open, 0);        // Send a signal to the solenoid so it also is in a known state
 
   // Setting analogReference to EXTERNAL must be called before reading from the analog pins to prevent a short circuit
   pinMode(VOLTAGE_PIN, INPUT);            // The system will read the divided battery voltage from the voltage pin
   analogReference(EXTERNAL);              // and use the external voltage reference for calibration
+  voltageAverage = 0;                     // There are no battery readings yet
+  voltageMin = 0xFFFF;
+  voltageMax = 0;
 
-  flow_count = 0;                         // On boot, the measured flow is 0L
-  pinMode(FLOW_PIN, INPUT);               // Use the pin for input, and register the interrupt for handling flow signals.
-  attachInterrupt(digitalPinToInterrupt(FLOW_PIN), measureWaterFlow, RISING);
+  for (byte channel = 0; channel < FLOW_CHANNEL_COUNT; channel++) {
+    flow_total[channel] = 0;              // On boot, the measured flow is 0L
+    flow_period[channel] = 0;             // and the flow rate is unknown
+    reportTotal[channel] = 0;
+    reportRate[channel] = 0;
+  }
+  restoreLog();                           // Telemetry frames continue from the sequence number of the newest record in the log
+  backfillRemaining = 0;
+  commandLength = 0;                      // No command has been received yet
+  lastRequestId = 0;
+  statusRequested = false;
+  // Use the flow pins for input (pulled up, so a pin with no sensor connected stays quiet),
+  // and enable the pin change interrupt for handling flow signals
+  for (byte channel = 0; channel < FLOW_CHANNEL_COUNT; channel++)
+    pinMode(FLOW_CHANNELS[channel].pin, INPUT_PULLUP);
+  flow_pins = PIND & FLOW_MASK;
+  PCMSK2 = FLOW_MASK;
+  PCICR |= _BV(PCIE2);
 
   pinMode(BLUETOOTH_PIN, INPUT);          // Similarly, set the Bluetooth monitor pin to input and ensure it is low.
   digitalWrite(BLUETOOTH_PIN, LOW);
 
+  // Turn off the peripherals which are not used, so they draw no current while the controller is awake
+  power_spi_disable();
+  power_twi_disable();
+  power_timer1_disable();
+  power_timer2_disable();
+
+  low_battery = false;
+  temperature_state = TEMPERATURE_IDLE;
+  temperatureStart = millis() - TEMPERATURE_INTERVAL;   // Start the first conversion now
+  temperature = TEMPERATURE_NONE;
+  reportTemperature = TEMPERATURE_NONE;
+  warm_water = false;
+  warmReported = false;
+  leak_detected = false;
+  leakWindows = 0;
+  leakWindowStart = millis();
+  leakWindowTotal = 0;
+  reportFlags = 0;
+  sensorInterval = SENSOR_READ_INTERVAL;
+  heartbeatInterval = HEARTBEAT_INTERVAL;
+  flowDeadband = FLOW_DEADBAND;
+  rateDeadband = RATE_DEADBAND;
+  voltageDeadband = VOLTAGE_DEADBAND;
+  temperatureDeadband = TEMPERATURE_DEADBAND;
+  memset(&diagnostics, 0, sizeof(diagnostics));
+  wake_reason = WAKE_NONE;
+  awakeMark = millis();
+  diagnosticStart = millis();
+  idleMicros = 0;
+
   sensorStart = millis() - SENSOR_READ_INTERVAL;  // The sensors are ready to be read again now
+  reportStart = millis() - HEARTBEAT_INTERVAL;    // and the first reading will be reported
+  showerDuration = SHOWER_DURATION;
+  budgetTime = SHOWER_DURATION;
+  budgetPulses = 0;
+  budgetTotal = 0;
   showerStart = millis() - SHOWER_DURATION;       // Set the shower start time to 4 minutes before now, which corresponds to the state where the solenoid is closed.
+  showerEnd = millis() - LEAK_SETTLE_TIME;        // and the pipes have already drained
   watchdogStart = millis() - WATCHDOG_DURATION;   // Set the watchdog start time so that the system will go to sleep until it is woken by the controller.
 }
 
 
-// writeSolenoid - Set the solenoid valve to the desired state
-// Params: Open - a boolean that represents whether the solenoid should be opened (otherwise it is closed)
+// writeSolenoid - Request the solenoid valve to change to the desired state
+// Params:
+//   Open - a boolean that represents whether the solenoid should be opened (otherwise it is closed)
+//   requestId - the id of the command making the request, reported with the actuation (0 if not requested by a command)
+// Returns: Nothing
+//
+// The pulse is started by updateSolenoid, so this returns immediately. If a pulse is already in progress,
+// the new position is driven once it completes.
+void writeSolenoid(bool Open, byte requestId)
+{
+  solenoid_target = Open;
+  solenoidRequest = millis();
+  solenoidRequestId = requestId;
+  if (solenoid_state == SOLENOID_IDLE)
+    solenoid_state = SOLENOID_START;
+}
+
+
+// updateSolenoid - Advance the solenoid pulse state machine
+// Params: None
 // Returns: Nothing
 //
 // Send a pulse to SOLENOID_INPUT_B to close, or SOLENOID_INPUT_A to open
-// Then leave both pins LOW to prevent drawing power while the latched solenoid maintains the open or closed state
-void writeSolenoid(bool Open)
+// Once the pulse has lasted SOLENOID_PULSE_DURATION, leave both pins LOW to prevent drawing power
+// while the latched solenoid maintains the open or closed state, and report the actuation
+void updateSolenoid()
 {
-  digitalWrite(SOLENOID_INPUT_A, Open ? LOW : HIGH);
-  digitalWrite(SOLENOID_INPUT_B, Open ? HIGH : LOW);
+  uint32_t currentTime = millis();
 
-  // Wait to allow time for the solenoid valve to change its position
-  float startTime = millis();
-  while ((millis() - startTime) < SOLENOID_PULSE_DURATION);
-  
-  digitalWrite(SOLENOID_INPUT_A, LOW);
-  digitalWrite(SOLENOID_INPUT_B, LOW);
+  switch (solenoid_state) {
+  case SOLENOID_START:
+    solenoid_driven = solenoid_target;
+    pulseRequest = solenoidRequest;
+    pulseRequestId = solenoidRequestId;
+    pulseStart = currentTime;
+    digitalWrite(SOLENOID_INPUT_A, solenoid_driven ? LOW : HIGH);
+    digitalWrite(SOLENOID_INPUT_B, solenoid_driven ? HIGH : LOW);
+    solenoid_state = SOLENOID_HOLD;
+    break;
+
+  case SOLENOID_HOLD:
+    // Wait to allow time for the solenoid valve to change its position
+    if ((currentTime - pulseStart) >= SOLENOID_PULSE_DURATION) {
+      digitalWrite(SOLENOID_INPUT_A, LOW);
+      digitalWrite(SOLENOID_INPUT_B, LOW);
+      diagnostics.actuations++;
+      sendActuation(currentTime);
+      // A request for the other position may have arrived during the pulse
+      solenoid_state = (solenoid_target != solenoid_driven) ? SOLENOID_START : SOLENOID_IDLE;
+    }
+    break;
+
+  case SOLENOID_IDLE:
+    break;
+  }
 }
 
-// measureWaterFlow - Interrupt handler to record another signal from the flow sensor
-// Params: None
+// measureWaterFlow - Record another signal from a flow sensor
+// Params:
+//   channel - the flow channel
+//   now - the time of the signal in microseconds
 // Returns: None
 //
-// The interrupt handler is called each time 1/450 L of flow is detected.
-// Increment the counter each time. This will be read and reset in the main loop each second.
-void measureWaterFlow()
+// Called from the pin change interrupt handler each time a sensor detects 1/pulsesPerLitre L of flow.
+// Increment the totalizer, and timestamp the signal so the flow rate can be calculated from the time between signals.
+// The period is kept as a moving average, using shifts so the handler stays short.
+void measureWaterFlow(byte channel, uint32_t now)
+{
+  uint32_t period = now - flow_edge_time[channel];
+  flow_edge_time[channel] = now;
+  flow_total[channel]++;
+
+  if (period >= FLOW_TIMEOUT_MICROS)
+    flow_period[channel] = 0;   // This is the first signal after the flow stopped, so there is no period yet
+  else if (flow_period[channel] == 0)
+    flow_period[channel] = period;  // Start the average from the first measured period
+  else
+    flow_period[channel] = flow_period[channel] - (flow_period[channel] >> FLOW_AVERAGE_SHIFT) + (period >> FLOW_AVERAGE_SHIFT);
+}
+
+
+// Pin change interrupt handler - Record the signals from the flow sensors on port D
+//
+// The interrupt is raised by both edges of every flow pin, so the pins which have risen since the last
+// change are found by comparing with their previous level. Flow also wakes the controller while it is asleep.
+ISR(PCINT2_vect)
+{
+  byte pins = PIND & FLOW_MASK;
+  byte rising = pins & ~flow_pins;
+  flow_pins = pins;
+  if (rising == 0)
+    return;
+
+  uint32_t now = micros();
+  for (byte channel = 0; channel < FLOW_CHANNEL_COUNT; channel++)
+    if (rising & _BV(FLOW_CHANNELS[channel].pin))
+      measureWaterFlow(channel, now);
+  if (wake_reason == WAKE_NONE)
+    wake_reason = WAKE_FLOW;
+}
+
+
+// readFlowTotal - Get the number of flow sensor pulses which have been measured since boot
+// Params: channel - the flow channel
+// Returns: The number of pulses (each pulse is 1/pulsesPerLitre L)
+//
+// The 32 bit total is updated by the interrupt handler, so it is copied with interrupts disabled
+// to ensure all four bytes come from the same count. The total is never reset, so the volume over
+// any interval is the difference between two readings, even if a reading is missed.
+uint32_t readFlowTotal(byte channel)
+{
+  uint32_t total;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    total = flow_total[channel];
+  }
+  return total;
+}
+
+
+// readFlowRate - Get the current flow rate
+// Params: channel - the flow channel
+// Returns: The flow rate in mL/min
+//
+// The rate is calculated from the average time between flow signals, so it is available
+// well within the reporting interval. If the time since the last signal is longer than the
+// average period the flow is slowing, so that time is used instead.
+unsigned int readFlowRate(byte channel)
 {
-  flow_count++;
+  uint32_t period;
+  uint32_t edge;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    period = flow_period[channel];
+    edge = flow_edge_time[channel];
+  }
+
+  uint32_t elapsed = micros() - edge;
+  if (period == 0 || elapsed >= FLOW_TIMEOUT_MICROS)
+    return 0;
+  if (elapsed > period)
+    period = elapsed;
+  return toMillilitresPerMinute(channel, period);
 }
 
 
-// readFlowRate - Get the volume of water which has been measured since the last call
+// isFlowing - Check whether water is flowing through any channel
 // Params: None
-// Returns: None
+// Returns: true if a flow signal has arrived on any channel within FLOW_TIMEOUT_MICROS
+//
+// This is checked every loop, so it only compares the time of the last signal rather than calculating the rates
+bool isFlowing()
+{
+  uint32_t now = micros();
+  for (byte channel = 0; channel < FLOW_CHANNEL_COUNT; channel++) {
+    uint32_t period;
+    uint32_t edge;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      period = flow_period[channel];
+      edge = flow_edge_time[channel];
+    }
+    if (period != 0 && (now - edge) < FLOW_TIMEOUT_MICROS)
+      return true;
+  }
+  return false;
+}
+
+
+// serialIdle - Check that nothing is being sent or received on the serial port
+// Params: None
+// Returns: true if the transmit buffer is empty, the last byte has been shifted out and no byte is arriving
+//
+// SLEEP_MODE_ADC stops the USART with the I/O clock, so a byte being sent would be cut off, and a byte arriving
+// would be lost (the USART cannot wake the CPU from this mode). The bluetooth pin is low while a byte arrives.
+bool serialIdle()
+{
+  return Serial.availableForWrite() == SERIAL_TX_BUFFER_SIZE - 1 && (UCSR0A & _BV(TXC0)) && digitalRead(BLUETOOTH_PIN) == HIGH;
+}
+
+
+// sampleVoltage - Take one battery voltage reading with reduced noise
+// Params: None
+// Returns: the sum of VOLTAGE_SAMPLES ADC counts, decimated to VOLTAGE_RESOLUTION
+//
+// While the serial port is idle each conversion is made in SLEEP_MODE_ADC, which stops the CPU and I/O clocks
+// so their switching noise does not disturb the measurement. Entering the sleep mode starts the conversion,
+// and the ADC interrupt wakes the CPU when it completes. Otherwise the conversion is started and polled,
+// so frames already queued are not corrupted. Summing 4^n samples and shifting right by n adds n bits of resolution.
+// Timer0 is stopped during the sleeping conversions, so millis() loses up to about 1.7 ms for each reading.
+unsigned int sampleVoltage()
+{
+  ADMUX = (VOLTAGE_PIN - A0) & 0x07;      // Measure the voltage pin against the external reference (REFS bits clear)
+  ADCSRA |= _BV(ADIE);                    // Enable the interrupt which wakes the CPU when a conversion completes
+
+  uint32_t sum = 0;
+  set_sleep_mode(SLEEP_MODE_ADC);
+  for (byte i = 0; i < VOLTAGE_SAMPLES; i++) {
+    // Checked before every sample, as a byte may start arriving between them
+    if (serialIdle()) {
+      sleep_enable();
+      sleep_cpu();
+      sleep_disable();
+    } else {
+      ADCSRA |= _BV(ADSC);
+    }
+    // Another interrupt (such as a flow signal) may wake the CPU first, so wait for the conversion to complete
+    while (ADCSRA & _BV(ADSC));
+    sum += ADC;
+  }
+
+  ADCSRA &= ~_BV(ADIE);
+  return sum >> VOLTAGE_OVERSAMPLE_BITS;
+}
+
+
+// ADC interrupt handler - Nothing to do, the conversion complete interrupt only wakes the CPU
+ISR(ADC_vect)
+{
+}
+
+
+// readVoltageCount - Return the filtered battery voltage as an ADC count
+// Params: None
+// Returns: the moving average of the readings, in the range 0 to VOLTAGE_RESOLUTION - 1
+//
+// Take an oversampled reading, add it to the moving average, and track the lowest and highest
+// readings since the last telemetry frame. The Raspberry Pi converts the count to Volts using the
+// same calibration, and BatteryVoltage::toMillivolts converts it on the controller when needed.
+unsigned int readVoltageCount()
+{
+  unsigned int sample = sampleVoltage();
+  if (sample < voltageMin)
+    voltageMin = sample;
+  if (sample > voltageMax)
+    voltageMax = sample;
+
+  if (voltageAverage == 0)
+    voltageAverage = (uint32_t)sample << VOLTAGE_AVERAGE_SHIFT;
+  else
+    voltageAverage = voltageAverage - (voltageAverage >> VOLTAGE_AVERAGE_SHIFT) + sample;
+  return voltageAverage >> VOLTAGE_AVERAGE_SHIFT;
+}
+
+
+// crc16Update - Add one byte to a running CRC-16/CCITT checksum
+// Params:
+//   crc - the checksum of the preceding bytes (start with 0xFFFF)
+//   data - the next byte
+// Returns: the updated checksum
+uint16_t crc16Update(uint16_t crc, byte data)
+{
+  crc ^= (unsigned int)data << 8;
+  for (byte i = 0; i < 8; i++)
+    crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+  return crc;
+}
+
+
+// frameBegin - Start assembling a new frame
+// Params: type - the frame type (one of the FRAME_ constants)
+// Returns: Nothing
+//
+// The payload is then added with the framePut functions and the frame is sent with frameEnd
+void frameBegin(byte type)
+{
+  frame[0] = FRAME_SYNC;
+  frame[1] = FRAME_VERSION;
+  frame[2] = type;
+  frame[3] = 0;
+  frameLength = 4;
+}
+
+
+// framePut8, framePut16, framePut32 - Append a field to the payload of the current frame
+// Params: value - the value to append
+// Returns: Nothing
+//
+// Values are written least significant byte first. Fields which would overflow the payload are dropped.
+void framePut8(byte value)
+{
+  if (frameLength < 4 + FRAME_MAX_PAYLOAD)
+    frame[frameLength++] = value;
+}
+
+void framePut16(unsigned int value)
+{
+  framePut8(value & 0xFF);
+  framePut8(value >> 8);
+}
+
+void framePut32(uint32_t value)
+{
+  framePut16(value & 0xFFFF);
+  framePut16(value >> 16);
+}
+
+
+// frameEnd - Complete the current frame and send it to the Raspberry Pi
+// Params: None
+// Returns: Nothing
+//
+// Fill in the payload length, append the CRC and write the whole frame in one call
+void frameEnd()
+{
+  frame[3] = frameLength - 4;
+  uint16_t crc = 0xFFFF;
+  for (byte i = 1; i < frameLength; i++)
+    crc = crc16Update(crc, frame[i]);
+  frame[frameLength++] = crc & 0xFF;
+  frame[frameLength++] = crc >> 8;
+  Serial.write(frame, frameLength);
+  diagnostics.bytesOut += frameLength;
+}
+
+
+// readFlags - Get the state flags for a telemetry frame
+// Params: flowing - whether water is flowing through any channel
+// Returns: the combination of FLAG_ constants which apply
+byte readFlags(bool flowing)
+{
+  byte flags = 0;
+  if (solenoid_open)
+    flags |= FLAG_SOLENOID_OPEN;
+  if (solenoid_state != SOLENOID_IDLE)
+    flags |= FLAG_SOLENOID_MOVING;
+  if (low_battery)
+    flags |= FLAG_LOW_BATTERY;
+  if (flowing)
+    flags |= FLAG_FLOWING;
+  if (leak_detected)
+    flags |= FLAG_LEAK;
+  if (warm_water)
+    flags |= FLAG_WARM;
+  return flags;
+}
+
+
+// updateBattery - Update the low battery state from a new voltage reading
+// Params: voltageCount - the ADC count of the divided battery voltage
+// Returns: Nothing
+void updateBattery(unsigned int voltageCount)
+{
+  unsigned int millivolts = BatteryVoltage::toMillivolts(voltageCount);
+  if (low_battery && millivolts >= LOW_BATTERY_MILLIVOLTS + LOW_BATTERY_HYSTERESIS)
+    low_battery = false;
+  else if (!low_battery && millivolts < LOW_BATTERY_MILLIVOLTS)
+    low_battery = true;
+}
+
+
+// difference - Return the absolute difference between two readings
+uint32_t difference(int32_t a, int32_t b)
+{
+  return a > b ? a - b : b - a;
+}
+
+
+// updateTelemetry - Read the sensors and report them to the Raspberry Pi when required
+// Params: currentTime - the time at the start of this loop
+// Returns: Nothing
+//
+// A frame is sent immediately when the solenoid opens or closes, the water starts or stops flowing,
+// the battery crosses the low voltage threshold, or the Raspberry Pi requests the status. Otherwise the sensors are read every sensorInterval,
+// and only reported if a reading has moved beyond its deadband, or no report has been sent for heartbeatInterval.
+// So reports are sent every second while water is flowing or the shower is open (as the remaining budget changes),
+// and every heartbeat while nothing is changing.
+void updateTelemetry(uint32_t currentTime)
+{
+  bool flowing = isFlowing();
+  bool event = ((readFlags(flowing) ^ reportFlags) & EVENT_FLAGS) != 0;
+  if (!event && !statusRequested && (currentTime - sensorStart) < sensorInterval)
+    return;
+  // A frame could be due, so wait until the transmit buffer has room for it rather than holding up the loop
+  if (Serial.availableForWrite() < TELEMETRY_PAYLOAD + 6)
+    return;
+  sensorStart = currentTime;
+
+  uint32_t totals[FLOW_CHANNEL_COUNT];
+  unsigned int rates[FLOW_CHANNEL_COUNT];
+  bool moved = solenoid_open;
+  for (byte channel = 0; channel < FLOW_CHANNEL_COUNT; channel++) {
+    totals[channel] = readFlowTotal(channel);
+    rates[channel] = readFlowRate(channel);
+    moved |= (totals[channel] - reportTotal[channel]) > flowDeadband ||
+             difference(rates[channel], reportRate[channel]) > rateDeadband;
+  }
+  unsigned int voltageCount = readVoltageCount();
+  updateBattery(voltageCount);
+  byte flags = readFlags(flowing);
+  event = ((flags ^ reportFlags) & EVENT_FLAGS) != 0;
+
+  moved |= difference(voltageCount, reportVoltage) > voltageDeadband ||
+           difference(temperature, reportTemperature) > temperatureDeadband;
+  if (event || moved || statusRequested || (currentTime - reportStart) >= heartbeatInterval)
+    sendTelemetry(totals, rates, voltageCount, event ? flags | FLAG_EVENT : flags);
+}
+
+
+// sendTelemetry - Send the current readings to the Raspberry Pi
+// Params:
+//   totals - the number of flow sensor pulses since boot on each channel
+//   rates - the flow rate on each channel in mL/min
+//   voltageCount - the ADC count of the divided battery voltage
+//   flags - the state flags (see readFlags)
+// Returns: Nothing
+//
+// The payload of a FRAME_TELEMETRY frame is
+//   sequence (2) | millis (4) | flow total (4) | flow rate (2) | voltage count (2) | flags (1) |
+//   lowest voltage count (2) | highest voltage count (2) | temperature (2) | remaining time (4) | remaining volume (4)
+// followed by flow total (4) | flow rate (2) for each channel after SHOWER_CHANNEL.
+// The first flow total and rate are SHOWER_CHANNEL in pulses, while the other channels are converted to millilitres
+// with their own calibration, so the Raspberry Pi can tell how many channels there are from the payload length.
+// The voltage count is the filtered reading, the lowest and highest are the individual readings since the last frame,
+// the temperature is signed in 1/16 degrees C (TEMPERATURE_NONE if there is no reading), and the remaining
+// budget of the shower is in milliseconds and millilitres (0 while closed, BUDGET_NONE if there is no volume limit)
+void sendTelemetry(const uint32_t* totals, const unsigned int* rates, unsigned int voltageCount, byte flags)
+{
+  statusRequested = false;
+  reportStart = millis();
+  for (byte channel = 0; channel < FLOW_CHANNEL_COUNT; channel++) {
+    reportTotal[channel] = totals[channel];
+    reportRate[channel] = rates[channel];
+  }
+  reportVoltage = voltageCount;
+  reportTemperature = temperature;
+  reportFlags = flags;
+
+  frameBegin(FRAME_TELEMETRY);
+  framePut16(sequence++);
+  framePut32(reportStart);
+  framePut32(totals[SHOWER_CHANNEL]);
+  framePut16(rates[SHOWER_CHANNEL]);
+  framePut16(voltageCount);
+  framePut8(flags);
+  framePut16(voltageMin);
+  framePut16(voltageMax);
+  framePut16(temperature);
+  framePut32(remainingTime(reportStart));
+  uint32_t pulses = remainingPulses(totals[SHOWER_CHANNEL]);
+  framePut32(pulses == BUDGET_NONE ? BUDGET_NONE : toMillilitres(SHOWER_CHANNEL, pulses));
+  for (byte channel = SHOWER_CHANNEL + 1; channel < FLOW_CHANNEL_COUNT; channel++) {
+    framePut32(toMillilitres(channel, totals[channel]));
+    framePut16(rates[channel]);
+  }
+  appendLog();
+  frameEnd();
+  voltageMin = 0xFFFF;
+  voltageMax = 0;
+}
+
+
+// logCheck - Calculate the check byte of a log record
+// Params: record - the record, of which the first LOG_PAYLOAD_SIZE bytes are checked
+// Returns: the check byte
+byte logCheck(const byte* record)
+{
+  uint16_t crc = 0xFFFF;
+  for (byte i = 0; i < LOG_PAYLOAD_SIZE; i++)
+    crc = crc16Update(crc, record[i]);
+  return crc & 0xFF;
+}
+
+
+// logAddress - Get the EEPROM address of a byte in the log
+// Params:
+//   slot - the slot of the record
+//   offset - the byte within the record
+// Returns: the address
+uint8_t* logAddress(byte slot, byte offset)
+{
+  return (uint8_t*)(uintptr_t)((unsigned int)slot * LOG_RECORD_SIZE + offset);
+}
+
+
+// readLog - Read a record from the log
+// Params:
+//   slot - the slot to read
+//   record - the LOG_RECORD_SIZE byte buffer to read into
+// Returns: true if the slot holds a valid record
+bool readLog(byte slot, byte* record)
+{
+  eeprom_read_block(record, logAddress(slot, 0), LOG_RECORD_SIZE);
+  return record[LOG_PAYLOAD_SIZE] == logCheck(record);
+}
+
+
+// logSequence - Get the sequence number of a log record
+// Params: record - the record
+// Returns: the sequence number
+uint16_t logSequence(const byte* record)
+{
+  return record[0] | (record[1] << 8);
+}
+
+
+// restoreLog - Find the newest record in the log
+// Params: None
+// Returns: Nothing
+//
+// The newest record is the valid record which is not followed by a newer sequence number (a record which
+// could not be queued leaves a gap in the sequence, so the next record is not always one more).
+// The next record will be written after it, and telemetry continues with the following sequence number.
+void restoreLog()
+{
+  byte record[LOG_RECORD_SIZE];
+  logSlot = 0;
+  logHead = 0;
+  logQueued = 0;
+  logWritten = 0;
+  sequence = 0;
+
+  for (byte slot = 0; slot < LOG_RECORDS; slot++) {
+    if (!readLog(slot, record))
+      continue;
+    byte next[LOG_RECORD_SIZE];
+    byte nextSlot = (slot + 1) % LOG_RECORDS;
+    if (!readLog(nextSlot, next) || (int16_t)(logSequence(next) - logSequence(record)) <= 0) {
+      logSlot = nextSlot;
+      sequence = logSequence(record) + 1;
+      return;
+    }
+  }
+}
+
+
+// appendLog - Queue the payload of the current telemetry frame to be written to the log
+// Params: None
+// Returns: Nothing
+//
+// Called before frameEnd while frame holds the payload. Only the first LOG_PAYLOAD_SIZE bytes are kept.
+// If the queue is full the EEPROM has fallen behind, and the record is sent but not logged.
+void appendLog()
+{
+  if (logQueued == LOG_QUEUE)
+    return;
+  byte* record = logQueue[(logHead + logQueued) % LOG_QUEUE];
+  memcpy(record, &frame[4], LOG_PAYLOAD_SIZE);
+  record[LOG_PAYLOAD_SIZE] = logCheck(record);
+  logQueued++;
+}
+
+
+// updateLog - Write the next byte of the oldest queued record if the EEPROM is ready
+// Params: None
+// Returns: Nothing
+void updateLog()
+{
+  if (logQueued > 0 && eeprom_is_ready()) {
+    eeprom_update_byte(logAddress(logSlot, logWritten), logQueue[logHead][logWritten]);
+    if (++logWritten == LOG_RECORD_SIZE) {
+      logWritten = 0;
+      logSlot = (logSlot + 1) % LOG_RECORDS;
+      logHead = (logHead + 1) % LOG_QUEUE;
+      logQueued--;
+    }
+  }
+}
+
+
+// findLog - Find a record in the queue or the log
+// Params:
+//   wanted - the sequence number of the record
+//   record - the LOG_RECORD_SIZE byte buffer to copy it into
+// Returns: true if the record was found
+//
+// The newest record in EEPROM is in the slot before logSlot, and the one wanted is found from its age.
+// Records which have already been overwritten, or were never logged, are not found.
+bool findLog(uint16_t wanted, byte* record)
+{
+  for (byte i = 0; i < logQueued; i++) {
+    const byte* queued = logQueue[(logHead + i) % LOG_QUEUE];
+    if (logSequence(queued) == wanted) {
+      memcpy(record, queued, LOG_RECORD_SIZE);
+      return true;
+    }
+  }
+
+  byte newestSlot = (logSlot + LOG_RECORDS - 1) % LOG_RECORDS;
+  if (!readLog(newestSlot, record))
+    return false;
+  uint16_t age = logSequence(record) - wanted;
+  return age < LOG_RECORDS && readLog((newestSlot + LOG_RECORDS - age) % LOG_RECORDS, record) && logSequence(record) == wanted;
+}
+
+
+// updateBackfill - Resend the next requested record from the log
+// Params: None
+// Returns: Nothing
+//
+// One record is sent each loop, and only when the serial transmit buffer has room for it, so a
+// burst of records does not delay the rest of the loop. Records which cannot be found are skipped.
+void updateBackfill()
+{
+  if (backfillRemaining == 0 || Serial.availableForWrite() < FRAME_MAX_PAYLOAD)
+    return;
+
+  byte record[LOG_RECORD_SIZE];
+  if (findLog(backfillSequence, record)) {
+    frameBegin(FRAME_RECORD);
+    for (byte i = 0; i < LOG_PAYLOAD_SIZE; i++)
+      framePut8(record[i]);
+    frameEnd();
+  }
+  backfillSequence++;
+  backfillRemaining--;
+}
+
+
+// updateTemperature - Advance the temperature conversion
+// Params: currentTime - the time at the start of this loop
+// Returns: Nothing
 //
-// Read the current value of the flow count variable, and convert it to Litres
-// If this is called every second, the reading is in L/sec.
-float readFlowRate()
+// A conversion is started every TEMPERATURE_INTERVAL (or as soon as the last has finished during a shower, so warm
+// water is noticed within one conversion), and the bus is checked every TEMPERATURE_POLL_INTERVAL until it has finished.
+// Each step only holds the loop for the few milliseconds of 1-Wire communication.
+void updateTemperature(uint32_t currentTime)
 {
-  float volume = (float)flow_count / PULSES_PER_LITRE;
-  flow_count = 0;
-  return volume;
+  switch (temperature_state) {
+  case TEMPERATURE_IDLE:
+    if (!solenoid_open && (currentTime - temperatureStart) < TEMPERATURE_INTERVAL)
+      return;
+    temperatureStart = currentTime;
+    if (!temperatureBus.reset()) {
+      setTemperature(TEMPERATURE_NONE);   // No sensor answered
+      return;
+    }
+    temperatureBus.skip();
+    temperatureBus.write(DS18B20_CONVERT);
+    temperaturePoll = currentTime;
+    temperature_state = TEMPERATURE_CONVERTING;
+    break;
+
+  case TEMPERATURE_CONVERTING:
+    if ((currentTime - temperaturePoll) < TEMPERATURE_POLL_INTERVAL)
+      return;
+    temperaturePoll = currentTime;
+    if (temperatureBus.read_bit()) {
+      temperature_state = TEMPERATURE_IDLE;
+      setTemperature(readTemperature());
+    } else if ((currentTime - temperatureStart) >= TEMPERATURE_TIMEOUT) {
+      temperature_state = TEMPERATURE_IDLE;
+      setTemperature(TEMPERATURE_NONE);
+    }
+    break;
+  }
 }
 
 
-// readVoltage - Return the battery voltage in Volts
+// readTemperature - Read the result of a finished conversion from the DS18B20
+// Params: None
+// Returns: the temperature in 1/16 degrees C, or TEMPERATURE_NONE if it could not be read
+int readTemperature()
+{
+  byte scratchpad[9];
+  if (!temperatureBus.reset())
+    return TEMPERATURE_NONE;
+  temperatureBus.skip();
+  temperatureBus.write(DS18B20_READ_SCRATCHPAD);
+  for (byte i = 0; i < sizeof(scratchpad); i++)
+    scratchpad[i] = temperatureBus.read();
+  if (OneWire::crc8(scratchpad, 8) != scratchpad[8])
+    return TEMPERATURE_NONE;
+  return (int16_t)(scratchpad[0] | (scratchpad[1] << 8));
+}
+
+
+// setTemperature - Record a new temperature reading, and report the water becoming warm during a shower
+// Params: value - the temperature in 1/16 degrees C, or TEMPERATURE_NONE
+// Returns: Nothing
+void setTemperature(int value)
+{
+  temperature = value;
+  if (temperature == TEMPERATURE_NONE)
+    warm_water = false;
+  else if (!warm_water && temperature >= WARM_TEMPERATURE)
+    warm_water = true;
+  else if (warm_water && temperature < WARM_TEMPERATURE - WARM_HYSTERESIS)
+    warm_water = false;
+
+  if (warm_water && solenoid_open && !warmReported) {
+    warmReported = true;
+    sendWarm();
+  }
+}
+
+
+// sendWarm - Report that the water has become warm
+// Params: None
+// Returns: Nothing
+//
+// Sent once per shower, as soon as the reading crosses WARM_TEMPERATURE. The payload of a FRAME_WARM frame is
+//   millis (4) | temperature (2) | time since the shower started (4)
+// with the temperature in 1/16 degrees C and the time in milliseconds
+void sendWarm()
+{
+  uint32_t currentTime = millis();
+  frameBegin(FRAME_WARM);
+  framePut32(currentTime);
+  framePut16(temperature);
+  framePut32(currentTime - showerStart);
+  frameEnd();
+}
+
+
+// updateLeak - Count the flow while the solenoid is closed, and report a leak once it has lasted LEAK_WINDOWS windows
+// Params: currentTime - the time at the start of this loop
+// Returns: Nothing
+//
+// The leak is cleared by a window with no busy flow, or by opening the solenoid
+void updateLeak(uint32_t currentTime)
+{
+  if ((currentTime - leakWindowStart) < LEAK_WINDOW)
+    return;
+  uint32_t total = readFlowTotal(SHOWER_CHANNEL);
+  uint32_t pulses = total - leakWindowTotal;
+  uint32_t windowStart = leakWindowStart;
+  leakWindowStart = currentTime;
+  leakWindowTotal = total;
+
+  if (solenoid_open || solenoid_state != SOLENOID_IDLE || (currentTime - showerEnd) < LEAK_SETTLE_TIME || pulses <= LEAK_PULSES) {
+    leakWindows = 0;
+    leak_detected = false;
+    return;
+  }
+
+  if (leakWindows == 0) {
+    leakStart = windowStart;
+    leakStartTotal = total - pulses;
+  }
+  if (leakWindows < LEAK_WINDOWS)
+    leakWindows++;
+  if (leakWindows == LEAK_WINDOWS && (!leak_detected || (currentTime - leakReported) >= LEAK_REPEAT_INTERVAL)) {
+    leak_detected = true;
+    sendLeak(currentTime, total);
+  }
+}
+
+
+// sendLeak - Report a leak to the Raspberry Pi
+// Params:
+//   currentTime - the time at the start of this loop
+//   total - the number of flow sensor pulses since boot
+// Returns: Nothing
+//
+// The payload of a FRAME_LEAK frame is
+//   millis (4) | time the leak started (4) | pulses since the leak started (4) | flow rate (2)
+// with times in milliseconds and the rate in mL/min. The frame is repeated while the leak continues,
+// with the same start time, so the Raspberry Pi can tell a repeat from a new leak.
+void sendLeak(uint32_t currentTime, uint32_t total)
+{
+  leakReported = currentTime;
+  frameBegin(FRAME_LEAK);
+  framePut32(currentTime);
+  framePut32(leakStart);
+  framePut32(total - leakStartTotal);
+  framePut16(readFlowRate(SHOWER_CHANNEL));
+  frameEnd();
+}
+
+
+// sendActuation - Report that the solenoid has finished changing position
+// Params: currentTime - the time the pulse was released
+// Returns: Nothing
+//
+// The payload of a FRAME_ACTUATION frame is
+//   millis (4) | position (1) | delay from request to pulse (2) | pulse duration (2) | request id (1)
+// with times in milliseconds, the position 1 for open and 0 for closed, and the id of the command
+// which requested the position (0 if the solenoid was closed at the end of the shower)
+void sendActuation(uint32_t currentTime)
+{
+  frameBegin(FRAME_ACTUATION);
+  framePut32(currentTime);
+  framePut8(solenoid_driven ? 1 : 0);
+  framePut16(pulseStart - pulseRequest);
+  framePut16(currentTime - pulseStart);
+  framePut8(pulseRequestId);
+  frameEnd();
+}
+
+// sendDiagnostics - Send the diagnostic counters to the Raspberry Pi
 // Params: None
-// Returns: the calculated voltage
+// Returns: Nothing
+//
+// The payload of a FRAME_DIAGNOSTICS frame is
+//   awake ms (4) | idle ms (4) | asleep ms (4) | flow wakes (2) | bluetooth wakes (2) | actuations (2) | bytes in (4) | bytes out (4)
+// The bytes out count does not include this frame
+void sendDiagnostics()
+{
+  uint32_t currentTime = millis();
+  diagnostics.awakeMillis += currentTime - awakeMark;
+  awakeMark = currentTime;
+  diagnosticStart = currentTime;
+
+  frameBegin(FRAME_DIAGNOSTICS);
+  framePut32(diagnostics.awakeMillis);
+  framePut32(diagnostics.idleMillis);
+  framePut32(diagnostics.asleepMillis);
+  framePut16(diagnostics.flowWakes);
+  framePut16(diagnostics.bluetoothWakes);
+  framePut16(diagnostics.actuations);
+  framePut32(diagnostics.bytesIn);
+  framePut32(diagnostics.bytesOut);
+  frameEnd();
+}
+
+// remainingTime - Get the time left in the budget of the current shower
+// Params: currentTime - the time at the start of this loop
+// Returns: the time in milliseconds, or 0 if the shower is closed
+uint32_t remainingTime(uint32_t currentTime)
+{
+  if (!solenoid_open)
+    return 0;
+  uint32_t elapsed = currentTime - showerStart;
+  return elapsed >= budgetTime ? 0 : budgetTime - elapsed;
+}
+
+
+// remainingPulses - Get the volume left in the budget of the current shower
+// Params: total - the number of flow sensor pulses since boot
+// Returns: the volume in flow pulses, BUDGET_NONE if there is no volume limit, or 0 if the shower is closed
+//
+// The volume is measured by the totalizer, so the valve closes when the budget is used without waiting for the Raspberry Pi
+uint32_t remainingPulses(uint32_t total)
+{
+  if (!solenoid_open)
+    return 0;
+  if (budgetPulses == 0)
+    return BUDGET_NONE;
+  uint32_t used = total - budgetTotal;
+  return used >= budgetPulses ? 0 : budgetPulses - used;
+}
+
+
+// openShower - Open the solenoid and start measuring the shower against its budget
+// Params:
+//   requestId - the id of the command which opened the shower
+//   time - the time budget in milliseconds
+//   millilitres - the volume budget (0 for no volume limit)
+// Returns: Nothing
+void openShower(byte requestId, uint32_t time, uint32_t millilitres)
+{
+  solenoid_open = true;
+  writeSolenoid(solenoid_open, requestId);
+  showerStart = millis();
+  budgetTime = time;
+  budgetPulses = toPulses(SHOWER_CHANNEL, millilitres);
+  budgetTotal = readFlowTotal(SHOWER_CHANNEL);
+  watchdogStart = showerStart;
+  warmReported = false;
+}
+
+
+// closeShower - Close the solenoid
+// Params: requestId - the id of the command which closed the shower (0 when the budget is used up)
+// Returns: Nothing
+void closeShower(byte requestId)
+{
+  solenoid_open = false;
+  writeSolenoid(solenoid_open, requestId);
+  showerEnd = millis();
+  watchdogStart = showerEnd;
+}
+
+
+// receiveCommand - Add a byte to the command being received, and carry out the command once it is complete
+// Params: c - the byte received
+// Returns: Nothing
+//
+// Bytes before the SYNC byte are ignored (such as the byte which wakes the controller), and a command
+// with an unexpected version, length or CRC is discarded. The Raspberry Pi retries commands which are
+// not acknowledged, so a command lost while the controller wakes is sent again.
+void receiveCommand(byte c)
+{
+  uint32_t currentTime = millis();
+  if (commandLength > 0 && (currentTime - commandStart) >= COMMAND_TIMEOUT)
+    commandLength = 0;
+
+  if (commandLength == 0) {
+    if (c != FRAME_SYNC)
+      return;
+    commandStart = currentTime;
+  }
+  command[commandLength++] = c;
+
+  if (commandLength == 4 && (command[1] != FRAME_VERSION || command[3] == 0 || command[3] > FRAME_MAX_PAYLOAD)) {
+    commandLength = 0;
+    return;
+  }
+  if (commandLength < 4 || commandLength < 4 + command[3] + 2)
+    return;
+
+  // The whole frame has arrived, so check the CRC
+  byte length = commandLength;
+  commandLength = 0;
+  uint16_t crc = 0xFFFF;
+  for (byte i = 1; i < length - 2; i++)
+    crc = crc16Update(crc, command[i]);
+  if (command[length - 2] != (crc & 0xFF) || command[length - 1] != (crc >> 8))
+    return;
+
+  runCommand(command[2], command[4], &command[5], command[3] - 1);
+}
+
+
+// getArgument16, getArgument32 - Read a little endian value from a command payload
+// Params: data - the first byte of the value
+// Returns: the value
+unsigned int getArgument16(const byte* data)
+{
+  return data[0] | ((unsigned int)data[1] << 8);
+}
+
+uint32_t getArgument32(const byte* data)
+{
+  return getArgument16(data) | ((uint32_t)getArgument16(data + 2) << 16);
+}
+
+
+// runCommand - Carry out a command from the Raspberry Pi and reply with FRAME_ACK or FRAME_NACK
+// Params:
+//   type - the command type (one of the COMMAND_ constants)
+//   requestId - the id of the request
+//   arguments - the rest of the payload
+//   length - the number of bytes in arguments
+// Returns: Nothing
+void runCommand(byte type, byte requestId, const byte* arguments, byte length)
+{
+  watchdogStart = millis();             // Any command counts as activity, so the controller stays awake
+
+  // A retry of the last command was already carried out, so only the acknowledgement was lost
+  if (requestId != 0 && requestId == lastRequestId && type == lastRequestType && (millis() - lastRequestTime) < RETRY_WINDOW) {
+    sendReply(FRAME_ACK, requestId, type, 0);
+    return;
+  }
+
+  byte error = 0;
+  switch (type) {
+  case COMMAND_OPEN:
+    if (length == 0)
+      openShower(requestId, showerDuration, 0);
+    else if (length != 8)
+      error = NACK_BAD_LENGTH;
+    else if ((getArgument32(arguments) == 0 && getArgument32(arguments + 4) == 0) ||
+             getArgument32(arguments) > MAX_SHOWER_DURATION || getArgument32(arguments + 4) > MAX_SHOWER_VOLUME)
+      error = NACK_BAD_VALUE;
+    else if (getArgument32(arguments) == 0)
+      openShower(requestId, MAX_SHOWER_DURATION, getArgument32(arguments + 4));   // Close it even if the water never flows
+    else
+      openShower(requestId, getArgument32(arguments), getArgument32(arguments + 4));
+    break;
+
+  case COMMAND_CLOSE:
+    if (length != 0)
+      error = NACK_BAD_LENGTH;
+    else
+      closeShower(requestId);
+    break;
+
+  case COMMAND_STATUS:
+    if (length != 0)
+      error = NACK_BAD_LENGTH;
+    else
+      statusRequested = true;
+    break;
+
+  case COMMAND_SET_DURATION:
+    if (length != 4)
+      error = NACK_BAD_LENGTH;
+    else if (getArgument32(arguments) == 0 || getArgument32(arguments) > MAX_SHOWER_DURATION)
+      error = NACK_BAD_VALUE;
+    else
+      showerDuration = getArgument32(arguments);
+    break;
+
+  case COMMAND_SET_REPORTING:
+    if (length != 6 && length != 14)
+      error = NACK_BAD_LENGTH;
+    else if (getArgument16(arguments) < MIN_SENSOR_INTERVAL || getArgument32(arguments + 2) < getArgument16(arguments))
+      error = NACK_BAD_VALUE;
+    else {
+      sensorInterval = getArgument16(arguments);
+      heartbeatInterval = getArgument32(arguments + 2);
+      if (length == 14) {
+        flowDeadband = getArgument16(arguments + 6);
+        rateDeadband = getArgument16(arguments + 8);
+        voltageDeadband = getArgument16(arguments + 10);
+        temperatureDeadband = getArgument16(arguments + 12);
+      }
+    }
+    break;
+
+  case COMMAND_DIAGNOSTICS:
+    if (length != 0)
+      error = NACK_BAD_LENGTH;
+    else
+      sendDiagnostics();
+    break;
+
+  case COMMAND_BACKFILL:
+    if (length != 3)
+      error = NACK_BAD_LENGTH;
+    else {
+      backfillSequence = getArgument16(arguments);
+      backfillRemaining = arguments[2];
+    }
+    break;
+
+  default:
+    error = NACK_UNKNOWN_COMMAND;
+    break;
+  }
+
+  if (error == 0) {
+    lastRequestId = requestId;
+    lastRequestType = type;
+    lastRequestTime = millis();
+    sendReply(FRAME_ACK, requestId, type, 0);
+  } else {
+    sendReply(FRAME_NACK, requestId, type, error);
+  }
+}
+
+
+// sendReply - Acknowledge or reject a command
+// Params:
+//   reply - FRAME_ACK or FRAME_NACK
+//   requestId - the id of the request
+//   type - the command type
+//   error - the reason the command was rejected (one of the NACK_ constants), or 0 for FRAME_ACK
+// Returns: Nothing
 //
-// First undo the effect of the resistor divider to get the original voltage,
-// then convert the count to a voltage using the reference voltage and ADC resolution
-float readVoltage()
+// The payload of a FRAME_ACK frame is request id (1) | command type (1)
+// and a FRAME_NACK frame is followed by the reason (1)
+void sendReply(byte reply, byte requestId, byte type, byte error)
 {
-  float count = analogRead(VOLTAGE_PIN);
-  float voltage = count / VOLT_VOLTAGE_DIVIDER * REFERENCE_VOLTAGE / ADC_RESOLUTION;
-  return voltage;
+  frameBegin(reply);
+  framePut8(requestId);
+  framePut8(type);
+  if (reply == FRAME_NACK)
+    framePut8(error);
+  frameEnd();
 }
 
+
 // loop - Perform regular processing while the ATmega328P is awake
 // Params: None
 // Returns: Nothing
 //
 // There are a number of tasks:
-// - Read the sensors every second and send them to the Raspberry Pi via Bluetooth
+// - Advance any solenoid pulse which is in progress
+// - Write the telemetry log to EEPROM and resend records requested by the Raspberry Pi
+// - Read the sensors every second and send them to the Raspberry Pi via Bluetooth when they change
 // - Respond to commands from the raspberry pi
-// - Turn the solenoid off after the shower has lasted 4 minutes
-// - and go to sleep after 5 minutes
+// - Turn the solenoid off once the shower has used its time or volume budget
+// - Report water flowing while the solenoid is closed as a leak
+// - Measure the water temperature, and report when it becomes warm
+// - and go to sleep after 10 seconds of inactivity (but not while water may be leaking, records are waiting to be logged,
+//   or the serial port is busy, as sleeping stops it)
+// Between loops the CPU idles until the next interrupt
 void loop() {
-  unsigned long currentTime = millis();
+  updateSolenoid();
+  updateLog();
+  updateBackfill();
 
-  // Check if it is time to turn off the shower or go to sleep for inactivity
+  uint32_t currentTime = millis();
+
+  // Check if the shower has used its budget, or it is time to go to sleep for inactivity
   // The method of comparison used will still function correctly when millis overflows once every 50 days
-  if (solenoid_open && (currentTime - showerStart) >= SHOWER_DURATION)
+  if (solenoid_open && (remainingTime(currentTime) == 0 || remainingPulses(readFlowTotal(SHOWER_CHANNEL)) == 0))
   {
-    solenoid_open = false;
-    writeSolenoid(solenoid_open);
-    watchdogStart = currentTime;
+    closeShower(0);
   }
-  if (!solenoid_open && (currentTime - watchdogStart) >= WATCHDOG_DURATION)
+  if (!solenoid_open && solenoid_state == SOLENOID_IDLE && leakWindows == 0 && logQueued == 0 && serialIdle() && (currentTime - watchdogStart) >= WATCHDOG_DURATION)
   {
     goToSleep();
   }
 
-  // Check for the open command from the Raspberry Pi
-  if (Serial.available()) {
-    char c = Serial.read();
-    if (c == 'o') {
-      solenoid_open = true;
-      writeSolenoid(solenoid_open);
-      showerStart = currentTime;
-      watchdogStart = currentTime;        
-    }
-  } 
+  // Check for commands from the Raspberry Pi
+  while (Serial.available()) {
+    diagnostics.bytesIn++;
+    receiveCommand(Serial.read());
+  }
 
 
-  // Check if it is time to update the sensor values
-  if ((currentTime - sensorStart) >= SENSOR_READ_INTERVAL) {
-    // Read all the sensors
-    float flow = readFlowRate();
-    float voltage = readVoltage();
+  // Watch for leaks and the water temperature, then read the sensors and send the raw readings to the raspberry pi when they change
+  updateLeak(currentTime);
+  updateTemperature(currentTime);
+  updateTelemetry(currentTime);
+  if ((currentTime - diagnosticStart) >= DIAGNOSTIC_INTERVAL)
+    sendDiagnostics();
+
+  // Then rest until something happens
+  idle();
+}
 
-    // Send the current readings to the raspberry pi
-    char buffer[54];
-    char flowString[8];
-    char voltageString[7];
-    // Convert each floating point reading into a string
-    dtostrf(flow, 2, 3, flowString);          // The flow rate is reported to 3 decimal places
-    dtostrf(voltage, 2, 2, voltageString);    // The voltage is reported to 2 decimal places
-    // Create and send the string via bluetooth
-    snprintf(buffer, sizeof(buffer), "Flow %s L/s | Volts %s V | Solenoid %s", flowString, voltageString, solenoid_open ? "Open" : "Closed");
-    Serial.println(buffer);
 
-    sensorStart = currentTime;
+// idle - Stop the CPU until the next interrupt
+// Params: None
+// Returns: Nothing
+//
+// Called at the end of each loop while the controller is awake, instead of spinning straight back into the loop.
+// In SLEEP_MODE_IDLE the CPU clock stops but the timers, UART and external interrupts keep running,
+// so the loop resumes on the next millis tick (Timer0 overflows every 1.024 ms), a received byte or a flow signal.
+// Every deadline in the loop is measured in milliseconds, so none of them is delayed by more than one tick.
+// If there is still work waiting, the CPU is not stopped.
+void idle()
+{
+  if (Serial.available() || backfillRemaining > 0)
+    return;
+
+  uint32_t start = micros();
+  set_sleep_mode(SLEEP_MODE_IDLE);
+  sleep_enable();
+  sleep_cpu();
+  sleep_disable();
+
+  idleMicros += micros() - start;
+  if (idleMicros >= 1000) {
+    diagnostics.idleMillis += idleMicros / 1000;
+    idleMicros %= 1000;
   }
 }
 
@@ -181,36 +1585,79 @@ void loop() {
 // Called after a period of inactivity to put the system to sleep
 // It enables interrupt handlers so that it will be woken again if flow or bluetooth communication is detected
 // and resets the watchdog timer on waking up so that it will not be put back to sleep immediately by the main loop
+//
+// millis() does not advance while asleep, so the watchdog interrupt is used as a clock to count the time asleep.
+// When only the watchdog has woken the controller it goes straight back to sleep. Each sleep is counted to
+// within half a watchdog period.
 void goToSleep()
 {
-  sleep_enable();                       // Enable sleep mode
-  // Remove the usual interrupt handler from the flow pin
-  detachInterrupt(digitalPinToInterrupt(FLOW_PIN));
-  // Then assign it to the wakeOnFlow handler
-  // The pin is LOW when inactive and rises when a signal is detected.
-  attachInterrupt(digitalPinToInterrupt(FLOW_PIN), wakeOnFlow, RISING);
-  // Also assign the bluetooth monitoring pin to trigger wakeOnBluetooth
+  uint32_t currentTime = millis();
+  diagnostics.awakeMillis += currentTime - awakeMark;
+
+  // The pin change interrupt of the flow sensors stays enabled, and sets the wake reason when a signal is detected
+  wake_reason = WAKE_NONE;
+  sleep_ticks = 0;
+  lastRequestId = 0;                    // Retries never wait this long, so any request after waking is new
+  // Assign the bluetooth monitoring pin to trigger wakeOnBluetooth
   // This pin will be HIGH when inactive and becomes LOW during transmission
   attachInterrupt(digitalPinToInterrupt(BLUETOOTH_PIN), wakeOnBluetooth, LOW);
-  sei();                                // Ensure interrupts are enabled otherwise it will not be possible to wake again
+  startSleepClock();
   set_sleep_mode(SLEEP_MODE_PWR_DOWN);  // This sleep mode uses the lowest current, but preserves the register values
-  sleep_cpu();                          // Put the ATmega328P to sleep
-  sleep_disable();                      // After waking up, disable the sleep mode
+
+  while (true) {
+    cli();                              // Check the wake reason with interrupts off, so a wake cannot be missed before sleeping
+    if (wake_reason != WAKE_NONE)
+      break;
+    sleep_enable();                     // Enable sleep mode
+    sei();                              // Ensure interrupts are enabled otherwise it will not be possible to wake again
+    sleep_cpu();                        // Put the ATmega328P to sleep (the instruction after sei always runs before any interrupt)
+    sleep_disable();                    // After waking up, disable the sleep mode
+  }
+  // A flow wake leaves the bluetooth interrupt attached, and the low level would keep interrupting while awake
+  detachInterrupt(digitalPinToInterrupt(BLUETOOTH_PIN));
+  sei();
+
+  stopSleepClock();
+  // The wake came part of the way through the period after the last watchdog interrupt, so count half a period for it
+  diagnostics.asleepMillis += (uint32_t)sleep_ticks * SLEEP_CLOCK_PERIOD + SLEEP_CLOCK_PERIOD / 2;
+  if (wake_reason == WAKE_FLOW)
+    diagnostics.flowWakes++;
+  else
+    diagnostics.bluetoothWakes++;
+
+  awakeMark = millis();
   watchdogStart = millis();             // and restart counting the period of inactivity before it sleeps again
 }
 
 
-// wakeOnFlow - Called when flow is detected while the system is asleep
+// startSleepClock - Start the watchdog timer in interrupt mode with a period of SLEEP_CLOCK_PERIOD
 // Params: None
 // Returns: Nothing
 //
-// First remove the wake interrupt handlers and restore the usual flow measurement interrupt
-// Then record the water flow
-void wakeOnFlow() {
-  detachInterrupt(digitalPinToInterrupt(FLOW_PIN));
-  detachInterrupt(digitalPinToInterrupt(BLUETOOTH_PIN));
-  attachInterrupt(digitalPinToInterrupt(FLOW_PIN), measureWaterFlow, RISING);
-  flow_count=1;
+// Only the watchdog interrupt is enabled, so the watchdog never resets the controller
+void startSleepClock()
+{
+  cli();
+  wdt_reset();
+  WDTCSR = _BV(WDCE) | _BV(WDE);                      // Allow the watchdog configuration to be changed
+  WDTCSR = _BV(WDIE) | _BV(WDP2) | _BV(WDP1);         // Interrupt mode, 128K cycles (SLEEP_CLOCK_PERIOD)
+  sei();
+}
+
+
+// stopSleepClock - Stop the watchdog timer
+// Params: None
+// Returns: Nothing
+void stopSleepClock()
+{
+  wdt_disable();
+}
+
+
+// Watchdog interrupt handler - Count another period asleep
+ISR(WDT_vect)
+{
+  sleep_ticks++;
 }
 
 
@@ -218,10 +1665,9 @@ void wakeOnFlow() {
 // Params: None
 // Returns: Nothing
 //
-// First remove the wake interrupt handlers and restore the usual flow measurement interrupt
+// First remove the wake interrupt handler, so the low level does not keep interrupting
 // The received input will be in the buffer and will be handled by the main loop now the system is awake again
 void wakeOnBluetooth() {
-  detachInterrupt(digitalPinToInterrupt(FLOW_PIN));
+  wake_reason = WAKE_BLUETOOTH;
   detachInterrupt(digitalPinToInterrupt(BLUETOOTH_PIN));
-  attachInterrupt(digitalPinToInterrupt(FLOW_PIN), measureWaterFlow, RISING);
 }
@@ -0,0 +1,103 @@
+// Arduino.h - The parts of the Arduino core used by shower_timer.ino, for the host simulation
+//
+// The functions are implemented in sim.cpp against a virtual clock, so the sketch runs unchanged on Linux.
+// The sketch uses fixed width types wherever values must wrap at 32 bits, as unsigned long is 64 bits on Linux.
+// int is still 32 bits rather than 16, so 16 bit overflow in the sketch is not simulated.
+// Only what the sketch uses is provided. The ATmega328P registers it touches are SimRegister objects,
+// so reads and writes can be observed by the simulation.
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+typedef uint8_t byte;
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define CHANGE 1
+#define FALLING 2
+#define RISING 3
+#define A0 14
+#define EXTERNAL 0
+#define DEFAULT 1
+#define INTERNAL 3
+#define NOT_AN_INTERRUPT -1
+
+#define _BV(bit) (1 << (bit))
+
+// SimRegister - An 8 bit register which calls the simulation when it is read or written
+struct SimRegister
+{
+  uint8_t value;
+  void (*onRead)(SimRegister& reg);
+  void (*onWrite)(SimRegister& reg);
+
+  operator uint8_t() { if (onRead) onRead(*this); return value; }
+  SimRegister& operator=(uint8_t v) { value = v; if (onWrite) onWrite(*this); return *this; }
+  SimRegister& operator|=(uint8_t v) { return *this = (uint8_t)(*this | v); }
+  SimRegister& operator&=(uint8_t v) { return *this = (uint8_t)(*this & v); }
+};
+
+// Analog to digital converter
+extern SimRegister ADMUX;
+extern SimRegister ADCSRA;
+extern uint16_t ADC;
+#define ADPS0 0
+#define ADPS1 1
+#define ADPS2 2
+#define ADIE 3
+#define ADIF 4
+#define ADATE 5
+#define ADSC 6
+#define ADEN 7
+
+// The serial port (USART0), where TXC0 is set once every byte written has been shifted out
+extern SimRegister UCSR0A;
+#define TXC0 6
+#define SERIAL_TX_BUFFER_SIZE 64
+
+// Pin change interrupts and port D, where the flow sensors are connected
+extern SimRegister PCICR;
+extern SimRegister PCMSK2;
+extern SimRegister PIND;
+#define PCIE2 2
+
+uint32_t millis();
+uint32_t micros();
+void delay(uint32_t ms);
+void delayMicroseconds(unsigned int us);
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+int analogRead(uint8_t pin);
+void analogReference(uint8_t mode);
+
+int digitalPinToInterrupt(uint8_t pin);
+void attachInterrupt(uint8_t interrupt, void (*handler)(), int mode);
+void detachInterrupt(uint8_t interrupt);
+
+void simCli();
+void simSei();
+#define cli() simCli()
+#define sei() simSei()
+#define noInterrupts() simCli()
+#define interrupts() simSei()
+bool simInterruptsEnabled();
+
+// SimSerial - The hardware serial port, connected to the bluetooth module at 9600 baud
+class SimSerial
+{
+public:
+  void begin(uint32_t baud);
+  int available();
+  int read();
+  int availableForWrite();
+  size_t write(uint8_t value);
+  size_t write(const uint8_t* buffer, size_t size);
+};
+extern SimSerial Serial;
@@ -0,0 +1,17 @@
+// OneWire.h - The parts of the OneWire library used by shower_timer.ino, for the host simulation
+//
+// A single DS18B20 is simulated on the bus (see simSetTemperature). Each reset and bit takes as long as it
+// does on the real bus, so the time the sketch spends talking to the sensor is counted.
+#pragma once
+
+class OneWire
+{
+public:
+  OneWire(uint8_t pin);
+  uint8_t reset();
+  void skip();
+  void write(uint8_t value, uint8_t power = 0);
+  uint8_t read();
+  uint8_t read_bit();
+  static uint8_t crc8(const uint8_t* data, uint8_t size);
+};
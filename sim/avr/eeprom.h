@@ -0,0 +1,12 @@
+// avr/eeprom.h - The 1 KB EEPROM of the ATmega328P for the host simulation
+// Each byte written keeps the EEPROM busy for the write time, and like avr-libc, reads and writes wait until it is ready
+#pragma once
+
+#define E2END 0x3FF
+
+uint8_t eeprom_read_byte(const uint8_t* address);
+void eeprom_read_block(void* destination, const void* source, size_t size);
+void eeprom_write_byte(uint8_t* address, uint8_t value);
+void eeprom_update_byte(uint8_t* address, uint8_t value);
+int eeprom_is_ready();
+void eeprom_busy_wait();
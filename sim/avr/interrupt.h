@@ -0,0 +1,5 @@
+// avr/interrupt.h - Interrupt handlers for the host simulation
+// The handlers are given C linkage so sim.cpp can call them when the interrupt occurs
+#pragma once
+
+#define ISR(vector) extern "C" void vector(); extern "C" void vector()
@@ -0,0 +1,18 @@
+// avr/power.h - Power reduction for the host simulation
+// The simulated peripherals draw no current, so these only record that the sketch turned them off
+#pragma once
+
+extern uint8_t PRR;
+#define PRADC 0
+#define PRUSART0 1
+#define PRSPI 2
+#define PRTIM1 3
+#define PRTIM0 5
+#define PRTIM2 6
+#define PRTWI 7
+
+#define power_adc_disable() (PRR |= _BV(PRADC))
+#define power_spi_disable() (PRR |= _BV(PRSPI))
+#define power_twi_disable() (PRR |= _BV(PRTWI))
+#define power_timer1_disable() (PRR |= _BV(PRTIM1))
+#define power_timer2_disable() (PRR |= _BV(PRTIM2))
@@ -0,0 +1,11 @@
+// avr/sleep.h - Sleep modes for the host simulation (see sim.cpp)
+#pragma once
+
+#define SLEEP_MODE_IDLE 0
+#define SLEEP_MODE_ADC 1
+#define SLEEP_MODE_PWR_DOWN 2
+
+void set_sleep_mode(uint8_t mode);
+void sleep_enable();
+void sleep_disable();
+void sleep_cpu();
@@ -0,0 +1,18 @@
+// avr/wdt.h - The watchdog timer for the host simulation
+// Only interrupt mode is simulated, a watchdog reset stops the simulation (see sim.cpp)
+#pragma once
+
+#include <avr/interrupt.h>
+
+extern SimRegister WDTCSR;
+#define WDP0 0
+#define WDP1 1
+#define WDP2 2
+#define WDE 3
+#define WDCE 4
+#define WDP3 5
+#define WDIE 6
+#define WDIF 7
+
+void wdt_reset();
+void wdt_disable();
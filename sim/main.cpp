@@ -0,0 +1,801 @@
+// main.cpp - Scenarios which drive the simulated controller
+//
+// Usage: shower_sim [-v] scenario
+//   shower      open the shower with a command, run water through it and check it closes on time
+//   wraparound  the same, while millis() and micros() overflow
+//   sleep       check the controller sleeps when idle, wakes on flow and counts the time asleep
+//   leak        run water with the solenoid closed and check the leak is reported
+//   trickle     drip water below the leak threshold, check the volume the Raspberry Pi logs, then widen the flow deadband
+//   warm        warm the water during a shower and check it is reported once, without blocking the loop
+//   budget      open the shower with a volume budget and check it closes once the volume is used
+//   channels    pulse a pin without a flow sensor, and check only the shower is reported
+//   backfill    request records from the telemetry log, including ones still waiting to be written
+//   restore     reset the controller, and check telemetry continues from the log
+//   bench       report the cost of each loop and the time spent in each power state
+// With -v every frame and solenoid pin change is printed.
+//
+// The scenarios act as the Raspberry Pi would: commands are framed, preceded by a wake byte,
+// and sent again if they are not acknowledged.
+
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+#include "sim.h"
+
+// FRAME LAYOUT (see shower_timer.ino and bluetooth/frame.py)
+const uint8_t FRAME_SYNC = 0xA5;
+const uint8_t FRAME_VERSION = 7;
+const uint8_t FRAME_TELEMETRY = 0x01;
+const uint8_t FRAME_ACTUATION = 0x02;
+const uint8_t FRAME_RECORD = 0x03;
+const uint8_t FRAME_DIAGNOSTICS = 0x04;
+const uint8_t FRAME_ACK = 0x05;
+const uint8_t FRAME_NACK = 0x06;
+const uint8_t FRAME_LEAK = 0x07;
+const uint8_t FRAME_WARM = 0x08;
+const uint8_t COMMAND_OPEN = 0x81;
+const uint8_t COMMAND_STATUS = 0x83;
+const uint8_t COMMAND_SET_DURATION = 0x84;
+const uint8_t COMMAND_SET_REPORTING = 0x85;
+const uint8_t COMMAND_DIAGNOSTICS = 0x86;
+const uint8_t COMMAND_BACKFILL = 0x87;
+const uint8_t FLAG_SOLENOID_OPEN = 0x01;
+const uint8_t FLAG_FLOWING = 0x08;
+const uint8_t FLAG_LEAK = 0x20;
+const uint8_t FLAG_WARM = 0x40;
+const uint32_t BUDGET_NONE = 0xFFFFFFFF;
+const uint32_t MAX_SHOWER_DURATION = 1800000;
+
+// CONSTANTS
+const uint64_t SECOND = 1000000;
+const uint64_t MILLISECOND = 1000;
+const uint64_t WAKE_DELAY = 30 * MILLISECOND;   // The gap between the wake byte and the command, as bluetooth writes are separate
+const uint64_t REPLY_TIMEOUT = SECOND;          // How long the Raspberry Pi waits for a reply before sending a command again
+const int COMMAND_ATTEMPTS = 3;
+const uint64_t FLOW_PERIOD = 14815;             // 9 L/min at 450 pulses per litre
+const uint8_t UNUSED_PIN = 5;                   // A port D pin with no flow channel
+const uint64_t HOT_PERIOD = 22727;              // 4 L/min at 660 pulses per litre, as from a sensor on the hot water line
+const size_t TELEMETRY_SIZE = 29;               // The telemetry payload up to the first extra flow channel
+const size_t LOG_PAYLOAD_SIZE = 15;             // The telemetry payload bytes kept in each log record
+const uint64_t OVERFLOW_MICROS = 4294967296000ULL;  // The Timer0 clock when millis() (and micros()) overflow
+
+// A frame sent by the controller
+struct Frame
+{
+  uint64_t time;
+  uint8_t type;
+  std::vector<uint8_t> payload;
+};
+
+bool verbose;
+int failures;
+size_t decoded;                 // The number of bytes in simSent which have been decoded
+size_t tracedPins;              // The number of pin changes which have been printed
+std::vector<Frame> frames;      // Every frame sent by the controller
+uint8_t requestId;
+
+
+// crc16 - Calculate the CRC-16/CCITT checksum used in frames
+// Params:
+//   data - the bytes to check
+//   size - the number of bytes
+// Returns: the checksum
+uint16_t crc16(const uint8_t* data, size_t size)
+{
+  uint16_t crc = 0xFFFF;
+  for (size_t i = 0; i < size; i++) {
+    crc ^= data[i] << 8;
+    for (int bit = 0; bit < 8; bit++)
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+  }
+  return crc;
+}
+
+
+// get16, get32 - Read a little endian value from a payload
+uint16_t get16(const std::vector<uint8_t>& payload, size_t offset)
+{
+  return payload[offset] | (payload[offset + 1] << 8);
+}
+
+uint32_t get32(const std::vector<uint8_t>& payload, size_t offset)
+{
+  return get16(payload, offset) | ((uint32_t)get16(payload, offset + 2) << 16);
+}
+
+
+// decode - Decode the frames the controller has sent since the last call, and print them and any pin changes if verbose
+// Params: None
+// Returns: Nothing
+void decode()
+{
+  while (decoded < simSent.size()) {
+    if (simSent[decoded].value != FRAME_SYNC || decoded + 4 > simSent.size()) {
+      decoded++;
+      continue;
+    }
+    size_t length = simSent[decoded + 3].value;
+    if (decoded + 6 + length > simSent.size())
+      break;
+    std::vector<uint8_t> body;
+    for (size_t i = decoded + 1; i < decoded + 6 + length; i++)
+      body.push_back(simSent[i].value);
+    uint16_t crc = body[length + 3] | (body[length + 4] << 8);
+    if (body[0] != FRAME_VERSION || crc16(body.data(), length + 3) != crc) {
+      decoded++;
+      continue;
+    }
+    Frame frame = { simSent[decoded].time, body[1], std::vector<uint8_t>(body.begin() + 3, body.begin() + 3 + length) };
+    frames.push_back(frame);
+    decoded += 6 + length;
+    if (verbose) {
+      printf("  %10.3f s  frame %02x ", frame.time / 1e6, frame.type);
+      for (uint8_t value : frame.payload)
+        printf("%02x", value);
+      printf("\n");
+    }
+  }
+
+  for (; verbose && tracedPins < simPins.size(); tracedPins++)
+    printf("  %10.3f s  pin %d %s\n", simPins[tracedPins].time / 1e6, simPins[tracedPins].pin, simPins[tracedPins].value ? "HIGH" : "LOW");
+}
+
+
+// run - Run the controller and decode what it sends
+// Params: duration - the time to run for (microseconds)
+// Returns: Nothing
+void run(uint64_t duration)
+{
+  simRun(duration);
+  decode();
+}
+
+
+// check - Report the result of a check
+// Params:
+//   passed - whether the check passed
+//   description - what was checked
+// Returns: Nothing
+void check(bool passed, const char* description)
+{
+  printf("  %s  %s\n", passed ? "ok  " : "FAIL", description);
+  if (!passed)
+    failures++;
+}
+
+
+// command - Frame a command with the next request id
+// Params:
+//   type - the command type
+//   arguments - the bytes after the request id
+// Returns: the bytes of the frame
+std::vector<uint8_t> command(uint8_t type, const std::vector<uint8_t>& arguments)
+{
+  requestId = requestId % 255 + 1;
+  std::vector<uint8_t> data = { FRAME_SYNC, FRAME_VERSION, type, (uint8_t)(arguments.size() + 1), requestId };
+  for (uint8_t value : arguments)
+    data.push_back(value);
+  uint16_t crc = crc16(data.data() + 1, data.size() - 1);
+  data.push_back(crc & 0xFF);
+  data.push_back(crc >> 8);
+  return data;
+}
+
+
+// request - Send a command to the controller and wait for its reply, trying again if there is none
+// Params:
+//   type - the command type
+//   arguments - the bytes after the request id
+// Returns: true if the command was acknowledged
+bool request(uint8_t type, const std::vector<uint8_t>& arguments)
+{
+  std::vector<uint8_t> data = command(type, arguments);
+  uint64_t start = simTime;
+  for (int attempt = 0; attempt < COMMAND_ATTEMPTS; attempt++) {
+    uint8_t wake = 'w';
+    simReceive(&wake, 1);
+    run(WAKE_DELAY);
+    simReceive(data.data(), data.size());
+    size_t first = frames.size();
+    for (uint64_t waited = 0; waited < REPLY_TIMEOUT; waited += 10 * MILLISECOND) {
+      run(10 * MILLISECOND);
+      for (size_t i = first; i < frames.size(); i++) {
+        const Frame& reply = frames[i];
+        if ((reply.type == FRAME_ACK || reply.type == FRAME_NACK) && reply.payload[0] == requestId && reply.payload[1] == type) {
+          if (verbose)
+            printf("  command %02x %s after %.1f ms (%d attempts)\n", type, reply.type == FRAME_ACK ? "acknowledged" : "rejected",
+              (reply.time - start) / 1e3, attempt + 1);
+          return reply.type == FRAME_ACK;
+        }
+      }
+    }
+  }
+  return false;
+}
+
+
+// find - Find the first frame of a type sent at or after a time
+// Params:
+//   type - the frame type
+//   after - the earliest time
+// Returns: the frame, or NULL if there is none
+const Frame* find(uint8_t type, uint64_t after)
+{
+  for (const Frame& frame : frames)
+    if (frame.type == type && frame.time >= after)
+      return &frame;
+  return NULL;
+}
+
+
+// lastTelemetry - Find the most recent telemetry frame
+// Params: None
+// Returns: the frame, or NULL if there is none
+const Frame* lastTelemetry()
+{
+  const Frame* last = NULL;
+  for (const Frame& frame : frames)
+    if (frame.type == FRAME_TELEMETRY)
+      last = &frame;
+  return last;
+}
+
+
+// logged - Check the records resent from the log match the telemetry frames they were taken from
+// Params:
+//   first - the sequence number of the first record
+//   count - the number of records
+//   after - the time the records were requested
+// Returns: the number of records which were resent and match
+int logged(uint16_t first, int count, uint64_t after)
+{
+  int matched = 0;
+  for (const Frame& record : frames) {
+    uint16_t sequence = get16(record.payload, 0);
+    if (record.type != FRAME_RECORD || record.time < after || (uint16_t)(sequence - first) >= count)
+      continue;
+    for (const Frame& frame : frames) {
+      if (frame.type == FRAME_TELEMETRY && get16(frame.payload, 0) == sequence && frame.time < record.time &&
+          record.payload.size() == LOG_PAYLOAD_SIZE && memcmp(frame.payload.data(), record.payload.data(), LOG_PAYLOAD_SIZE) == 0) {
+        matched++;
+        break;
+      }
+    }
+  }
+  return matched;
+}
+
+
+// backfillArguments - The arguments of a backfill command
+// Params:
+//   first - the sequence number of the first record
+//   count - the number of records
+// Returns: the arguments
+std::vector<uint8_t> backfillArguments(uint16_t first, uint8_t count)
+{
+  return { (uint8_t)(first & 0xFF), (uint8_t)(first >> 8), count };
+}
+
+
+// diagnostics - Request the diagnostic counters
+// Params: None
+// Returns: the diagnostics frame, or NULL if it was not received
+const Frame* diagnostics()
+{
+  uint64_t start = simTime;
+  if (!request(COMMAND_DIAGNOSTICS, {}))
+    return NULL;
+  return find(FRAME_DIAGNOSTICS, start);
+}
+
+
+// shower - Open the shower with a command, run water through it, and check it closes at the end of the shower
+// Params: startMicros - the Timer0 clock at boot
+// Returns: Nothing
+void shower(uint64_t startMicros)
+{
+  simBoot(startMicros);
+  run(2 * SECOND);
+  check(simPower() == SIM_POWER_DOWN, "sleeps at boot until it is needed");
+
+  check(request(COMMAND_SET_DURATION, { 0x60, 0xEA, 0x00, 0x00 }), "shower duration set to 60 s");
+  uint64_t opened = simTime;
+  check(request(COMMAND_OPEN, {}), "open command acknowledged");
+  run(100 * MILLISECOND);
+  const Frame* open = find(FRAME_ACTUATION, opened);
+  check(open && open->payload[4] == 1 && open->payload[9] == requestId, "solenoid opened by the command");
+  bool pulsed = false;
+  for (const SimPinChange& change : simPins)
+    pulsed |= change.time >= opened && change.value == 1;
+  check(pulsed, "solenoid driver pulsed");
+
+  uint32_t openMillis = simMillis();
+  uint64_t flowStart = simTime;
+  simFlow(FLOW_PERIOD);
+  run(61 * SECOND);
+  uint64_t flowEnd = simTime;
+  simFlow(0);
+  run(4 * SECOND);
+  const Frame* close = find(FRAME_ACTUATION, opened + SECOND);
+  check(close && close->payload[4] == 0 && close->payload[9] == 0, "solenoid closed at the end of the shower");
+  if (close) {
+    double duration = (close->time - open->time) / 1e6;
+    printf("  shower lasted %.2f s\n", duration);
+    check(duration > 59.5 && duration < 61.0, "shower lasted 60 s");
+  }
+  const Frame* halfway = find(FRAME_TELEMETRY, opened + 30 * SECOND);
+  check(halfway && get32(halfway->payload, 21) > 29000 && get32(halfway->payload, 21) <= 30000 &&
+    get32(halfway->payload, 25) == BUDGET_NONE, "telemetry reports the time remaining");
+
+  int reports = 0;
+  const Frame* last = NULL;
+  for (const Frame& frame : frames) {
+    if (frame.type == FRAME_TELEMETRY && frame.time > opened && (frame.payload[14] & FLAG_FLOWING)) {
+      reports++;
+      last = &frame;
+    }
+  }
+  check(reports >= 60, "telemetry sent every second while flowing");
+  if (last) {
+    uint32_t total = get32(last->payload, 6);
+    uint64_t pulses = ((last->time < flowEnd ? last->time : flowEnd) - flowStart) / FLOW_PERIOD;
+    printf("  %d telemetry frames while flowing, flow total %u of %llu pulses\n", reports, total, (unsigned long long)pulses);
+    check(total + 1 >= pulses && total <= pulses, "every flow pulse counted");
+  }
+  printf("  millis() from %u to %u\n", openMillis, simMillis());
+
+  run(15 * SECOND);
+  check(simPower() == SIM_POWER_DOWN, "sleeps again once the water stops");
+  check(find(FRAME_LEAK, 0) == NULL, "water draining after the shower is not a leak");
+  check(simRxLost <= 2 * COMMAND_ATTEMPTS, "only wake bytes lost");
+  check(simTxCorrupt == 0, "no byte sent was cut off by sleeping");
+}
+
+
+// sleeping - Check the controller sleeps while idle, wakes on flow and counts the time asleep
+// Params: None
+// Returns: Nothing
+void sleeping()
+{
+  simBoot(0);
+  run(60 * SECOND);
+  printf("  asleep %.1f%% of the first minute\n", 100.0 * simPowerMicros[SIM_POWER_DOWN] / simTime);
+  check(simPowerMicros[SIM_POWER_DOWN] > 59 * SECOND, "sleeps while nothing happens");
+
+  uint64_t flowed = simTime;
+  simFlow(FLOW_PERIOD);
+  run(100 * MILLISECOND);
+  check(simPower() != SIM_POWER_DOWN, "wakes on flow");
+  check(!simInterruptAttached(1), "bluetooth wake interrupt detached once awake");
+  run(3 * SECOND);
+  simFlow(0);
+  const Frame* telemetry = find(FRAME_TELEMETRY, flowed);
+  check(telemetry && (telemetry->payload[14] & FLAG_FLOWING), "reports the flow");
+
+  run(15 * SECOND);
+  check(simPower() == SIM_POWER_DOWN, "sleeps again once the water stops");
+
+  const Frame* counters = diagnostics();
+  check(counters != NULL, "diagnostics received");
+  if (counters) {
+    uint32_t asleep = get32(counters->payload, 8);
+    uint64_t actual = simPowerMicros[SIM_POWER_DOWN] / MILLISECOND;
+    uint64_t sleeps = get16(counters->payload, 12) + get16(counters->payload, 14);
+    uint64_t error = asleep > actual ? asleep - actual : actual - asleep;
+    printf("  asleep %u ms counted, %llu ms actual in %llu sleeps\n", asleep, (unsigned long long)actual, (unsigned long long)sleeps);
+    check(error <= sleeps * 500, "time asleep counted to within half a watchdog period per sleep");
+    check(get16(counters->payload, 12) == 1, "one flow wake counted");
+    check(get16(counters->payload, 14) >= 1, "bluetooth wake counted");
+  }
+}
+
+
+// leak - Run water with the solenoid closed, and check the leak is reported straight away
+// Params: None
+// Returns: Nothing
+void leak()
+{
+  simBoot(0);
+  run(10 * SECOND);
+
+  uint64_t started = simTime;
+  simFlow(FLOW_PERIOD * 10);          // A slow leak, 0.9 L/min
+  run(3 * SECOND);
+  check(simPower() != SIM_POWER_DOWN, "stays awake while water flows with the solenoid closed");
+  run(90 * SECOND);
+
+  const Frame* first = find(FRAME_LEAK, started);
+  check(first != NULL, "leak reported");
+  if (first) {
+    printf("  leak reported after %.2f s\n", (first->time - started) / 1e6);
+    check(first->time - started < 8 * SECOND, "leak reported within 8 s");
+    const Frame* repeat = find(FRAME_LEAK, first->time + 1);
+    check(repeat && get32(repeat->payload, 4) == get32(first->payload, 4), "leak repeated with the same start time");
+  }
+  bool flagged = false;
+  for (const Frame& frame : frames)
+    flagged |= frame.type == FRAME_TELEMETRY && (frame.payload[14] & FLAG_LEAK);
+  check(flagged, "telemetry flags the leak");
+
+  simFlow(0);
+  run(20 * SECOND);
+  check(simPower() == SIM_POWER_DOWN, "sleeps once the leak stops");
+}
+
+
+// trickle - Drip water with the solenoid closed, below the leak threshold, and check the volume the Raspberry Pi logs
+// Params: None
+// Returns: Nothing
+//
+// Telemetry is only sent when the readings change or on the heartbeat, so the frames are irregularly spaced.
+// The Raspberry Pi logs the volume from the change in the flow total between frames (see log_readings in
+// bluetooth/bluetooth.py), which the alert check adds up, so it must match the water that dripped.
+// Then the flow deadband is widened with COMMAND_SET_REPORTING, which should send fewer frames for the same drips.
+void trickle()
+{
+  simBoot(0);
+  run(10 * SECOND);
+  uint32_t previous = get32(lastTelemetry()->payload, 6);
+  uint64_t previousTime = lastTelemetry()->time;
+  uint64_t started = simTime;
+
+  // Drips every 1.3 s to every 4 s, with pauses long enough for the heartbeat and for the controller to sleep
+  const uint64_t periods[] = { 1300 * MILLISECOND, 0, 1700 * MILLISECOND, 4 * SECOND, 0, 1300 * MILLISECOND };
+  const uint64_t DRIPPING = 30 * SECOND;
+  uint64_t pulses = 0;
+  for (uint64_t period : periods) {
+    simFlow(period);
+    run(DRIPPING);
+    if (period)
+      pulses += DRIPPING / period;
+  }
+  simFlow(0);
+  run(15 * SECOND);
+  check(find(FRAME_LEAK, started) == NULL, "drips are below the leak threshold");
+
+  uint32_t logged = 0;
+  uint64_t shortest = UINT64_MAX;
+  uint64_t longest = 0;
+  int reports = 0;
+  for (const Frame& frame : frames) {
+    if (frame.type != FRAME_TELEMETRY || frame.time <= started)
+      continue;
+    uint32_t total = get32(frame.payload, 6);
+    if (!(frame.payload[14] & FLAG_SOLENOID_OPEN))
+      logged += total - previous;
+    uint64_t gap = frame.time - previousTime;
+    shortest = gap < shortest ? gap : shortest;
+    longest = gap > longest ? gap : longest;
+    previous = total;
+    previousTime = frame.time;
+    reports++;
+  }
+  printf("  %d telemetry frames from %.1f s to %.1f s apart, %u of %llu pulses logged\n", reports, shortest / 1e6, longest / 1e6,
+    logged, (unsigned long long)pulses);
+  check(reports > 0 && longest >= 5 * shortest, "telemetry irregularly spaced");
+  // The drips are counted to within a pulse each time their rate changes
+  check(logged + 4 >= pulses && logged <= pulses + 4, "volume logged matches the water that dripped");
+
+  // With a flow deadband of 5 pulses the drips are only reported every few pulses, or on the heartbeat
+  check(!request(COMMAND_SET_REPORTING, { 0xE8, 0x03, 0x10, 0x27, 0, 0, 5, 0 }), "deadbands without all four values rejected");
+  check(request(COMMAND_SET_REPORTING, { 0xE8, 0x03, 0x10, 0x27, 0, 0, 5, 0, 0x64, 0, 0x10, 0, 0x08, 0 }),
+    "flow deadband set to 5 pulses");
+  started = simTime;
+  simFlow(1300 * MILLISECOND);
+  run(DRIPPING);
+  simFlow(0);
+  reports = 0;
+  for (const Frame& frame : frames)
+    reports += frame.type == FRAME_TELEMETRY && frame.time > started;
+  printf("  %d telemetry frames in %.0f s of drips\n", reports, DRIPPING / 1e6);
+  check(reports <= 6, "drips reported less often");
+}
+
+
+// warm - Warm the water during a shower, and check the controller reports it once and quickly
+// Params: None
+// Returns: Nothing
+void warm()
+{
+  simBoot(0);
+  run(SECOND);
+  check(request(COMMAND_OPEN, {}), "open command acknowledged");
+  simFlow(FLOW_PERIOD);
+
+  // Warm from 20 to 40 degrees C over 20 seconds, then cool to 30 and warm to 40 again
+  uint64_t crossed = 0;
+  for (int step = 0; step <= 200; step++) {
+    int temperature = 20 * 16 + step * 20 * 16 / 200;
+    simSetTemperature(temperature);
+    if (!crossed && temperature >= 35 * 16)
+      crossed = simTime;
+    run(100 * MILLISECOND);
+  }
+  simSetTemperature(30 * 16);
+  run(3 * SECOND);
+  simSetTemperature(40 * 16);
+  run(3 * SECOND);
+
+  int reports = 0;
+  const Frame* first = NULL;
+  for (const Frame& frame : frames) {
+    if (frame.type == FRAME_WARM) {
+      reports++;
+      if (!first)
+        first = &frame;
+    }
+  }
+  check(reports == 1, "warm water reported once per shower");
+  if (first) {
+    printf("  warm water reported %.0f ms after it reached 35 degrees\n", (first->time - crossed) / 1e3);
+    check(first->time - crossed < SECOND, "warm water reported within a second");
+    check((int16_t)get16(first->payload, 4) >= 35 * 16, "reported temperature is warm");
+  }
+  const Frame* telemetry = find(FRAME_TELEMETRY, simTime - 2 * SECOND);
+  check(telemetry && (telemetry->payload[14] & FLAG_WARM) && (int16_t)get16(telemetry->payload, 19) == 40 * 16,
+    "telemetry reports the temperature");
+  printf("  longest loop %.2f ms\n", simLongestLoop / 1e3);
+  check(simLongestLoop < 10 * MILLISECOND, "the loop never waits for a conversion");
+}
+
+
+// budget - Open the shower with a volume budget, and check the controller closes it once the volume is used,
+// or after MAX_SHOWER_DURATION if the water never flows
+// Params: None
+// Returns: Nothing
+void budget()
+{
+  simBoot(0);
+  run(SECOND);
+  check(!request(COMMAND_OPEN, { 0, 0, 0, 0, 0, 0, 0, 0 }), "a budget without a limit is rejected");
+  uint64_t opened = simTime;
+  check(request(COMMAND_OPEN, { 0, 0, 0, 0, 0xD0, 0x07, 0, 0 }), "open with a 2 L budget acknowledged");
+  run(100 * MILLISECOND);
+  uint64_t flowStart = simTime;
+  simFlow(FLOW_PERIOD);
+  run(20 * SECOND);
+  simFlow(0);
+  run(4 * SECOND);
+
+  const Frame* close = find(FRAME_ACTUATION, opened + 200 * MILLISECOND);
+  check(close && close->payload[4] == 0 && close->payload[9] == 0, "solenoid closed by the controller");
+  if (close) {
+    uint64_t pulses = (close->time - flowStart) / FLOW_PERIOD;
+    printf("  closed after %.2f s and %llu pulses\n", (close->time - flowStart) / 1e6, (unsigned long long)pulses);
+    check(pulses >= 900 && pulses <= 905, "closed once 2 L had flowed");
+  }
+
+  uint32_t previous = BUDGET_NONE;
+  bool decreasing = true;
+  int reports = 0;
+  for (const Frame& frame : frames) {
+    if (frame.type != FRAME_TELEMETRY || frame.time < flowStart || !(frame.payload[14] & FLAG_SOLENOID_OPEN))
+      continue;
+    uint32_t remaining = get32(frame.payload, 25);
+    decreasing &= remaining <= previous && get32(frame.payload, 21) <= MAX_SHOWER_DURATION;
+    previous = remaining;
+    reports++;
+  }
+  printf("  %d telemetry frames, %u mL remaining in the last\n", reports, previous);
+  check(reports >= 12 && decreasing && previous < 2000, "telemetry reports the volume remaining");
+  const Frame* closed = find(FRAME_TELEMETRY, simTime - 2 * SECOND);
+  check(!closed || (get32(closed->payload, 21) == 0 && get32(closed->payload, 25) == 0), "nothing remains once closed");
+
+  // The supply is off, so the volume budget is never used
+  check(request(COMMAND_OPEN, { 0, 0, 0, 0, 0xD0, 0x07, 0, 0 }), "open with a 2 L budget and no water acknowledged");
+  opened = simTime;
+  run(MAX_SHOWER_DURATION * MILLISECOND + 10 * SECOND);
+  close = find(FRAME_ACTUATION, opened + 200 * MILLISECOND);
+  check(close && close->payload[4] == 0 && close->payload[9] == 0, "solenoid closed by the controller");
+  if (close) {
+    // millis() stops during each battery conversion, so the controller's 30 minutes are a little longer
+    printf("  closed after %.2f s without water\n", (close->time - opened) / 1e6);
+    check(close->time - opened < (MAX_SHOWER_DURATION + 5000) * MILLISECOND, "closed after the longest shower duration");
+  }
+  run(15 * SECOND);
+  check(simPower() == SIM_POWER_DOWN, "sleeps once closed");
+}
+
+
+// channels - Pulse a port D pin which has no flow channel, then run water through the shower, and check only the shower is reported
+// Params: None
+// Returns: Nothing
+//
+// The controller only has the flow sensor after the solenoid, so a pin without a channel must not wake it or add to telemetry
+void channels()
+{
+  simBoot(0);
+  run(20 * SECOND);
+  check(simPower() == SIM_POWER_DOWN, "sleeps while nothing happens");
+
+  simFlow(HOT_PERIOD, UNUSED_PIN);
+  run(5 * SECOND);
+  check(simPower() == SIM_POWER_DOWN, "a pin without a flow channel does not wake it");
+
+  uint64_t showerStart = simTime;
+  simFlow(FLOW_PERIOD);
+  run(5 * SECOND);
+  uint64_t end = simTime;
+  simFlow(0);
+  simFlow(0, UNUSED_PIN);
+  run(3 * SECOND);
+
+  const Frame* shower = NULL;
+  for (const Frame& frame : frames)
+    if (frame.type == FRAME_TELEMETRY && frame.time < end)
+      shower = &frame;
+  check(shower && shower->time > showerStart + 2 * SECOND, "reported while the shower is flowing");
+  if (shower) {
+    uint64_t showerPulses = (shower->time - showerStart) / FLOW_PERIOD;
+    printf("  shower %u of %llu pulses\n", get32(shower->payload, 6), (unsigned long long)showerPulses);
+    check(shower->payload.size() == TELEMETRY_SIZE, "telemetry carries only the shower channel");
+    check(get32(shower->payload, 6) + 1 >= showerPulses && get32(shower->payload, 6) <= showerPulses, "every shower pulse counted");
+  }
+}
+
+
+// backfill - Request records from the log, both written and still waiting for the EEPROM, and check they match the telemetry
+// Params: None
+// Returns: Nothing
+void backfill()
+{
+  simBoot(0);
+  run(SECOND);
+  // Opening the shower and the water starting to flow send two frames within a record's write time
+  check(request(COMMAND_OPEN, { 0x20, 0x4E, 0, 0, 0, 0, 0, 0 }), "open for 20 s acknowledged");
+  simFlow(FLOW_PERIOD);
+  run(15 * SECOND);
+  printf("  longest loop %.2f ms\n", simLongestLoop / 1e3);
+  check(simLongestLoop < 10 * MILLISECOND, "the loop never waits for the EEPROM");
+
+  // Ask for a status frame and its record together, so the record is still queued when it is resent.
+  // The battery is read for the status frame while the backfill command is arriving.
+  const Frame* last = lastTelemetry();
+  uint16_t status = get16(last->payload, 0) + 1;
+  uint64_t requested = simTime;
+  std::vector<uint8_t> data = command(COMMAND_STATUS, {});
+  simReceive(data.data(), data.size());
+  data = command(COMMAND_BACKFILL, backfillArguments(status, 1));
+  simReceive(data.data(), data.size());
+  run(500 * MILLISECOND);
+  check(logged(status, 1, requested) == 1, "a queued record resent");
+
+  requested = simTime;
+  check(request(COMMAND_BACKFILL, backfillArguments(status - 12, 12)), "backfill command acknowledged");
+  run(2 * SECOND);
+  int matched = logged(status - 12, 12, requested);
+  printf("  %d of 12 records resent\n", matched);
+  check(matched == 12, "written records resent");
+
+  simFlow(0);
+  run(25 * SECOND);
+  check(simPower() == SIM_POWER_DOWN, "sleeps once the records are written");
+  check(simLongestLoop < 10 * MILLISECOND, "the loop never waits for the EEPROM");
+  check(simRxLost <= COMMAND_ATTEMPTS, "only wake bytes lost");
+  check(simTxCorrupt == 0, "no byte sent was cut off by sleeping");
+}
+
+
+// restore - Reset the controller, and check telemetry continues from the newest record in the log
+// Params: None
+// Returns: Nothing
+//
+// The first reset is while the controller sleeps, when every record has been written, and the second
+// straight after a frame, while its record is still being written
+void restore()
+{
+  simBoot(0);
+  run(SECOND);
+  check(request(COMMAND_OPEN, { 0x10, 0x27, 0, 0, 0, 0, 0, 0 }), "open for 10 s acknowledged");
+  simFlow(FLOW_PERIOD);
+  run(10 * SECOND);
+  simFlow(0);
+  run(20 * SECOND);
+  check(simPower() == SIM_POWER_DOWN, "sleeps once the water stops");
+
+  uint16_t before = get16(lastTelemetry()->payload, 0);
+  simReset();
+  uint64_t reset = simTime;
+  check(request(COMMAND_STATUS, {}), "status command acknowledged after the reset");
+  run(100 * MILLISECOND);
+  const Frame* after = find(FRAME_TELEMETRY, reset);
+  check(after && get16(after->payload, 0) == (uint16_t)(before + 1), "telemetry continues from the newest record");
+  uint64_t requested = simTime;
+  check(request(COMMAND_BACKFILL, backfillArguments(before - 4, 5)), "backfill command acknowledged");
+  run(SECOND);
+  check(logged(before - 4, 5, requested) == 5, "records from before the reset resent");
+
+  // Reset while the record of a frame is being written, which leaves it incomplete
+  simFlow(FLOW_PERIOD);
+  run(5 * SECOND);
+  size_t sent = frames.size();
+  while (frames.size() == sent || frames.back().type != FRAME_TELEMETRY)
+    run(MILLISECOND);
+  run(20 * MILLISECOND);
+  uint16_t partial = get16(frames.back().payload, 0);
+  simReset();
+  simFlow(0);
+  reset = simTime;
+  check(request(COMMAND_STATUS, {}), "status command acknowledged after the second reset");
+  run(100 * MILLISECOND);
+  after = find(FRAME_TELEMETRY, reset);
+  check(after && get16(after->payload, 0) == partial, "an incomplete record is not restored");
+  requested = simTime;
+  check(request(COMMAND_BACKFILL, backfillArguments(partial - 3, 3)), "backfill command acknowledged");
+  run(SECOND);
+  check(logged(partial - 3, 3, requested) == 3, "the records before it resent");
+}
+
+
+// bench - Report the cost of each loop and the time spent in each power state
+// Params: None
+// Returns: Nothing
+//
+// Ten showers of four minutes with ten minutes between them
+void bench()
+{
+  simBoot(0);
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < 10; i++) {
+    request(COMMAND_OPEN, {});
+    simFlow(FLOW_PERIOD);
+    run(240 * SECOND);
+    simFlow(0);
+    run(600 * SECOND);
+  }
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  const char* names[SIM_POWER_STATES] = { "active", "idle", "adc", "power down" };
+  printf("  %llu loops in %.0f s simulated, %.0f ns host time per loop\n", (unsigned long long)simLoops, simTime / 1e6,
+    elapsed * 1e9 / simLoops);
+  uint64_t awake = simPowerMicros[SIM_ACTIVE] + simPowerMicros[SIM_IDLE] + simPowerMicros[SIM_ADC];
+  printf("  %.0f loops per second awake\n", simLoops / (awake / 1e6));
+  for (int state = 0; state < SIM_POWER_STATES; state++)
+    printf("  %-10s %10.3f s %6.2f%%\n", names[state], simPowerMicros[state] / 1e6, 100.0 * simPowerMicros[state] / simTime);
+  printf("  %zu bytes sent, %lu bytes received lost\n", simSent.size(), simRxLost);
+}
+
+
+int main(int argc, char** argv)
+{
+  int arg = 1;
+  if (arg < argc && strcmp(argv[arg], "-v") == 0) {
+    verbose = true;
+    arg++;
+  }
+  if (arg >= argc) {
+    fprintf(stderr, "Usage: %s [-v] shower|wraparound|sleep|leak|trickle|warm|budget|channels|backfill|restore|bench\n", argv[0]);
+    return 2;
+  }
+
+  const char* scenario = argv[arg];
+  printf("%s\n", scenario);
+  if (strcmp(scenario, "shower") == 0)
+    shower(0);
+  else if (strcmp(scenario, "wraparound") == 0)
+    shower(OVERFLOW_MICROS - 20 * SECOND);
+  else if (strcmp(scenario, "sleep") == 0)
+    sleeping();
+  else if (strcmp(scenario, "leak") == 0)
+    leak();
+  else if (strcmp(scenario, "trickle") == 0)
+    trickle();
+  else if (strcmp(scenario, "warm") == 0)
+    warm();
+  else if (strcmp(scenario, "budget") == 0)
+    budget();
+  else if (strcmp(scenario, "channels") == 0)
+    channels();
+  else if (strcmp(scenario, "backfill") == 0)
+    backfill();
+  else if (strcmp(scenario, "restore") == 0)
+    restore();
+  else if (strcmp(scenario, "bench") == 0)
+    bench();
+  else {
+    fprintf(stderr, "Unknown scenario %s\n", scenario);
+    return 2;
+  }
+  return failures > 0;
+}
@@ -0,0 +1,861 @@
+// sim.cpp - A simulated ATmega328P for running shower_timer.ino on Linux
+//
+// The sketch runs on its own stack (a ucontext), so it can be paused wherever it waits for time to pass
+// (while asleep, for instance) and resumed by the next call to simRun. Everything which happens outside the
+// CPU - flow pulses, received bytes, the serial transmitter, Timer0, the watchdog and the ADC - is an event
+// at a point in time. Events raise interrupts, which run when interrupts are enabled, and wake the CPU.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ucontext.h>
+#include <deque>
+#include "sim.h"
+#include "Arduino.h"
+#include "OneWire.h"
+#include <avr/sleep.h>
+#include <avr/power.h>
+#include <avr/eeprom.h>
+#include <avr/wdt.h>
+
+// CONSTANTS
+const uint64_t NEVER = UINT64_MAX;
+const uint64_t BYTE_MICROS = 1042;          // One byte (10 bits) at 9600 baud
+const uint64_t TIMER0_MICROS = 1024;        // Timer0 overflows every 1.024 ms, which keeps millis() running
+const uint64_t CONVERSION_MICROS = 104;     // 13 ADC clock cycles with the Arduino prescaler of 128
+const size_t SERIAL_BUFFER = 64;            // The size of the Arduino serial receive and transmit buffers
+const size_t SKETCH_STACK = 256 * 1024;
+const uint8_t FLOW_INPUT = 2;               // The pins of the external interrupts INT0 and INT1
+const uint8_t BLUETOOTH_INPUT = 3;
+const uint8_t PORT_PINS = 8;                // The pins of port D (D0 to D7), which share a pin change interrupt
+const uint64_t RESET_MICROS = 960;          // A 1-Wire reset and presence pulse
+const uint64_t SLOT_MICROS = 70;            // A 1-Wire bit
+const uint64_t DS18B20_CONVERSION = 750000; // A 12 bit DS18B20 temperature conversion
+const uint64_t EEPROM_WRITE_MICROS = 3400;  // Erasing and writing one EEPROM byte
+
+// Interrupts which can be pending
+enum SimInterrupt
+{
+  INT_EXTERNAL0 = 0x01,
+  INT_EXTERNAL1 = 0x02,
+  INT_PINCHANGE2 = 0x04,
+  INT_WATCHDOG = 0x08,
+  INT_ADC = 0x10,
+  INT_TIMER0 = 0x20,
+  INT_SERIAL = 0x40,
+};
+
+// The interrupt handlers in the sketch
+extern "C" void PCINT2_vect();
+extern "C" void WDT_vect();
+extern "C" void ADC_vect();
+void setup();
+void loop();
+
+// SIMULATION STATE VISIBLE TO THE SCENARIOS
+uint64_t simTime;
+uint64_t simLoopMicros = 100;
+uint64_t simLoops;
+uint64_t simLongestLoop;
+uint64_t simPowerMicros[SIM_POWER_STATES];
+unsigned long simRxLost;
+unsigned long simTxCorrupt;
+std::vector<SimPinChange> simPins;
+std::vector<SimByte> simSent;
+
+// CLOCKS AND POWER
+uint64_t ioTime;                  // The I/O clock (Timer0), which only runs while the CPU is active or idle
+SimPower power = SIM_ACTIVE;
+uint8_t sleepMode;
+bool sleepEnabled;
+bool interruptsEnabled = true;
+uint8_t pending;                  // The interrupts which have been raised but not handled
+
+// THE SKETCH AND THE SCENARIO TAKE TURNS TO RUN
+ucontext_t scenarioContext;
+ucontext_t sketchContext;
+void* sketchStack;
+uint64_t runEnd;                  // The sketch returns control to the scenario when simTime reaches this
+bool booted;
+
+// EXTERNAL INTERRUPTS
+void (*handlers[2])();
+int handlerModes[2];
+
+// FLOW SENSORS AND PIN CHANGE INTERRUPTS
+uint64_t flowPeriod[PORT_PINS];
+uint64_t flowNext[PORT_PINS] = { NEVER, NEVER, NEVER, NEVER, NEVER, NEVER, NEVER, NEVER };  // The time of the next edge
+uint8_t flowLevels;               // The level of each flow sensor pin
+SimRegister PCICR;
+SimRegister PCMSK2;
+SimRegister PIND;
+
+// SERIAL PORT
+struct Arrival
+{
+  uint64_t start;
+  uint8_t value;
+};
+std::deque<Arrival> arriving;     // Bytes being sent to the controller
+bool arrivalStarted;              // The first byte of arriving has started
+bool arrivalCorrupt;              // The serial port stopped while the first byte of arriving was being received
+std::deque<uint8_t> received;     // The serial receive buffer
+size_t transmitting;              // The number of bytes in the serial transmit buffer
+uint64_t transmitNext = NEVER;    // The I/O clock time the next byte finishes transmitting
+SimRegister UCSR0A;
+bool transmitComplete;            // Every byte written has been sent (TXC0)
+
+// ADC
+SimRegister ADMUX;
+SimRegister ADCSRA;
+uint16_t ADC;
+unsigned int analogCount = 512;
+uint64_t conversionDone = NEVER;
+uint32_t noise = 1;
+
+// WATCHDOG AND POWER REDUCTION
+SimRegister WDTCSR;
+uint64_t watchdogPeriod;
+uint64_t watchdogNext = NEVER;
+uint8_t PRR;
+
+// DS18B20
+int sensorTemperature = 20 * 16;
+int sensorMeasured = 20 * 16;     // The result of the last conversion
+uint64_t sensorConversionDone;
+uint8_t sensorCommand;            // The function command since the last reset (0 for none yet)
+bool sensorRomSelected;           // The ROM command has been received since the last reset
+uint8_t sensorScratchpad[9];
+uint8_t sensorRead;               // The number of scratchpad bytes read
+
+// EEPROM
+uint8_t eeprom[E2END + 1];
+uint64_t eepromReady;             // The time the byte being written is finished (the EEPROM has its own clock, so this is real time)
+SimSerial Serial;
+
+
+// fail - Stop the simulation because the sketch did something the real controller could not recover from
+// Params: message - what went wrong
+// Returns: Does not return
+void fail(const char* message)
+{
+  fprintf(stderr, "FAIL at %.3f s: %s\n", simTime / 1e6, message);
+  exit(1);
+}
+
+
+// ioRunning - Return whether the I/O clock is running in the current power state
+// Params: None
+// Returns: true if Timer0 and the serial port are running
+bool ioRunning()
+{
+  return power == SIM_ACTIVE || power == SIM_IDLE;
+}
+
+
+// ioToReal - Convert an I/O clock time to the real time it will happen, if the I/O clock keeps running
+// Params: time - the I/O clock time
+// Returns: the real time, or NEVER if the I/O clock is stopped
+uint64_t ioToReal(uint64_t time)
+{
+  if (time == NEVER || !ioRunning())
+    return NEVER;
+  return simTime + (time - ioTime);
+}
+
+
+// nextEvent - Return the time of the next event
+// Params: None
+// Returns: the real time of the next event, or NEVER if nothing will happen
+uint64_t nextEvent()
+{
+  uint64_t next = NEVER;
+  for (uint8_t pin = 0; pin < PORT_PINS; pin++)
+    if (flowNext[pin] < next)
+      next = flowNext[pin];
+  if (!arriving.empty()) {
+    uint64_t arrival = arriving.front().start + (arrivalStarted ? BYTE_MICROS : 0);
+    if (arrival < next)
+      next = arrival;
+  }
+  uint64_t overflow = ioToReal((ioTime / TIMER0_MICROS + 1) * TIMER0_MICROS);
+  if (overflow < next)
+    next = overflow;
+  uint64_t transmitted = ioToReal(transmitNext);
+  if (transmitted < next)
+    next = transmitted;
+  if (watchdogNext < next)
+    next = watchdogNext;
+  if (conversionDone < next)
+    next = conversionDone;
+  return next;
+}
+
+
+// raise - Raise an interrupt on an external interrupt pin
+// Params:
+//   interrupt - 0 or 1
+//   mode - the edge or level which occurred (RISING, FALLING or LOW)
+// Returns: Nothing
+void raise(int interrupt, int mode)
+{
+  if (!handlers[interrupt])
+    return;
+  int attached = handlerModes[interrupt];
+  if (attached == mode || (attached == CHANGE && mode != LOW))
+    pending |= interrupt == 0 ? INT_EXTERNAL0 : INT_EXTERNAL1;
+}
+
+
+// setFlowLevel - Change the level of a flow sensor pin, raising the pin change interrupt if it is enabled
+// Params:
+//   pin - the port D pin
+//   high - the new level
+// Returns: Nothing
+void setFlowLevel(uint8_t pin, bool high)
+{
+  if (((flowLevels >> pin) & 1) == high)
+    return;
+  flowLevels ^= _BV(pin);
+  if ((PCICR.value & _BV(PCIE2)) && (PCMSK2.value & _BV(pin)))
+    pending |= INT_PINCHANGE2;
+}
+
+
+// handleEvents - Process every event due at the current time
+// Params: None
+// Returns: Nothing
+void handleEvents()
+{
+  for (uint8_t pin = 0; pin < PORT_PINS; pin++) {
+    if (flowNext[pin] == simTime) {
+      // Each pulse rises at the start of the period, and falls half way through
+      bool high = !((flowLevels >> pin) & 1);
+      setFlowLevel(pin, high);
+      flowNext[pin] += high ? flowPeriod[pin] / 2 : flowPeriod[pin] - flowPeriod[pin] / 2;
+    }
+  }
+
+  if (!arriving.empty() && !arrivalStarted && arriving.front().start == simTime) {
+    // The start bit pulls the bluetooth monitor pin low
+    arrivalStarted = true;
+    arrivalCorrupt = !ioRunning();
+    raise(1, FALLING);
+    raise(1, LOW);
+  } else if (!arriving.empty() && arrivalStarted && arriving.front().start + BYTE_MICROS == simTime) {
+    if (arrivalCorrupt || received.size() >= SERIAL_BUFFER - 1) {
+      simRxLost++;
+    } else {
+      received.push_back(arriving.front().value);
+      pending |= INT_SERIAL;
+    }
+    arriving.pop_front();
+    arrivalStarted = false;
+    raise(1, RISING);
+  }
+
+  if (ioRunning()) {
+    if (ioTime % TIMER0_MICROS == 0)
+      pending |= INT_TIMER0;
+    if (transmitNext == ioTime) {
+      transmitting--;
+      transmitNext = transmitting > 0 ? ioTime + BYTE_MICROS : NEVER;
+      transmitComplete = transmitting == 0;
+    }
+  }
+
+  if (watchdogNext == simTime) {
+    pending |= INT_WATCHDOG;
+    watchdogNext += watchdogPeriod;
+  }
+
+  if (conversionDone == simTime) {
+    int count = (int)analogCount + (int)(noise % 5) - 2;
+    noise = noise * 1103515245 + 12345;
+    ADC = count < 0 ? 0 : count > 1023 ? 1023 : count;
+    ADCSRA.value = (ADCSRA.value & ~_BV(ADSC)) | _BV(ADIF);
+    conversionDone = NEVER;
+    if (ADCSRA.value & _BV(ADIE))
+      pending |= INT_ADC;
+  }
+}
+
+
+// step - Advance the clocks to the next event (or the limit), process the events then, and let the scenario
+// run if the end of the current run has been reached
+// Params: limit - the latest time to advance to
+// Returns: Nothing
+void step(uint64_t limit)
+{
+  if (simTime >= runEnd)
+    swapcontext(&sketchContext, &scenarioContext);
+
+  uint64_t next = nextEvent();
+  if (next > limit)
+    next = limit;
+  if (next > runEnd)
+    next = runEnd;
+
+  simPowerMicros[power] += next - simTime;
+  if (ioRunning())
+    ioTime += next - simTime;
+  simTime = next;
+  handleEvents();
+}
+
+
+// deliver - Run the handlers of the pending interrupts, if interrupts are enabled
+// Params: None
+// Returns: Nothing
+//
+// Interrupts are disabled while a handler runs, as they are on the AVR
+void deliver()
+{
+  while (interruptsEnabled && pending) {
+    uint8_t interrupt = pending & -pending;
+    pending &= ~interrupt;
+    interruptsEnabled = false;
+    if (interrupt == INT_EXTERNAL0 && handlers[0])
+      handlers[0]();
+    else if (interrupt == INT_EXTERNAL1 && handlers[1])
+      handlers[1]();
+    else if (interrupt == INT_PINCHANGE2)
+      PCINT2_vect();
+    else if (interrupt == INT_WATCHDOG)
+      WDT_vect();
+    else if (interrupt == INT_ADC)
+      ADC_vect();
+    interruptsEnabled = true;
+  }
+}
+
+
+// busy - Let time pass while the CPU is running
+// Params: duration - the time (microseconds)
+// Returns: Nothing
+void busy(uint64_t duration)
+{
+  uint64_t until = simTime + duration;
+  while (simTime < until) {
+    step(until);
+    deliver();
+  }
+}
+
+
+// startConversion - Start an ADC conversion, unless one is already running
+// Params: None
+// Returns: Nothing
+void startConversion()
+{
+  if (conversionDone != NEVER || !(ADCSRA.value & _BV(ADEN)))
+    return;
+  ADCSRA.value |= _BV(ADSC);
+  conversionDone = simTime + CONVERSION_MICROS;
+}
+
+
+// readADCSRA - Called when the sketch reads ADCSRA
+// Params: reg - the register
+// Returns: Nothing
+//
+// The sketch busy waits on ADSC, so reading it during a conversion takes time
+void readADCSRA(SimRegister& reg)
+{
+  if (reg.value & _BV(ADSC))
+    busy(1);
+}
+
+
+// writeADCSRA - Called when the sketch writes ADCSRA
+// Params: reg - the register
+// Returns: Nothing
+void writeADCSRA(SimRegister& reg)
+{
+  if (reg.value & _BV(ADSC))
+    startConversion();
+}
+
+
+// writeWDTCSR - Called when the sketch writes WDTCSR
+// Params: reg - the register
+// Returns: Nothing
+//
+// The watchdog period is 16 ms doubled for each step of the prescaler bits
+void writeWDTCSR(SimRegister& reg)
+{
+  if (reg.value & _BV(WDE) && !(reg.value & _BV(WDCE)))
+    fail("the watchdog was set to reset the controller");
+  if (!(reg.value & _BV(WDIE))) {
+    watchdogNext = NEVER;
+    return;
+  }
+  uint8_t prescaler = (reg.value & 0x07) | ((reg.value & _BV(WDP3)) ? 0x08 : 0);
+  watchdogPeriod = (uint64_t)16000 << prescaler;
+  watchdogNext = simTime + watchdogPeriod;
+}
+
+
+// readUCSR0A - Called when the sketch reads UCSR0A
+// Params: reg - the register
+// Returns: Nothing
+void readUCSR0A(SimRegister& reg)
+{
+  reg.value = transmitComplete ? _BV(TXC0) : 0;
+}
+
+
+// readPIND - Called when the sketch reads PIND
+// Params: reg - the register
+// Returns: Nothing
+void readPIND(SimRegister& reg)
+{
+  reg.value = flowLevels | (arrivalStarted ? 0 : _BV(BLUETOOTH_INPUT));
+}
+
+
+// runSketch - The entry point of the sketch context
+// Params: None
+// Returns: Does not return
+void runSketch()
+{
+  setup();
+  for (;;) {
+    uint64_t active = simPowerMicros[SIM_ACTIVE];
+    loop();
+    if (simPowerMicros[SIM_ACTIVE] - active > simLongestLoop)
+      simLongestLoop = simPowerMicros[SIM_ACTIVE] - active;
+    simLoops++;
+    busy(simLoopMicros);
+  }
+}
+
+
+// startSketch - Start the sketch from setup() on a fresh stack
+// Params: None
+// Returns: Nothing
+void startSketch()
+{
+  getcontext(&sketchContext);
+  sketchContext.uc_stack.ss_sp = sketchStack;
+  sketchContext.uc_stack.ss_size = SKETCH_STACK;
+  sketchContext.uc_link = NULL;
+  makecontext(&sketchContext, runSketch, 0);
+
+  // Run setup() and everything up to the first time the sketch waits
+  runEnd = simTime;
+  swapcontext(&scenarioContext, &sketchContext);
+}
+
+
+void simBoot(uint64_t startMicros)
+{
+  if (booted)
+    fail("the controller can only be booted once");
+  booted = true;
+
+  ioTime = startMicros;
+  memset(eeprom, 0xFF, sizeof(eeprom));                             // Erased
+  ADCSRA.value = _BV(ADEN) | _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0);   // As set by the Arduino core's init()
+  ADCSRA.onRead = readADCSRA;
+  ADCSRA.onWrite = writeADCSRA;
+  WDTCSR.onWrite = writeWDTCSR;
+  PIND.onRead = readPIND;
+  UCSR0A.onRead = readUCSR0A;
+
+  sketchStack = malloc(SKETCH_STACK);
+  startSketch();
+}
+
+
+void simReset()
+{
+  if (!booted)
+    fail("the controller must be booted before it is reset");
+
+  // Everything but the EEPROM and the world outside the controller returns to its state at power on.
+  // Bytes waiting to be sent are lost, and so is a byte being received.
+  ioTime = 0;
+  power = SIM_ACTIVE;
+  sleepEnabled = false;
+  interruptsEnabled = true;
+  pending = 0;
+  handlers[0] = handlers[1] = NULL;
+  PCICR.value = 0;
+  PCMSK2.value = 0;
+  received.clear();
+  transmitting = 0;
+  transmitNext = NEVER;
+  transmitComplete = false;
+  arrivalCorrupt = arrivalStarted;
+  ADCSRA.value = _BV(ADEN) | _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0);
+  conversionDone = NEVER;
+  WDTCSR.value = 0;
+  watchdogNext = NEVER;
+  PRR = 0;
+  sensorCommand = 0;
+  sensorRomSelected = false;
+
+  startSketch();
+}
+
+
+void simRun(uint64_t duration)
+{
+  runEnd = simTime + duration;
+  swapcontext(&scenarioContext, &sketchContext);
+}
+
+
+void simFlow(uint64_t period, uint8_t pin)
+{
+  flowPeriod[pin] = period;
+  if (period == 0) {
+    flowNext[pin] = NEVER;
+    setFlowLevel(pin, false);
+  } else if (flowNext[pin] == NEVER) {
+    flowNext[pin] = simTime + period;
+  }
+}
+
+
+void simReceive(const uint8_t* data, size_t size)
+{
+  uint64_t start = arriving.empty() ? simTime : arriving.back().start + BYTE_MICROS;
+  for (size_t i = 0; i < size; i++)
+    arriving.push_back({ start + i * BYTE_MICROS, data[i] });
+}
+
+
+void simSetAnalog(unsigned int count)
+{
+  analogCount = count;
+}
+
+
+void simSetTemperature(int sixteenths)
+{
+  sensorTemperature = sixteenths;
+}
+
+
+SimPower simPower()
+{
+  return power;
+}
+
+
+uint32_t simMillis()
+{
+  return (uint32_t)(ioTime / 1000);
+}
+
+
+bool simInterruptAttached(uint8_t interrupt)
+{
+  return handlers[interrupt] != NULL;
+}
+
+
+// ARDUINO CORE
+
+uint32_t millis()
+{
+  return (uint32_t)(ioTime / 1000);
+}
+
+uint32_t micros()
+{
+  return (uint32_t)ioTime;
+}
+
+void delay(uint32_t ms)
+{
+  busy((uint64_t)ms * 1000);
+}
+
+void delayMicroseconds(unsigned int us)
+{
+  busy(us);
+}
+
+void pinMode(uint8_t, uint8_t)
+{
+}
+
+void digitalWrite(uint8_t pin, uint8_t value)
+{
+  simPins.push_back({ simTime, pin, value });
+}
+
+int digitalRead(uint8_t pin)
+{
+  if (pin == BLUETOOTH_INPUT)
+    return arrivalStarted ? LOW : HIGH;
+  if (pin < PORT_PINS)
+    return (flowLevels >> pin) & 1;
+  return LOW;
+}
+
+int analogRead(uint8_t)
+{
+  startConversion();
+  while (ADCSRA & _BV(ADSC));
+  return ADC;
+}
+
+void analogReference(uint8_t)
+{
+}
+
+int digitalPinToInterrupt(uint8_t pin)
+{
+  return pin == FLOW_INPUT ? 0 : pin == BLUETOOTH_INPUT ? 1 : NOT_AN_INTERRUPT;
+}
+
+void attachInterrupt(uint8_t interrupt, void (*handler)(), int mode)
+{
+  handlers[interrupt] = handler;
+  handlerModes[interrupt] = mode;
+  // A low level interrupt fires for as long as the pin is low
+  if (interrupt == 1 && mode == LOW && arrivalStarted)
+    raise(1, LOW);
+}
+
+void detachInterrupt(uint8_t interrupt)
+{
+  handlers[interrupt] = NULL;
+  pending &= ~(interrupt == 0 ? INT_EXTERNAL0 : INT_EXTERNAL1);
+}
+
+void simCli()
+{
+  interruptsEnabled = false;
+}
+
+// Pending interrupts are not handled until the next call into the simulation, so like the AVR,
+// the instruction after sei() (usually sleep_cpu()) runs first
+void simSei()
+{
+  interruptsEnabled = true;
+}
+
+bool simInterruptsEnabled()
+{
+  return interruptsEnabled;
+}
+
+void SimSerial::begin(uint32_t)
+{
+}
+
+int SimSerial::available()
+{
+  deliver();
+  return received.size();
+}
+
+int SimSerial::read()
+{
+  deliver();
+  if (received.empty())
+    return -1;
+  uint8_t value = received.front();
+  received.pop_front();
+  return value;
+}
+
+int SimSerial::availableForWrite()
+{
+  return SERIAL_BUFFER - 1 - transmitting;
+}
+
+size_t SimSerial::write(uint8_t value)
+{
+  // Like the Arduino core, wait for space in the transmit buffer
+  while (transmitting >= SERIAL_BUFFER - 1)
+    busy(1);
+  simSent.push_back({ simTime, value });
+  transmitComplete = false;
+  if (transmitting++ == 0)
+    transmitNext = ioTime + BYTE_MICROS;
+  return 1;
+}
+
+size_t SimSerial::write(const uint8_t* buffer, size_t size)
+{
+  for (size_t i = 0; i < size; i++)
+    write(buffer[i]);
+  return size;
+}
+
+
+// AVR LIBRARY
+
+void set_sleep_mode(uint8_t mode)
+{
+  sleepMode = mode;
+}
+
+void sleep_enable()
+{
+  sleepEnabled = true;
+}
+
+void sleep_disable()
+{
+  sleepEnabled = false;
+}
+
+// sleep_cpu - Stop the CPU until an interrupt wakes it
+//
+// An interrupt which is already pending wakes the CPU straight away. Entering SLEEP_MODE_ADC starts a conversion.
+void sleep_cpu()
+{
+  if (!sleepEnabled)
+    return;
+  if (!interruptsEnabled)
+    fail("sleep_cpu with interrupts disabled, so the controller would never wake");
+
+  power = sleepMode == SLEEP_MODE_IDLE ? SIM_IDLE : sleepMode == SLEEP_MODE_ADC ? SIM_ADC : SIM_POWER_DOWN;
+  if (power == SIM_ADC)
+    startConversion();
+  if (arrivalStarted && !ioRunning())
+    arrivalCorrupt = true;
+  if (transmitting > 0 && !ioRunning()) {
+    // The byte being shifted out is cut off, and the rest of the buffer is sent once the clock starts again
+    simSent[simSent.size() - transmitting].value ^= 0xFF;
+    simTxCorrupt++;
+  }
+  while (!pending)
+    step(NEVER);
+  power = SIM_ACTIVE;
+  deliver();
+}
+
+int eeprom_is_ready()
+{
+  return simTime >= eepromReady;
+}
+
+void eeprom_busy_wait()
+{
+  if (simTime < eepromReady)
+    busy(eepromReady - simTime);
+}
+
+uint8_t eeprom_read_byte(const uint8_t* address)
+{
+  eeprom_busy_wait();
+  return eeprom[(uintptr_t)address & E2END];
+}
+
+void eeprom_read_block(void* destination, const void* source, size_t size)
+{
+  eeprom_busy_wait();
+  for (size_t i = 0; i < size; i++)
+    ((uint8_t*)destination)[i] = eeprom[((uintptr_t)source + i) & E2END];
+}
+
+void eeprom_write_byte(uint8_t* address, uint8_t value)
+{
+  eeprom_busy_wait();
+  eeprom[(uintptr_t)address & E2END] = value;
+  eepromReady = simTime + EEPROM_WRITE_MICROS;
+}
+
+// Like avr-libc, a byte which already holds the value is not written again
+void eeprom_update_byte(uint8_t* address, uint8_t value)
+{
+  if (eeprom_read_byte(address) != value)
+    eeprom_write_byte(address, value);
+}
+
+void wdt_reset()
+{
+  if (watchdogNext != NEVER)
+    watchdogNext = simTime + watchdogPeriod;
+}
+
+void wdt_disable()
+{
+  WDTCSR = 0;
+}
+
+
+// ONEWIRE LIBRARY
+
+OneWire::OneWire(uint8_t)
+{
+}
+
+uint8_t OneWire::reset()
+{
+  busy(RESET_MICROS);
+  sensorCommand = 0;
+  sensorRomSelected = false;
+  return 1;
+}
+
+void OneWire::skip()
+{
+  write(0xCC);
+}
+
+void OneWire::write(uint8_t value, uint8_t)
+{
+  busy(8 * SLOT_MICROS);
+  if (!sensorRomSelected) {
+    sensorRomSelected = value == 0xCC;
+    return;
+  }
+  sensorCommand = value;
+  if (value == 0x44) {
+    sensorConversionDone = simTime + DS18B20_CONVERSION;
+  } else if (value == 0xBE) {
+    sensorScratchpad[0] = sensorMeasured & 0xFF;
+    sensorScratchpad[1] = (sensorMeasured >> 8) & 0xFF;
+    sensorScratchpad[2] = 0x4B;       // Alarm thresholds and configuration (12 bit) as shipped
+    sensorScratchpad[3] = 0x46;
+    sensorScratchpad[4] = 0x7F;
+    sensorScratchpad[5] = 0xFF;
+    sensorScratchpad[6] = 0x0C;
+    sensorScratchpad[7] = 0x10;
+    sensorScratchpad[8] = crc8(sensorScratchpad, 8);
+    sensorRead = 0;
+  }
+}
+
+uint8_t OneWire::read()
+{
+  busy(8 * SLOT_MICROS);
+  if (sensorCommand != 0xBE || sensorRead >= sizeof(sensorScratchpad))
+    return 0xFF;
+  return sensorScratchpad[sensorRead++];
+}
+
+uint8_t OneWire::read_bit()
+{
+  busy(SLOT_MICROS);
+  if (sensorCommand != 0x44)
+    return 1;
+  if (simTime < sensorConversionDone)
+    return 0;
+  sensorMeasured = sensorTemperature;
+  return 1;
+}
+
+uint8_t OneWire::crc8(const uint8_t* data, uint8_t size)
+{
+  uint8_t crc = 0;
+  for (uint8_t i = 0; i < size; i++) {
+    uint8_t value = data[i];
+    for (int bit = 0; bit < 8; bit++) {
+      uint8_t mix = (crc ^ value) & 0x01;
+      crc >>= 1;
+      if (mix)
+        crc ^= 0x8C;
+      value >>= 1;
+    }
+  }
+  return crc;
+}
@@ -0,0 +1,105 @@
+// sim.h - Interface between the simulated controller and the scenarios which drive it
+//
+// The simulation keeps two clocks. simTime is the real time in microseconds since the simulation started.
+// The Timer0 clock behind millis() and micros() only runs while the I/O clock runs, so like the real
+// controller it stops in SLEEP_MODE_ADC and SLEEP_MODE_PWR_DOWN.
+//
+// Sleeping in a mode which stops the I/O clock while a byte is being sent corrupts that byte, as the
+// USART stops part way through it.
+//
+// Time only passes while the sketch sleeps, waits for a full serial buffer or busy waits on a register,
+// and for a fixed cost (simLoopMicros) each time around loop().
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+// The power states of the simulated controller
+enum SimPower { SIM_ACTIVE, SIM_IDLE, SIM_ADC, SIM_POWER_DOWN, SIM_POWER_STATES };
+
+// A change of an output pin
+struct SimPinChange
+{
+  uint64_t time;
+  uint8_t pin;
+  uint8_t value;
+};
+
+// A byte written to the serial port
+struct SimByte
+{
+  uint64_t time;
+  uint8_t value;
+};
+
+extern uint64_t simTime;                          // Real time since the simulation started (microseconds)
+extern uint64_t simLoopMicros;                    // The time taken by each pass through loop()
+extern uint64_t simLoops;                         // The number of times loop() has run
+extern uint64_t simLongestLoop;                   // The longest time one pass through loop() has kept the CPU busy
+extern uint64_t simPowerMicros[SIM_POWER_STATES]; // The time spent in each power state
+extern unsigned long simRxLost;                   // The number of received bytes lost while the serial port was stopped
+extern unsigned long simTxCorrupt;                // The number of bytes corrupted because the serial port stopped while sending them
+extern std::vector<SimPinChange> simPins;         // Every change of an output pin
+extern std::vector<SimByte> simSent;              // Every byte written to the serial port
+
+// simBoot - Reset the controller and run setup()
+// Params: startMicros - the Timer0 clock at boot, so millis() and micros() can start close to overflowing
+// Returns: Nothing
+void simBoot(uint64_t startMicros);
+
+// simReset - Reset the controller, as the reset pin or a brown out would, and run setup() again
+// Params: None
+// Returns: Nothing
+//
+// The EEPROM keeps its contents, and millis() and micros() start again from 0
+void simReset();
+
+// simRun - Run loop() repeatedly until the given time has passed
+// Params: duration - the time to run for (microseconds)
+// Returns: Nothing
+void simRun(uint64_t duration);
+
+// simFlow - Start or stop the pulses from a flow sensor
+// Params:
+//   period - the time between rising edges (microseconds), or 0 to stop the flow
+//   pin - the port D pin of the sensor (D2 is the sensor after the solenoid)
+// Returns: Nothing
+//
+// Each pulse is high for half the period, and every edge raises the pin change interrupt if the pin is enabled
+void simFlow(uint64_t period, uint8_t pin = 2);
+
+// simReceive - Start sending bytes to the controller through the bluetooth module
+// Params:
+//   data - the bytes to send
+//   size - the number of bytes
+// Returns: Nothing
+//
+// The bytes arrive at 9600 baud after any bytes already being sent. The bluetooth monitor pin is low while
+// a byte arrives. A byte which arrives while the serial port is stopped (asleep or converting) is lost.
+void simReceive(const uint8_t* data, size_t size);
+
+// simSetAnalog - Set the battery voltage seen by the ADC
+// Params: count - the ADC count (0 to 1023), which is read with a little noise
+// Returns: Nothing
+void simSetAnalog(unsigned int count);
+
+// simSetTemperature - Set the temperature measured by the DS18B20
+// Params: sixteenths - the temperature in 1/16 degrees C
+// Returns: Nothing
+void simSetTemperature(int sixteenths);
+
+// simPower - Return the current power state
+// Params: None
+// Returns: the power state
+SimPower simPower();
+
+// simMillis - Return the value millis() would return now
+// Params: None
+// Returns: the Timer0 clock in milliseconds
+uint32_t simMillis();
+
+// simInterruptAttached - Check whether a handler is attached to an external interrupt
+// Params: interrupt - the interrupt number (0 for INT0 on D2, 1 for INT1 on D3)
+// Returns: true if a handler is attached
+bool simInterruptAttached(uint8_t interrupt);
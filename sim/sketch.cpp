@@ -0,0 +1,6 @@
+// sketch.cpp - Compile shower_timer.ino for the host simulation
+// Like the Arduino builder, the Arduino core is included first, then the prototypes of the sketch's functions
+// (generated by the Makefile) so functions can be called before they are defined
+#include "Arduino.h"
+#include "prototypes.h"
+#include "../shower_timer.ino"
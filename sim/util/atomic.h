@@ -0,0 +1,7 @@
+// util/atomic.h - Atomic blocks for the host simulation
+// Interrupts are disabled for the block and the previous state is restored after it
+#pragma once
+
+#define ATOMIC_RESTORESTATE simInterruptsEnabled()
+#define ATOMIC_BLOCK(state) \
+  for (bool simRestore = state, simOnce = (simCli(), true); simOnce; simOnce = false, simRestore ? simSei() : (void)0)